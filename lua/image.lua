@@ -5,9 +5,10 @@
 local reg = debug.getregistry()
 
 local image_mt = reg["image"]
-local image_mt_funcs = image_mt["__index"]
+local image_mt_funcs = image_mt.methods
 
 local ceil = math.ceil
+local floor = math.floor
 local abs = math.abs
 
 local function hsl_to_rgb(h,s,l)
@@ -80,41 +81,6 @@ end
 
 image_mt_funcs.draw_rectangle_rgb = image_mt_funcs.draw_rectangle
 
-image_mt_funcs.stamp_letter = function(self,font,codepoint,scale,x,y,r,g,b,hloffset,hroffset,ytoffset,yboffset)
-
-  if not font.widths[codepoint] then
-    codepoint = 32
-  end
-
-  hloffset = hloffset or 0 -- "masks" the first pixels of the left of the string
-  hroffset = hroffset or 0 -- "masks" the end pixels of the right of the string
-  ytoffset = ytoffset or 0
-  yboffset = yboffset or 0
-  local pixel_hroffset = font.widths[codepoint] * scale - hroffset - 1
-  local pixel_yboffset = font.height * scale - yboffset - 1
-  local xcc
-  local ycc
-
-  for xc=1,font.widths[codepoint],1 do
-    for yc=font.height,1,-1 do
-      if font:pixel(codepoint,xc,yc) then
-        for xi=0,scale-1,1 do
-          for yi=0,scale-1,1 do
-            xcc = (xc - 1) * scale + xi
-            ycc = (yc - 1) * scale + yi
-            if xcc >= hloffset and xcc <= pixel_hroffset and
-               ycc >= ytoffset and ycc <= pixel_yboffset then
-              self:set_pixel(x+xcc,y+((yc - 1) * scale)+yi,r,g,b)
-            end
-          end
-        end
-      end
-    end
-  end
-
-  return font.widths[codepoint] * scale
-end
-
 local string_props = {
   'font',
   'scale',
@@ -167,44 +133,6 @@ image_mt_funcs.stamp_string_adv = function(self, str, props, userd)
 
 end
 
-image_mt_funcs.stamp_string = function(self,font,str,scale,x,y,r,g,b,max,lmask,rmask,tmask,bmask)
-  local lmask_applied = false
-  if not lmask then
-    lmask_applied = true
-  end
-
-  rmask = rmask or 0
-  tmask = tmask or 0
-  bmask = bmask or 0
-
-  tmask = tmask * scale
-  bmask = bmask * scale
-
-  local codepoints = font.utf8_to_table(str)
-
-  local xi = x
-  for _,codepoint in ipairs(codepoints) do
-    if not font.widths[codepoint] then
-      codepoint = 32
-    end
-    if lmask and lmask >= (font.widths[codepoint] * scale) then
-      lmask = lmask - (font.widths[codepoint] * scale)
-      xi = xi + (font.widths[codepoint] * scale)
-    else
-      if max and  xi + (font.widths[codepoint] * scale) > max then
-        rmask =  (font.widths[codepoint] * scale) - (max - xi)
-      end
-      xi = xi + self:stamp_letter(font,codepoint,scale,xi,y,r,g,b,
-        lmask_applied == false and lmask or 0,
-        rmask,tmask,bmask)
-      if lmask_applied == false then
-        lmask_applied = true
-        lmask = 0
-      end
-    end
-  end
-end
-
 image_mt_funcs.stamp_string_hsl = function(self,font,str,scale,x,y,h,s,l,max,lmask,rmask,tmask,bmask)
   local r, g, b = hsl_to_rgb(h,s,l)
   return self:stamp_string(font,str,scale,x,y,r,g,b,max,lmask,rmask,tmask,bmask)
@@ -254,10 +182,125 @@ image_load (const char *filename, unsigned int *width, unsigned int *height, uns
 void
 image_blend(uint8_t *dst, uint8_t *src, unsigned int len, uint8_t a);
 
+void
+image_blend_mode(uint8_t *dst, const uint8_t *src, unsigned int len, uint8_t a, unsigned int mode);
+
+void
+image_blend_rgba(uint8_t *dst, const uint8_t *src, unsigned int pixels, uint8_t a);
+
+void
+image_stamp(
+  uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const uint8_t *src, unsigned int src_width, unsigned int src_height, unsigned int src_channels,
+  int x, int y, unsigned int flags,
+  int mask_left, int mask_right, int mask_top, int mask_bottom,
+  int alpha);
+
+int
+image_fill(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+int
+image_gradient_linear(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  int x1, int y1, int x2, int y2, const uint8_t *from, const uint8_t *to, unsigned int vertical);
+
+int
+image_gradient_radial(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  int x, int y, unsigned int radius, const uint8_t *from, const uint8_t *to);
+
+enum IMAGE_CMD {
+    IMAGE_CMD_RECTANGLE,
+    IMAGE_CMD_PIXEL,
+    IMAGE_CMD_STAMP,
+    IMAGE_CMD_MASK,
+};
+
+typedef struct image_cmd {
+    unsigned int type;
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+    uint8_t a;
+    const uint8_t *src;
+    unsigned int src_width;
+    unsigned int src_height;
+    unsigned int src_channels;
+    unsigned int flags;
+    int mask_left;
+    int mask_right;
+    int mask_top;
+    int mask_bottom;
+    int alpha;
+} image_cmd;
+
+void
+image_draw(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const image_cmd *cmds, unsigned int count);
+
+struct font;
+
+typedef struct font_glyph {
+    uint32_t codepoint;
+    unsigned int width;
+    unsigned int offset;
+} font_glyph;
+
+typedef struct font_mask {
+    uint32_t codepoint;
+    unsigned int scale;
+    unsigned int width;
+    unsigned int height;
+    uint8_t *mask;
+} font_mask;
+
+typedef struct lua_font {
+    struct font *font;
+    int widths_ref;
+    int bitmaps_ref;
+} lua_font;
+
+const font_glyph *
+font_glyph_find(const struct font *f, uint32_t codepoint);
+
+const font_mask *
+font_glyph_mask(struct font *f, const font_glyph *g, unsigned int scale);
+
+uint8_t *
+font_mask_ref(const font_mask *m);
+
+void
+font_mask_unref(const uint8_t *mask);
+
 void
 visualizer_set_image_cb(void *vis,void (*)(void *L, intptr_t table_ref, unsigned int frames, uint8_t *image));
+
+typedef struct image_frame {
+    uint8_t *image;
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels;
+    unsigned int stride;
+    unsigned int image_len;
+    unsigned int owned;
+} image_frame;
 ]]
 
+local frame_t = ffi.typeof("image_frame *")
+
+-- frames are userdata with an image_frame header, reading it
+-- directly skips the __index metamethod. older table frames are
+-- used as-is
+local function frame(t)
+  if type(t) == 'userdata' then
+    return ffi.cast(frame_t,t)
+  end
+  return t
+end
+
 local function load_image_mem_chunk(t_image,frames,img)
   local x = t_image.width
   local y = t_image.height
@@ -268,8 +311,8 @@ local function load_image_mem_chunk(t_image,frames,img)
 
   for i=0,frames-1,1 do
     local chunk = img + (i * (x * y * c)) + (i * 2)
-    local frame = ffi.new("uint8_t[?]",x * y * c)
-    ffi.C.memcpy(frame,chunk,x*y*c)
+    local fr = image.frame(x,y,c)
+    ffi.C.memcpy(frame(fr).image,chunk,x*y*c)
 
     if frames > 1 then
       chunk = chunk + (x * y * c)
@@ -283,16 +326,7 @@ local function load_image_mem_chunk(t_image,frames,img)
       t_image.delays[i+1] = 0
     end
 
-    t_image.frames[i+1] = {
-      image = frame,
-      width = x,
-      height = y,
-      channels = c,
-      image_len = x * y * c,
-      image_state = ffi.C.IMAGE_FIXED,
-      state = "fixed",
-    }
-    setmetatable(t_image.frames[i+1],image_mt)
+    t_image.frames[i+1] = fr
   end
 
   t_image.image_state = ffi.C.IMAGE_LOADED
@@ -320,9 +354,7 @@ local function image_cb(lua,table_ref,frames,img)
 end
 
 image_mt_funcs.draw_rectangle = function(self,x1,y1,x2,y2,r,g,b,a)
-  local xstart, xend
-  local ystart, yend
-
+  local f = frame(self)
   a = a or 255
 
   if(r < 0 or b < 0 or g < 0 or a < 0 or
@@ -334,81 +366,62 @@ image_mt_funcs.draw_rectangle = function(self,x1,y1,x2,y2,r,g,b,a)
     return true
   end
 
-  if x1 <= x2 then
-    xstart = x1
-    xend = x2
-  else
-    xstart = x2
-    xend = x1
+  if not f.image then
+    return false
   end
 
-  if y1 <= y2 then
-    ystart = y1
-    yend = y2
-  else
-    ystart = y2
-    yend = y1
-  end
+  return ffi.C.image_fill(f.image,f.width,f.height,f.channels,
+    x1,y1,x2,y2,r,g,b,a) == 1
+end
 
-  if xend < 1 then
-    return
-  end
+local gradient_from = ffi.new("uint8_t[4]")
+local gradient_to = ffi.new("uint8_t[4]")
 
-  if yend < 1 then
-    return
+local function gradient_color(c,t)
+  if type(t) ~= 'table' then
+    return false
   end
-
-  if xstart > self.width then
-    return
+  for i=1,4 do
+    local v = t[i] or 255
+    if v < 0 or v > 255 then
+      return false
+    end
+    c[i-1] = v
   end
+  return true
+end
 
-  if ystart > self.height then
-    return
+image_mt_funcs.draw_linear_gradient = function(self,x1,y1,x2,y2,from,to,direction)
+  local f = frame(self)
+  direction = direction or "horizontal"
+  if not gradient_color(gradient_from,from) or not gradient_color(gradient_to,to) then
+    return nil, "Colors must be {r,g,b,[a]} tables with values 0 - 255"
   end
-
-  if xstart < 1 then
-    xstart = 1
+  if direction ~= "horizontal" and direction ~= "vertical" then
+    return nil, "Unknown gradient direction"
   end
-
-  if ystart < 1 then
-    ystart = 1
+  if not f.image then
+    return false
   end
+  return ffi.C.image_gradient_linear(f.image,f.width,f.height,f.channels,
+    x1,y1,x2,y2,gradient_from,gradient_to,direction == "vertical" and 1 or 0) == 1
+end
 
-  if xend > self.width then
-    xend = self.width
+image_mt_funcs.draw_radial_gradient = function(self,x,y,radius,from,to)
+  local f = frame(self)
+  -- same limits as the C binding, the FFI would truncate these
+  if radius < 0 or radius > 0xffffffff or
+     x < -0x80000000 or x > 0x7fffffff or y < -0x80000000 or y > 0x7fffffff then
+    return false
   end
-
-  if yend > self.height then
-    yend = self.height
+  if not gradient_color(gradient_from,from) or not gradient_color(gradient_to,to) then
+    return nil, "Colors must be {r,g,b,[a]} tables with values 0 - 255"
   end
-
-  ystart, yend = yend, ystart
-
-  xstart = xstart - 1
-  xend = xend - 1
-  ystart = self.height - ystart
-  yend = self.height - yend
-
-  local alpha = 1 + a
-  local alpha_inv = 256 - a
-
-  for x=xstart,xend,1 do
-    for y=ystart,yend,1 do
-      local index = (y * self.width * self.channels) + (x * self.channels)
-
-      if a == 255 then
-        self.image[index] = b
-        self.image[index + 1] = g
-        self.image[index + 2] = r
-      end
-
-      self.image[index]   = rshift( ((self.image[index] * alpha_inv) + (b * alpha)), 8)
-      self.image[index+1] = rshift( ((self.image[index+1] * alpha_inv) + (g * alpha)), 8)
-      self.image[index+2] = rshift( ((self.image[index+2] * alpha_inv) + (r * alpha)), 8)
-    end
+  if not f.image then
+    return false
   end
-
-  return true
+  return ffi.C.image_gradient_radial(f.image,f.width,f.height,f.channels,
+    x,y,radius,gradient_from,gradient_to) == 1
 end
 
 image.new = function(filename,width,height,channels)
@@ -439,17 +452,10 @@ image.new = function(filename,width,height,channels)
     img.image_state = ffi.C.IMAGE_UNLOADED
     img.state = "unloaded"
   else
+    img.image_state = ffi.C.IMAGE_FIXED
+    img.state = "fixed"
     img.frames = {}
-    img.frames[1] = {
-        image_state = ffi.C.IMAGE_FIXED,
-        image_len = img.width * img.height * img.channels,
-        state = "fixed",
-        image = ffi.new("uint8_t[?]",img.width * img.height * img.channels),
-        width = img.width,
-        height = img.height,
-        channels = img.channels,
-    }
-    setmetatable(img.frames[1],image_mt)
+    img.frames[1] = image.frame(img.width,img.height,img.channels)
   end
 
   setmetatable(img,image_c_mt)
@@ -457,17 +463,41 @@ image.new = function(filename,width,height,channels)
   return img
 end
 
-image_mt_funcs.blend = function(self,b,a)
-  if self.image_len ~= b.image_len then
+local blend_modes = {
+  alpha = 0,
+  add = 1,
+  multiply = 2,
+}
+
+image_mt_funcs.blend = function(self,b,a,mode)
+  local f = frame(self)
+  local src = frame(b)
+  local m = blend_modes[mode or "alpha"]
+  if not m then
+    return nil, "Unknown blend mode"
+  end
+  if a <= 0 then
     return
   end
-  ffi.C.image_blend(self.image,b.image,self.image_len,a)
+  if a > 255 then
+    a = 255
+  end
+  if f.image_len == src.image_len then
+    ffi.C.image_blend_mode(f.image,src.image,f.image_len,a,m)
+    return true
+  end
+  if m == 0 and f.channels == 3 and src.channels == 4 and
+     f.width == src.width and f.height == src.height then
+    ffi.C.image_blend_rgba(f.image,src.image,f.width * f.height,a)
+    return true
+  end
 end
 
 image_mt_funcs.set_pixel = function(self,x,y,r,g,b,a)
+  local f = frame(self)
   if not x or not y or not r or not g or not b then return false end
 
-  if(x < 1 or y < 1 or x > self.width or y > self.width) then
+  if(x < 1 or y < 1 or x > f.width or y > f.height) then
     return false
   end
   a = a or 255
@@ -482,42 +512,43 @@ image_mt_funcs.set_pixel = function(self,x,y,r,g,b,a)
   end
 
   x = x - 1
-  y = self.height - y
+  y = f.height - y
 
-  local index = (y * self.width * self.channels) + (x * self.channels)
+  local index = (y * f.width * f.channels) + (x * f.channels)
 
   if a == 255 then
-    self.image[index] = b
-    self.image[index + 1] = g
-    self.image[index + 2] = r
+    f.image[index] = b
+    f.image[index + 1] = g
+    f.image[index + 2] = r
     return true
   end
 
   local alpha = 1 + a
   local alpha_inv = 256 - a
 
-  self.image[index]   = rshift( ((self.image[index] * alpha_inv) + (b * alpha)), 8)
-  self.image[index+1] = rshift( ((self.image[index+1] * alpha_inv) + (g * alpha)), 8)
-  self.image[index+2] = rshift( ((self.image[index+2] * alpha_inv) + (r * alpha)), 8)
+  f.image[index]   = rshift( ((f.image[index] * alpha_inv) + (b * alpha)), 8)
+  f.image[index+1] = rshift( ((f.image[index+1] * alpha_inv) + (g * alpha)), 8)
+  f.image[index+2] = rshift( ((f.image[index+2] * alpha_inv) + (r * alpha)), 8)
 
   return true
 end
 
 image_mt_funcs.get_pixel = function(self,x,y)
-  if x < 1 or y < 1 or x > self.width or y > self.height then
+  local f = frame(self)
+  if x < 1 or y < 1 or x > f.width or y > f.height then
     return nil
   end
   local r, g, b, a
   x = x - 1
-  y = self.height - y
-  index = (y * self.width * self.channels) + (x * self.channels)
+  y = f.height - y
+  local index = (y * f.width * f.channels) + (x * f.channels)
 
-  b = self.image[index]
-  g = self.image[index+1]
-  r = self.image[index+2]
+  b = f.image[index]
+  g = f.image[index+1]
+  r = f.image[index+2]
 
-  if self.channels == 4 then
-    a = self.image[index+3]
+  if f.channels == 4 then
+    a = f.image[index+3]
   else
     a = 255
   end
@@ -526,98 +557,36 @@ image_mt_funcs.get_pixel = function(self,x,y)
 end
 
 image_mt_funcs.stamp_image = function(self,img,x,y,flip,mask,alpha)
+  local f = frame(self)
+  local src = frame(img)
+  local flags = 0
+  if not f.image or not src.image then
+    return
+  end
   x = x or 1
   y = y or 1
   flip = flip or {}
   mask = mask or {}
 
-  local xi = 1
-  local yi = 1
-
-  local xm = img.width
-  local ym = img.height
-
-  local xt, yt, dxt, dyt, aa, aa_inv
-
-  if x < 1 then
-    xi = xi + abs(x) + 1
+  if flip.hflip then
+    flags = flags + 1
   end
-  if y < 1 then
-    yi = yi + abs(y) + 1
+  if flip.vflip then
+    flags = flags + 2
   end
 
-
-  if mask.left then
-    xi = xi + mask.left
-  end
-  if mask.right then
-    xm = xm - mask.right
-  end
-  if mask.top then
-    yi = yi + mask.top
+  if not alpha or alpha < 0 then
+    alpha = -1
+  elseif alpha > 255 then
+    alpha = 255
   end
-  if mask.bottom then
-    ym = ym - mask.bottom
-  end
-
-  for yii=yi,ym,1 do
-    for xii=xi,xm, 1 do
-      xt, yt = xii, yii
-
-      if flip.hflip then
-        xt = img.width - xii + 1
-      end
-
-      if flip.vflip then
-        yt = img.height - yii + 1
-      end
 
-      dxt = x - 1 + xii
-      dyt = y - 1 + yii
-
-      if dxt <= self.width and dyt <= self.height then
-        xt = xt - 1
-        yt = img.height - yt
-
-        dxt = dxt - 1
-        dyt = self.height - dyt
-
-        local byte = (yt * img.width * img.channels) + (xt * img.channels)
-        local r, g, b, a
-
-        if img.channels == 4 then
-          a = img.image[byte + 3]
-        else
-          a = 255
-        end
-
-        if a > 0 then
-
-          if alpha then
-            a = alpha
-          end
-
-          b = img.image[byte]
-          g = img.image[byte + 1]
-          r = img.image[byte + 2]
-
-          byte = (dyt * self.width * self.channels) + (dxt * self.channels)
-
-          if a == 255 then
-            self.image[byte] = b
-            self.image[byte+1] = g
-            self.image[byte+2] = r
-          else
-            aa = 1 + a
-            aa_inv = 256 - a
-            self.image[byte]   = rshift( ((self.image[byte] * aa_inv) + (b * aa)), 8)
-            self.image[byte+1] = rshift( ((self.image[byte+1] * aa_inv) + (g * aa)), 8)
-            self.image[byte+2] = rshift( ((self.image[byte+2] * aa_inv) + (r * aa)), 8)
-          end
-        end
-      end
-    end
-  end
+  ffi.C.image_stamp(
+    f.image, f.width, f.height, f.channels,
+    src.image, src.width, src.height, src.channels,
+    x, y, flags,
+    mask.left or 0, mask.right or 0, mask.top or 0, mask.bottom or 0,
+    alpha)
 end
 
 
@@ -668,8 +637,223 @@ image_c_funcs.unload = function(self)
 end
 
 image_mt_funcs.set = function(self,a)
-  if self.image_len ~= a.image_len then return end
-  ffi.C.memcpy(self.image,a.image,self.image_len)
+  local f = frame(self)
+  local src = frame(a)
+  if f.image_len ~= src.image_len then return end
+  ffi.C.memcpy(f.image,src.image,f.image_len)
+end
+
+local batch_funcs = {}
+local batch_mt = { __index = batch_funcs }
+
+image.batch = function()
+  local b = {
+    cmds = ffi.new("image_cmd[?]",64),
+    len = 0,
+    size = 64,
+    sources = {},
+  }
+  return setmetatable(b,batch_mt)
+end
+
+local function batch_push(b)
+  if b.len == b.size then
+    local cmds = ffi.new("image_cmd[?]",b.size * 2)
+    ffi.copy(cmds,b.cmds,ffi.sizeof("image_cmd") * b.len)
+    b.cmds = cmds
+    b.size = b.size * 2
+  end
+  local c = b.cmds[b.len]
+  b.len = b.len + 1
+  return c
+end
+
+batch_funcs.draw_rectangle = function(self,x1,y1,x2,y2,r,g,b,a)
+  a = a or 255
+  if(r < 0 or b < 0 or g < 0 or a < 0 or
+     r > 255 or b > 255 or g > 255 or a > 255) then
+     return false
+  end
+  if a == 0 then
+    return true
+  end
+  local c = batch_push(self)
+  c.type = ffi.C.IMAGE_CMD_RECTANGLE
+  c.x1, c.y1, c.x2, c.y2 = x1, y1, x2, y2
+  c.r, c.g, c.b, c.a = r, g, b, a
+  return true
+end
+
+batch_funcs.set_pixel = function(self,x,y,r,g,b,a)
+  a = a or 255
+  if(r < 0 or b < 0 or g < 0 or a < 0 or
+     r > 255 or b > 255 or g > 255 or a > 255) then
+     return false
+  end
+  if a == 0 then
+    return true
+  end
+  local c = batch_push(self)
+  c.type = ffi.C.IMAGE_CMD_PIXEL
+  c.x1, c.y1 = x, y
+  c.r, c.g, c.b, c.a = r, g, b, a
+  return true
+end
+
+batch_funcs.stamp_image = function(self,img,x,y,flip,mask,alpha)
+  local src = frame(img)
+  if not src.image then
+    return false
+  end
+  flip = flip or {}
+  mask = mask or {}
+  local flags = 0
+  if flip.hflip then
+    flags = flags + 1
+  end
+  if flip.vflip then
+    flags = flags + 2
+  end
+  if not alpha or alpha < 0 then
+    alpha = -1
+  elseif alpha > 255 then
+    alpha = 255
+  end
+  local c = batch_push(self)
+  c.type = ffi.C.IMAGE_CMD_STAMP
+  c.x1, c.y1 = x or 1, y or 1
+  c.src = src.image
+  c.src_width, c.src_height, c.src_channels = src.width, src.height, src.channels
+  c.flags = flags
+  c.mask_left, c.mask_right = mask.left or 0, mask.right or 0
+  c.mask_top, c.mask_bottom = mask.top or 0, mask.bottom or 0
+  c.alpha = alpha
+  self.sources[self.len] = img
+  return true
+end
+
+-- FONT_SCALE_MAX in font.h
+local font_scale_max = 256
+
+-- glyph positions are kept well inside an int, like the C batch
+local batch_max = 0x3fffffff
+
+local lua_font_t = ffi.typeof("lua_font *")
+
+local function batch_font(fnt)
+  if type(fnt) ~= 'userdata' or getmetatable(fnt) ~= reg["font"] then
+    error("bad argument, font expected",3)
+  end
+  local f = ffi.cast(lua_font_t,fnt).font
+  if f == nil then
+    error("font has been freed",3)
+  end
+  return f
+end
+
+local function text_mask(v,max)
+  if v <= 0 then return 0 end
+  if v >= max then return max end
+  return ceil(v)
+end
+
+-- queues one glyph's cached mask and returns its advance, same rules
+-- as frame:stamp_letter. each command holds a reference to the mask
+-- until the batch is cleared, the cache can drop it in the meantime
+local function batch_glyph(self,f,codepoint,scale,x,y,r,g,b,lmask,rmask,tmask,bmask)
+  local glyph = ffi.C.font_glyph_find(f,codepoint)
+  if glyph == nil then
+    glyph = ffi.C.font_glyph_find(f,32)
+  end
+  if glyph == nil or scale < 1 or scale > font_scale_max then
+    return 0
+  end
+
+  if r >= 0 and r <= 255 and g >= 0 and g <= 255 and b >= 0 and b <= 255 and
+     x <= batch_max and y <= batch_max then
+    local m = ffi.C.font_glyph_mask(f,glyph,scale)
+    if m ~= nil and x > -m.width and y > -m.height then
+      local src = ffi.gc(ffi.C.font_mask_ref(m),ffi.C.font_mask_unref)
+      local c = batch_push(self)
+      c.type = ffi.C.IMAGE_CMD_MASK
+      c.x1, c.y1 = x, y
+      c.r, c.g, c.b, c.a = r, g, b, 255
+      c.src = src
+      c.src_width, c.src_height = m.width, m.height
+      c.mask_left, c.mask_right = text_mask(lmask,m.width), text_mask(rmask,m.width)
+      c.mask_top, c.mask_bottom = text_mask(tmask,m.height), text_mask(bmask,m.height)
+      self.sources[self.len] = src
+    end
+  end
+
+  return glyph.width * scale
+end
+
+batch_funcs.stamp_letter = function(self,fnt,codepoint,scale,x,y,r,g,b,lmask,rmask,tmask,bmask)
+  local f = batch_font(fnt)
+  return batch_glyph(self,f,codepoint,floor(scale),x,y,r,g,b,
+    lmask or 0,rmask or 0,tmask or 0,bmask or 0)
+end
+
+batch_funcs.stamp_string = function(self,fnt,str,scale,x,y,r,g,b,max,lmask,rmask,tmask,bmask)
+  local f = batch_font(fnt)
+  scale = floor(scale)
+  if scale < 1 or scale > font_scale_max then
+    return
+  end
+
+  local has_lmask = lmask ~= nil
+  local lmask_applied = not has_lmask
+  lmask = lmask or 0
+  rmask = rmask or 0
+  tmask = (tmask or 0) * scale
+  bmask = (bmask or 0) * scale
+
+  for _,codepoint in ipairs(font.utf8_to_table(str)) do
+    local glyph = ffi.C.font_glyph_find(f,codepoint)
+    if glyph == nil then
+      glyph = ffi.C.font_glyph_find(f,32)
+    end
+    local cw = glyph == nil and 0 or glyph.width * scale
+
+    -- lmask skips whole letters first, then trims the first one drawn
+    if has_lmask and lmask >= cw then
+      lmask = lmask - cw
+      x = x + cw
+    else
+      if max and x >= max then
+        break
+      end
+      if x > batch_max then
+        break
+      end
+      if max and x + cw > max then
+        rmask = cw - (max - x)
+      end
+      x = x + batch_glyph(self,f,codepoint,scale,x,y,r,g,b,
+        lmask_applied and 0 or lmask,rmask,tmask,bmask)
+      lmask_applied = true
+      lmask = 0
+    end
+  end
+end
+
+batch_funcs.clear = function(self)
+  self.len = 0
+  self.sources = {}
+end
+
+batch_funcs.count = function(self)
+  return self.len
+end
+
+image_mt_funcs.draw_batch = function(self,b)
+  local f = frame(self)
+  if not f.image then
+    return false
+  end
+  ffi.C.image_draw(f.image,f.width,f.height,f.channels,b.cmds,b.len)
+  return true
 end
 
 local args = {...}
@@ -10,10 +10,42 @@ stream.draw_rectangle_hsl = function(self,x1,y1,x2,y2,h,s,l,a)
   return self.video:draw_rectangle_hsl(x1,y1,x2,y2,h,s,l,a)
 end
 
+stream.draw_linear_gradient = function(self,x1,y1,x2,y2,from,to,direction)
+  return self.video:draw_linear_gradient(x1,y1,x2,y2,from,to,direction)
+end
+
+stream.draw_radial_gradient = function(self,x,y,radius,from,to)
+  return self.video:draw_radial_gradient(x,y,radius,from,to)
+end
+
+stream.draw_line = function(self,x1,y1,x2,y2,r,g,b,a,thickness)
+  return self.video:draw_line(x1,y1,x2,y2,r,g,b,a,thickness)
+end
+
+stream.draw_polyline = function(self,points,r,g,b,a,thickness,closed)
+  return self.video:draw_polyline(points,r,g,b,a,thickness,closed)
+end
+
+stream.draw_polygon = function(self,points,r,g,b,a)
+  return self.video:draw_polygon(points,r,g,b,a)
+end
+
+stream.draw_circle = function(self,x,y,radius,r,g,b,a,thickness)
+  return self.video:draw_circle(x,y,radius,r,g,b,a,thickness)
+end
+
+stream.draw_arc = function(self,x,y,radius,start,finish,r,g,b,a,thickness)
+  return self.video:draw_arc(x,y,radius,start,finish,r,g,b,a,thickness)
+end
+
 stream.stamp_string_adv = function(self,str,props,userd)
   return self.video:stamp_string_adv(str,props,userd)
 end
 
+stream.stamp_string_fx = function(self,str,fx)
+  return self.video:stamp_string_fx(str,fx)
+end
+
 stream.stamp_string = function(self,font,str,scale,x,y,r,g,b,max,lmask,rmask,tmask,bmask)
   return self.video:stamp_string(font,str,scale,x,y,r,g,b,max,lmask,rmask,tmask,bmask)
 end
@@ -42,12 +74,50 @@ stream.stamp_image = function(self,b,x,y,flip,mask,alpha)
   return self.video:stamp_image(b,x,y,flip,mask,alpha)
 end
 
-stream.blend = function(self,b,alpha)
-  return self.video:blend(b,alpha)
+stream.blend = function(self,b,alpha,mode)
+  return self.video:blend(b,alpha,mode)
+end
+
+stream.draw_batch = function(self,b)
+  return self.video:draw_batch(b)
 end
 
 local ok, ffi = pcall(require,'ffi')
 if ok then
-  stream.video.image = ffi.cast("uint8_t *",stream.video.image)
+  -- audio arrays are offset by one so indexing starts at 1, like with plain Lua
+  local float_ptr = ffi.typeof("const " .. stream.audio.float_type .. " *")
+  local waveform = stream.audio.waveform
+  waveform.mono = ffi.cast(float_ptr,waveform.mono:pointer()) - 1
+  for i=1,#waveform do
+    waveform[i] = ffi.cast(float_ptr,waveform[i]:pointer()) - 1
+  end
+  local vectorscope = stream.audio.vectorscope
+  vectorscope.x = ffi.cast(float_ptr,vectorscope.x:pointer()) - 1
+  vectorscope.y = ffi.cast(float_ptr,vectorscope.y:pointer()) - 1
+
+  -- called again whenever the analysis is reconfigured
+  stream.audio.map_arrays = function(self)
+    local arrays = self:arrays()
+    self.amps = ffi.cast(float_ptr,arrays.amps:pointer()) - 1
+    self.peaks = ffi.cast(float_ptr,arrays.peaks:pointer()) - 1
+    self.freqs = ffi.cast(float_ptr,arrays.freqs:pointer()) - 1
+    self.harmonic = arrays.harmonic and ffi.cast(float_ptr,arrays.harmonic:pointer()) - 1
+    self.percussive = arrays.percussive and ffi.cast(float_ptr,arrays.percussive:pointer()) - 1
+    self.substeps = ffi.cast(float_ptr,arrays.substeps:pointer()) - 1
+    self.current = arrays.current and ffi.cast(float_ptr,arrays.current:pointer()) - 1 or self.amps
+
+    -- raw ring, 0-based: spectrogram_data[row * width + band - 1]
+    local spectrogram = self.spectrogram:pointer()
+    if spectrogram then
+      if self.spectrogram.format == "float" then
+        self.spectrogram_data = ffi.cast("const float *",spectrogram)
+      else
+        self.spectrogram_data = ffi.cast("const uint8_t *",spectrogram)
+      end
+    else
+      self.spectrogram_data = nil
+    end
+  end
+  stream.audio:map_arrays()
 end
 
@@ -1,5 +1,6 @@
 #include <skalibs/strerr.h>
 #include <string.h>
+#include <assert.h>
 #include <stdlib.h>
 #include <math.h>
 #include <unistd.h>
@@ -13,6 +14,61 @@
 #define AMP_MAX 70.0f
 #define AMP_MIN 70.0f
 #define AMP_BOOST 1.8f
+/* how fast peaks fall, per second */
+#define PEAK_FALL 0.5f
+
+/* range folded into the chromagram, also limited to where bins are
+ * narrower than a semitone */
+#define CHROMA_FREQ_MIN 65.0f
+#define CHROMA_FREQ_MAX 5000.0f
+/* time constants, in seconds */
+#define CHROMA_SMOOTH 0.25f
+#define CHROMA_KEY_SMOOTH 8.0f
+
+/* loudness is reported down to the BS.1770 absolute gate */
+#define LUFS_MIN -70.0f
+#define LUFS_MOMENTARY 0.4f
+#define LUFS_SHORT 3.0f
+
+/* spectral kernel weights below this fraction of the peak are dropped */
+#define CQT_SPARSITY 0.0054f
+/* shortest constant-Q kernel, in samples */
+#define CQT_MIN_LEN 16
+
+/* magnitudes are compressed with log(1 + ONSET_COMPRESSION * mag) before flux */
+#define ONSET_COMPRESSION 1000.0f
+/* how long the onset normalization takes to fall by half, in seconds */
+#define ONSET_HALFLIFE 4.0f
+/* a beat needs to beat the recent average onset by this much */
+#define ONSET_THRESHOLD_MULT 1.5f
+#define ONSET_THRESHOLD_DELTA 0.05f
+/* window for that average, in seconds */
+#define ONSET_THRESHOLD_WINDOW 0.5f
+/* shortest gap between beats, in seconds */
+#define ONSET_MIN_GAP 0.1f
+/* onset envelope kept for tempo tracking, in seconds */
+#define TEMPO_HISTORY 8.0f
+#define TEMPO_MIN 60.0f
+#define TEMPO_MAX 200.0f
+/* tempos near this one are preferred, to avoid half/double tempo jumps */
+#define TEMPO_PREFERRED 120.0f
+
+#ifdef AUDIO_FLOAT
+#define audio_cabs(x) cabsf(x)
+#define audio_log10(x) log10f(x)
+#define audio_log1p(x) log1pf(x)
+#define audio_creal(x) crealf(x)
+#define audio_cimag(x) cimagf(x)
+#else
+#define audio_cabs(x) cabs(x)
+#define audio_log10(x) log10(x)
+#define audio_log1p(x) log1p(x)
+#define audio_creal(x) creal(x)
+#define audio_cimag(x) cimag(x)
+#endif
+
+/* squared magnitude, for when only comparisons or power are needed */
+#define audio_cnorm(x) (audio_creal(x) * audio_creal(x) + audio_cimag(x) * audio_cimag(x))
 
 #ifdef __cplusplus
 extern "C" {
@@ -57,219 +113,1532 @@ static double window_blackman_harris(int i, int n) {
     return 0.35875 - 0.48829*cos(a*i) + 0.14128*cos(2*a*i) - 0.01168*cos(3*a*i);
 }
 
-static double find_amplitude_low(fftw_complex *out, unsigned int start, unsigned int end, unsigned int chunk_len) {
+/* indexed by enum AUDIO_WINDOW */
+static double (* const window_funcs[])(int, int) = {
+    window_blackman_harris,
+    window_blackman,
+    window_hann,
+    window_none,
+};
+
+static const char * const window_names[] = {
+    "blackman-harris",
+    "blackman",
+    "hann",
+    "none",
+    NULL,
+};
+
+static const char * const scale_names[] = {
+    "log",
+    "linear",
+    NULL,
+};
+
+static const char * const engine_names[] = {
+    "fft",
+    "cqt",
+    NULL,
+};
+
+static const char * const hop_mode_names[] = {
+    "max",
+    "mean",
+    NULL,
+};
+
+static const char * const spectrogram_format_names[] = {
+    "u8",
+    "float",
+    NULL,
+};
+
+static int name_scan(const char * const *names, const char *s, unsigned int *val) {
+    unsigned int i = 0;
+    for(i=0;names[i] != NULL;i++) {
+        if(strcmp(names[i],s) == 0) {
+            *val = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int audio_window_scan(const char *s, unsigned int *window) {
+    return name_scan(window_names,s,window);
+}
+
+int audio_scale_scan(const char *s, unsigned int *scale) {
+    return name_scan(scale_names,s,scale);
+}
+
+int audio_engine_scan(const char *s, unsigned int *engine) {
+    return name_scan(engine_names,s,engine);
+}
+
+int audio_hop_mode_scan(const char *s, unsigned int *mode) {
+    return name_scan(hop_mode_names,s,mode);
+}
+
+int audio_spectrogram_format_scan(const char *s, unsigned int *format) {
+    return name_scan(spectrogram_format_names,s,format);
+}
+
+static unsigned int plan_flags(unsigned int effort) {
+    switch(effort) {
+        case AUDIO_PLAN_ESTIMATE: return FFTW_ESTIMATE;
+        case AUDIO_PLAN_PATIENT: return FFTW_PATIENT;
+        default: break;
+    }
+    return FFTW_MEASURE;
+}
+
+static int audio_analysis_plan(audio_processor *processor, audio_analysis *a) {
+    /* planning with anything but FFTW_ESTIMATE overwrites the arrays,
+     * so this has to happen before the buffers are zeroed */
+    int n = (int)a->chunk_len;
+
+    if(processor->wisdom_file && access(processor->wisdom_file,R_OK) == 0) {
+        if(!AUDIO_FFTW(import_wisdom_from_filename)(processor->wisdom_file)) {
+            strerr_warn2x("warning: unable to import FFTW wisdom from ",processor->wisdom_file);
+        }
+    }
+
+    a->plan = AUDIO_FFTW(plan_many_dft_r2c)(1,&n,(int)a->hops,
+      a->fftw_in,NULL,1,(int)a->chunk_len,
+      a->fftw_out,NULL,1,(int)a->fftw_len,
+      plan_flags(processor->plan_effort));
+    if(!a->plan) {
+        strerr_warn1x("error: unable to create FFTW plan");
+        return 0;
+    }
+
+    if(processor->wisdom_file) {
+        if(!AUDIO_FFTW(export_wisdom_to_filename)(processor->wisdom_file)) {
+            strerr_warn2x("warning: unable to export FFTW wisdom to ",processor->wisdom_file);
+        }
+    }
+    return 1;
+}
+
+static audio_float find_amplitude_low(audio_complex *out, unsigned int start, unsigned int end, unsigned int chunk_len) {
     (void)end;
-    return 20.0f * log10(2.0f * cabs(out[start]) / chunk_len);
+    return 20.0f * audio_log10(2.0f * audio_cabs(out[start]) / chunk_len);
 }
 
-static double find_amplitude_mid(fftw_complex *out, unsigned int start, unsigned int end, unsigned int chunk_len) {
+static audio_float find_amplitude_mid(audio_complex *out, unsigned int start, unsigned int end, unsigned int chunk_len) {
     unsigned int mid = start + ((end - start) / 2);
-    return 20.0f * log10(2.0f * cabs(out[mid]) / chunk_len);
+    return 20.0f * audio_log10(2.0f * audio_cabs(out[mid]) / chunk_len);
 }
 
-static double find_amplitude_avg(fftw_complex *out, unsigned int start, unsigned int end, unsigned int chunk_len) {
+static audio_float find_amplitude_avg(audio_complex *out, unsigned int start, unsigned int end, unsigned int chunk_len) {
     unsigned int i;
     unsigned int len = end - start;
-    double avg = 0.0f;
+    audio_float avg = 0.0f;
     for(i=start;i<=end;i++) {
-        avg += 20.0f * log10(2.0f * cabs(out[i]) / chunk_len);
+        avg += 20.0f * audio_log10(2.0f * audio_cabs(out[i]) / chunk_len);
     }
     return avg / len;
 
 }
 
-static double find_amplitude_max(fftw_complex *out, unsigned int start, unsigned int end, unsigned int chunk_len) {
+static audio_float find_amplitude_max(audio_complex *out, unsigned int start, unsigned int end, unsigned int chunk_len) {
     unsigned int i = 0;
-    double val = -INFINITY;
-    double tmp = 0.0f;
+    audio_float val = 0.0f;
+    /* the dB scale is monotonic, so only the loudest bin needs converting:
+     * 20 * log10(2 * |x| / n) == 10 * log10(4 * |x|^2 / n^2) */
     for(i=start;i<=end;i++) {
-        tmp = 20.0f * log10(2.0f * cabs(out[i]) / chunk_len);
-        /* see https://groups.google.com/d/msg/comp.dsp/cZsS1ftN5oI/rEjHXKTxgv8J */
-        val = audio_max(tmp,val);
+        val = audio_max(audio_cnorm(out[i]),val);
     }
-    return val;
+    /* see https://groups.google.com/d/msg/comp.dsp/cZsS1ftN5oI/rEjHXKTxgv8J */
+    return 10.0f * audio_log10(4.0f * val / ((audio_float)chunk_len * (audio_float)chunk_len));
 }
 
 
-static void mono_downmix(audio_processor *processor) {
+static void fft_amplitudes(audio_analysis *a, audio_complex *out) {
     unsigned int i = 0;
-    unsigned int s = 0;
-    unsigned int o = processor->chunk_len - processor->sample_window_len;
-    int32_t m = 0;
 
-    char *buffer = processor->output_buffer;
+    for(i=0;i<a->spectrum_len;i++) {
+        a->spectrum_cur[i].amp = find_amplitude_max(out,a->spectrum_cur[i].first_bin,a->spectrum_cur[i].last_bin,a->chunk_len);
+    }
+}
 
-    while(i<o) {
-        processor->fftw_buffer[i] = processor->fftw_buffer[o+i];
-        processor->fftw_in[i] = processor->fftw_buffer[i];
-        processor->fftw_in[i] *= processor->window[i];
-        i++;
+static void cqt_amplitudes(audio_analysis *a, const audio_complex *out) {
+    unsigned int i = 0;
+    unsigned int j = 0;
+    audio_complex *k = NULL;
+    audio_complex cq;
+
+    for(i=0;i<a->spectrum_len;i++) {
+        k = a->cqt_kernel + a->spectrum_cur[i].kernel_offset - a->spectrum_cur[i].first_bin;
+        cq = 0.0f;
+        for(j=a->spectrum_cur[i].first_bin;j<=a->spectrum_cur[i].last_bin;j++) {
+            cq += out[j] * k[j];
+        }
+        a->spectrum_cur[i].amp = 20.0f * audio_log10(2.0f * audio_cabs(cq));
     }
+}
 
-    i=0;
 
-    while(i<processor->sample_window_len) {
-        s = i * processor->samplesize * 2;
-        switch(processor->samplesize) {
-            case 1: {
-                m += buffer[s];
-                break;
-            }
-            case 2: {
-                if(buffer[s+1] & 0x80) {
-                    m = 0xffff << 16 | buffer[s+1] << 8 | buffer[s];
-                }
-                else {
-                    m = buffer[s+1] << 8 | buffer[s];
-                }
-                break;
+/* dB to 0.0 - 1.0 */
+static audio_float amp_scale(audio_float amp, audio_float boost) {
+    if(!isfinite(amp)) {
+        amp = -999.0f; /* filtered out next line */
+    }
+
+    amp += boost;
+
+    if(amp <= -AMP_MIN) {
+        amp = -AMP_MIN;
+    }
+
+    amp += AMP_MIN;
+
+    if(amp > AMP_MAX) {
+        amp = AMP_MAX;
+    }
+
+    amp /= AMP_MAX;
+
+    amp *= AMP_BOOST; /* i seem to rarely get results near 1.0, let's give this a boost */
+
+    if(amp > 1.0f) {
+        amp = 1.0f;
+    }
+    return amp;
+}
+
+/* half-wave rectified difference of log magnitudes, averaged over bins.
+ * with several hops, each is compared to the one before and the
+ * strongest is kept, so short transients aren't averaged away */
+static audio_float spectral_flux(audio_analysis *a) {
+    unsigned int i = 0;
+    unsigned int k = 0;
+    const audio_complex *out = NULL;
+    audio_float mag = 0.0f;
+    audio_float flux = 0.0f;
+    audio_float max = 0.0f;
+
+    for(k=0;k<a->hops;k++) {
+        out = a->fftw_out + (k * a->fftw_len);
+        flux = 0.0f;
+        for(i=a->flux_first;i<=a->flux_last;i++) {
+            mag = audio_log1p(ONSET_COMPRESSION * 2.0f * audio_cabs(out[i]) / a->chunk_len);
+            if(mag > a->flux_prev[i]) {
+                flux += mag - a->flux_prev[i];
             }
-            case 3: {
-                if(buffer[s+2] & 0x80) {
-                    m = 0xff << 24 | buffer[s+2] << 16 | buffer[s+1] << 8 | buffer[s];
-                }
-                else {
-                    m = buffer[s+2] << 16 | buffer[s+1] << 8 | buffer[s];
-                }
-                break;
+            a->flux_prev[i] = mag;
+        }
+        max = audio_max(max,flux);
+    }
+
+    return max / (a->flux_last - a->flux_first + 1);
+}
+
+/* autocorrelation of the onset envelope, weighted towards TEMPO_PREFERRED */
+static audio_float rhythm_tempo(audio_rhythm *r) {
+    unsigned int lag = 0;
+    unsigned int lag_min = (unsigned int)floor(60.0f * r->fps / TEMPO_MAX);
+    unsigned int lag_max = (unsigned int)ceil(60.0f * r->fps / TEMPO_MIN);
+    unsigned int best = 0;
+    unsigned int i = 0;
+    audio_float mean = 0.0f;
+    audio_float acf[3] = { 0.0f, 0.0f, 0.0f };
+    audio_float best_acf = 0.0f;
+    audio_float cur = 0.0f;
+    audio_float weight = 0.0f;
+    audio_float d = 0.0f;
+    audio_float shift = 0.0f;
+
+    lag_min = audio_max(lag_min,2);
+    lag_max = audio_min(lag_max,r->history_len / 2);
+    if(lag_min + 1 >= lag_max) return 0.0f;
+
+    for(i=0;i<r->history_len;i++) {
+        mean += r->history[i];
+    }
+    mean /= r->history_len;
+
+    for(lag=lag_min-1;lag<=lag_max+1;lag++) {
+        cur = 0.0f;
+        for(i=lag;i<r->history_len;i++) {
+            cur += (r->history[(r->history_pos + i) % r->history_len] - mean) *
+                   (r->history[(r->history_pos + i - lag) % r->history_len] - mean);
+        }
+        acf[0] = acf[1];
+        acf[1] = acf[2];
+        acf[2] = cur / (r->history_len - lag);
+        if(lag < lag_min + 1) continue;
+
+        /* acf[1] is lag - 1, keep it if it's a weighted local peak */
+        if(acf[1] > acf[0] && acf[1] >= acf[2]) {
+            weight = log2((lag - 1) / (60.0f * r->fps / TEMPO_PREFERRED));
+            weight = exp(-0.5f * weight * weight);
+            if(acf[1] * weight > best_acf) {
+                best_acf = acf[1] * weight;
+                best = lag - 1;
+                /* parabolic interpolation between neighbouring lags */
+                d = acf[0] - 2.0f * acf[1] + acf[2];
+                shift = d < 0.0f ? 0.5f * (acf[0] - acf[2]) / d : 0.0f;
             }
         }
-        processor->fftw_buffer[o+i] = (double)m / processor->sample_max_val;
-        processor->fftw_in[o+i] = processor->fftw_buffer[o+i] * processor->window[i+o];
+    }
+
+    if(best == 0) return 0.0f;
+    return 60.0f * r->fps / (best + shift);
+}
+
+static void rhythm_update(audio_rhythm *r, audio_analysis *a) {
+    unsigned int i = 0;
+    unsigned int window = 0;
+    audio_float flux = 0.0f;
+    audio_float avg = 0.0f;
+    audio_float threshold = 0.0f;
+
+    if(a->flux_primed) {
+        flux = spectral_flux(a);
+    }
+    else {
+        /* new analysis, flux_prev is empty so hold the last value */
+        spectral_flux(a);
+        a->flux_primed = 1;
+        flux = r->flux[0];
+    }
+
+    r->flux_max = audio_max(flux,r->flux_max * r->decay);
+    r->onset = r->flux_max > 0.0f ? flux / r->flux_max : 0.0f;
+
+    /* average of the recent onset envelope, before adding this frame */
+    window = audio_min((unsigned int)(ONSET_THRESHOLD_WINDOW * r->fps),r->history_count);
+    for(i=0;i<window;i++) {
+        avg += r->history[(r->history_pos + r->history_len - 1 - i) % r->history_len];
+    }
+    if(window) avg /= window;
+
+    /* peaks are picked one frame late, once we know the flux went down */
+    r->since_beat++;
+    threshold = avg * ONSET_THRESHOLD_MULT + r->flux_max * ONSET_THRESHOLD_DELTA;
+    r->beat = r->flux[0] > r->flux[1] &&
+              r->flux[0] >= flux &&
+              r->flux[0] > threshold &&
+              r->since_beat >= ONSET_MIN_GAP * r->fps;
+    if(r->beat) {
+        r->since_beat = 0;
+    }
+
+    r->flux[1] = r->flux[0];
+    r->flux[0] = flux;
+
+    r->history[r->history_pos] = flux;
+    r->history_pos = (r->history_pos + 1) % r->history_len;
+    if(r->history_count < r->history_len) {
+        r->history_count++;
+    }
+
+    if(r->history_count == r->history_len) {
+        r->bpm = rhythm_tempo(r);
+    }
+}
+
+/* Krumhansl-Kessler key profiles, starting at the tonic */
+static const double key_major[12] = {
+    6.35, 2.23, 3.48, 2.33, 4.38, 4.09, 2.52, 5.19, 2.39, 3.66, 2.29, 2.88,
+};
+static const double key_minor[12] = {
+    6.33, 2.68, 3.52, 5.38, 2.60, 3.53, 2.54, 4.75, 3.98, 2.69, 3.34, 3.17,
+};
+
+/* pearson correlation of the chroma profile against a rotated key profile */
+static double chroma_key_score(const audio_float *profile, const double *key, unsigned int tonic) {
+    unsigned int i = 0;
+    double pm = 0.0f;
+    double km = 0.0f;
+    double pk = 0.0f;
+    double pp = 0.0f;
+    double kk = 0.0f;
+    double p = 0.0f;
+    double k = 0.0f;
+
+    for(i=0;i<12;i++) {
+        pm += profile[i];
+        km += key[i];
+    }
+    pm /= 12.0f;
+    km /= 12.0f;
+
+    for(i=0;i<12;i++) {
+        p = profile[(tonic + i) % 12] - pm;
+        k = key[i] - km;
+        pk += p * k;
+        pp += p * p;
+        kk += k * k;
+    }
+
+    return pp > 0.0f ? pk / sqrt(pp * kk) : 0.0f;
+}
+
+static void chroma_update(audio_chroma *c, const audio_analysis *a) {
+    const audio_complex *out = a->fftw_out + ((a->hops - 1) * a->fftw_len);
+    unsigned int i = 0;
+    audio_float raw[12] = { 0.0f };
+    audio_float max = 0.0f;
+    double score = 0.0f;
+    double best = -2.0f;
+
+    for(i=a->chroma_first;i<=a->chroma_last;i++) {
+        raw[a->chroma_bins[i - a->chroma_first]] += audio_cnorm(out[i]);
+    }
+
+    for(i=0;i<12;i++) {
+        max = audio_max(max,raw[i]);
+    }
+
+    for(i=0;i<12;i++) {
+        if(max > 0.0f) {
+            raw[i] /= max;
+        }
+        c->chroma[i] += (raw[i] - c->chroma[i]) * c->smooth;
+        c->profile[i] += (raw[i] - c->profile[i]) * c->key_smooth;
+    }
+
+    c->pitch = 0;
+    for(i=1;i<12;i++) {
+        if(c->chroma[i] > c->chroma[c->pitch]) {
+            c->pitch = i;
+        }
+    }
+
+    for(i=0;i<12;i++) {
+        score = chroma_key_score(c->profile,key_major,i);
+        if(score > best) {
+            best = score;
+            c->key = i;
+            c->minor = 0;
+        }
+        score = chroma_key_score(c->profile,key_minor,i);
+        if(score > best) {
+            best = score;
+            c->key = i;
+            c->minor = 1;
+        }
+    }
+}
+
+static void chroma_init(audio_processor *processor, audio_chroma *c) {
+    double fps = (double)processor->samplerate / processor->sample_window_len;
+    c->smooth = 1.0f - exp(-1.0f / (CHROMA_SMOOTH * fps));
+    c->key_smooth = 1.0f - exp(-1.0f / (CHROMA_KEY_SMOOTH * fps));
+}
+
+/* sorted windows for running medians */
+static void median_remove(audio_float *w, unsigned int *len, audio_float v) {
+    unsigned int i = 0;
+
+    for(i=0;i<*len && w[i] != v;i++);
+    if(i < *len) {
+        memmove(w + i, w + i + 1, sizeof(audio_float) * (*len - i - 1));
+        (*len)--;
+    }
+}
+
+static void median_insert(audio_float *w, unsigned int *len, audio_float v) {
+    unsigned int i = *len;
 
+    while(i > 0 && w[i-1] > v) {
+        w[i] = w[i-1];
+        i--;
+    }
+    w[i] = v;
+    (*len)++;
+}
+
+/* median filtering of the bars across time gives the harmonic part, across
+ * frequency the percussive part (Fitzgerald, "Harmonic/percussive separation
+ * using median filtering"), the bars are then split with soft masks.
+ * Both medians slide a sorted window, so each frame costs
+ * spectrum_len * (AUDIO_HPSS_TIME + the frequency window) */
+static void hpss_update(audio_analysis *a) {
+    unsigned int b = 0;
+    unsigned int n = 0;
+    unsigned int half = audio_max(2,a->spectrum_len / 32);
+    audio_float window[AUDIO_HPSS_FREQ_HALF * 2 + 1];
+    audio_float *sorted = NULL;
+    audio_float *row = a->hpss_history + (a->hpss_pos * a->spectrum_len);
+    audio_float h = 0.0f;
+    audio_float p = 0.0f;
+    int full = a->hpss_count == AUDIO_HPSS_TIME;
+
+    half = audio_min(half,AUDIO_HPSS_FREQ_HALF);
+
+    for(b=0;b<a->spectrum_len;b++) {
+        sorted = a->hpss_sorted + (b * AUDIO_HPSS_TIME);
+        n = a->hpss_count;
+        if(full) {
+            median_remove(sorted,&n,row[b]);
+        }
+        median_insert(sorted,&n,a->hpss_in[b]);
+        row[b] = a->hpss_in[b];
+        a->harmonic[b] = sorted[n / 2];
+    }
+    a->hpss_pos = (a->hpss_pos + 1) % AUDIO_HPSS_TIME;
+    if(!full) {
+        a->hpss_count++;
+    }
+
+    /* window is bars b - half .. b + half, cut off at the edges */
+    n = 0;
+    for(b=0;b<half && b<a->spectrum_len;b++) {
+        median_insert(window,&n,a->hpss_in[b]);
+    }
+    for(b=0;b<a->spectrum_len;b++) {
+        /* drop the outgoing bar first, so the window never holds more than 2 * half + 1 */
+        if(b > half) {
+            median_remove(window,&n,a->hpss_in[b - half - 1]);
+        }
+        if(b + half < a->spectrum_len) {
+            assert(n < sizeof(window) / sizeof(window[0]));
+            median_insert(window,&n,a->hpss_in[b + half]);
+        }
+        a->percussive[b] = window[n / 2];
+    }
+
+    for(b=0;b<a->spectrum_len;b++) {
+        h = a->harmonic[b] * a->harmonic[b];
+        p = a->percussive[b] * a->percussive[b];
+        if(h + p > 0.0f) {
+            a->harmonic[b] = a->hpss_in[b] * h / (h + p);
+            a->percussive[b] = a->hpss_in[b] * p / (h + p);
+        }
+        else {
+            a->harmonic[b] = 0.0f;
+            a->percussive[b] = 0.0f;
+        }
+    }
+}
+
+static int rhythm_init(audio_processor *processor, audio_rhythm *r) {
+    r->fps = (audio_float)processor->samplerate / processor->sample_window_len;
+    r->decay = pow(0.5, 1.0f / (ONSET_HALFLIFE * r->fps));
+    r->history_len = (unsigned int)ceil(TEMPO_HISTORY * r->fps);
+    r->history = (audio_float *)malloc(sizeof(audio_float) * r->history_len);
+    if(!r->history) {
+        return 0;
+    }
+    memset(r->history,0,sizeof(audio_float) * r->history_len);
+    return 1;
+}
+
+static void rhythm_free(audio_rhythm *r) {
+    if(r->history) free(r->history);
+    r->history = NULL;
+}
+
+/* BS.1770 K-weighting for any samplerate, see Brecht De Man,
+ * "Evaluation of implementations of the EBU R128 loudness measurement" */
+static void meter_kweighting(audio_meter *m, double fs) {
+    double k = tan(M_PI * 1681.974450955533 / fs);
+    double vh = pow(10.0, 3.999843853973347 / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double q = 0.7071752369554196;
+    double a0 = 1.0 + k / q + k * k;
+
+    m->k1[0] = (vh + vb * k / q + k * k) / a0;
+    m->k1[1] = 2.0 * (k * k - vh) / a0;
+    m->k1[2] = (vh - vb * k / q + k * k) / a0;
+    m->k1[3] = 2.0 * (k * k - 1.0) / a0;
+    m->k1[4] = (1.0 - k / q + k * k) / a0;
+
+    k = tan(M_PI * 38.13547087602444 / fs);
+    q = 0.5003270373238773;
+    a0 = 1.0 + k / q + k * k;
+
+    m->k2[0] = 1.0;
+    m->k2[1] = -2.0;
+    m->k2[2] = 1.0;
+    m->k2[3] = 2.0 * (k * k - 1.0) / a0;
+    m->k2[4] = (1.0 - k / q + k * k) / a0;
+}
+
+/* 4 phase windowed-sinc interpolator, each phase normalized to unity gain */
+static void meter_truepeak(audio_meter *m) {
+    unsigned int p = 0;
+    unsigned int k = 0;
+    unsigned int n = 0;
+    unsigned int len = AUDIO_TRUEPEAK_TAPS * 4;
+    double t = 0.0f;
+    double h = 0.0f;
+    double sum = 0.0f;
+
+    for(p=0;p<4;p++) {
+        sum = 0.0f;
+        for(k=0;k<AUDIO_TRUEPEAK_TAPS;k++) {
+            n = (k * 4) + p;
+            t = ((double)n - (len - 1) / 2.0) / 4.0;
+            h = t == 0.0f ? 1.0f : sin(M_PI * t) / (M_PI * t);
+            h *= 0.42 - 0.5 * cos(2.0 * M_PI * (n + 0.5) / len) + 0.08 * cos(4.0 * M_PI * (n + 0.5) / len);
+            m->tp_coef[p][k] = h;
+            sum += h;
+        }
+        for(k=0;k<AUDIO_TRUEPEAK_TAPS;k++) {
+            m->tp_coef[p][k] /= sum;
+        }
+    }
+}
+
+static int meter_init(audio_processor *processor, audio_meter *m) {
+    double fps = (double)processor->samplerate / processor->sample_window_len;
+
+    meter_kweighting(m,processor->samplerate);
+    meter_truepeak(m);
+
+    m->blocks_len = audio_max(1,(unsigned int)(LUFS_SHORT * fps + 0.5f));
+    m->momentary_len = audio_max(1,(unsigned int)(LUFS_MOMENTARY * fps + 0.5f));
+    m->blocks_pos = 0;
+    m->blocks_count = 0;
+    m->blocks = (double *)malloc(sizeof(double) * m->blocks_len);
+    if(!m->blocks) {
+        return 0;
+    }
+    memset(m->blocks,0,sizeof(double) * m->blocks_len);
+    return 1;
+}
+
+static void meter_free(audio_meter *m) {
+    if(m->blocks) free(m->blocks);
+    m->blocks = NULL;
+}
+
+static inline void meter_begin(audio_meter *m) {
+    m->sum[0] = m->sum[1] = 0.0f;
+    m->ksum = 0.0f;
+    m->peak[0] = m->peak[1] = 0.0f;
+    m->true_peak[0] = m->true_peak[1] = 0.0f;
+}
+
+static inline void meter_sample(audio_meter *m, unsigned int c, audio_float v) {
+    unsigned int p = 0;
+    unsigned int k = 0;
+    double y = 0.0f;
+    double w = 0.0f;
+    audio_float t = 0.0f;
+    audio_float *h = NULL;
+
+    m->sum[c] += v * v;
+    if(fabs(v) > m->peak[c]) {
+        m->peak[c] = fabs(v);
+    }
+
+    /* K-weighting, transposed direct form II */
+    y = m->k1[0] * v + m->kz[c][0];
+    m->kz[c][0] = m->k1[1] * v - m->k1[3] * y + m->kz[c][1];
+    m->kz[c][1] = m->k1[2] * v - m->k1[4] * y;
+    w = m->k2[0] * y + m->kz[c][2];
+    m->kz[c][2] = m->k2[1] * y - m->k2[3] * w + m->kz[c][3];
+    m->kz[c][3] = m->k2[2] * y - m->k2[4] * w;
+    m->ksum += w * w;
+
+    m->tp_pos[c] = (m->tp_pos[c] + AUDIO_TRUEPEAK_TAPS - 1) % AUDIO_TRUEPEAK_TAPS;
+    h = m->tp_hist[c] + m->tp_pos[c];
+    h[0] = h[AUDIO_TRUEPEAK_TAPS] = v;
+    for(p=0;p<4;p++) {
+        t = 0.0f;
+        for(k=0;k<AUDIO_TRUEPEAK_TAPS;k++) {
+            t += m->tp_coef[p][k] * h[k];
+        }
+        if(fabs(t) > m->true_peak[c]) {
+            m->true_peak[c] = fabs(t);
+        }
+    }
+}
+
+static double meter_lufs(double ms) {
+    double l = ms > 0.0f ? -0.691 + 10.0 * log10(ms) : LUFS_MIN;
+    return l < LUFS_MIN ? LUFS_MIN : l;
+}
+
+static void meter_end(audio_meter *m, unsigned int channels, unsigned int len) {
+    unsigned int c = 0;
+    unsigned int i = 0;
+    unsigned int n = 0;
+    double momentary = 0.0f;
+    double s = 0.0f;
+
+    for(c=0;c<channels;c++) {
+        m->rms[c] = sqrt(m->sum[c] / len);
+        m->true_peak[c] = audio_max(m->true_peak[c],m->peak[c]);
+    }
+
+    m->blocks[m->blocks_pos] = m->ksum / len;
+    m->blocks_pos = (m->blocks_pos + 1) % m->blocks_len;
+    if(m->blocks_count < m->blocks_len) {
+        m->blocks_count++;
+    }
+
+    /* newest first, so the momentary sum falls out on the way */
+    n = audio_min(m->momentary_len,m->blocks_count);
+    for(i=0;i<m->blocks_count;i++) {
+        s += m->blocks[(m->blocks_pos + m->blocks_len - 1 - i) % m->blocks_len];
+        if(i + 1 == n) {
+            momentary = s / n;
+        }
+    }
+
+    m->lufs_momentary = meter_lufs(momentary);
+    m->lufs_short = meter_lufs(s / m->blocks_count);
+}
+
+static int stereo_init(audio_processor *processor, audio_stereo *s) {
+    s->points_step = (processor->sample_window_len + AUDIO_VECTORSCOPE_POINTS - 1) / AUDIO_VECTORSCOPE_POINTS;
+    s->points_len = processor->sample_window_len / s->points_step;
+    s->points = (audio_float *)malloc(sizeof(audio_float) * s->points_len * 2);
+    if(!s->points) {
+        return 0;
+    }
+    memset(s->points,0,sizeof(audio_float) * s->points_len * 2);
+    return 1;
+}
+
+static void stereo_free(audio_stereo *s) {
+    if(s->points) free(s->points);
+    s->points = NULL;
+}
+
+/* lr is the frame's sum of left * right, this also needs
+ * the meter's per-channel sums so call it before meter_end */
+static void stereo_end(audio_stereo *s, const audio_meter *m, double lr) {
+    double l = sqrt(m->sum[0]);
+    double r = sqrt(m->sum[1]);
+
+    s->correlation = l * r > 0.0f ? lr / (l * r) : 1.0f;
+    s->balance = l + r > 0.0f ? (r - l) / (l + r) : 0.0f;
+}
+
+/* decodes one little-endian signed sample */
+static inline int32_t audio_sample(const uint8_t *b, unsigned int samplesize) {
+    switch(samplesize) {
+        case 1: return (int8_t)b[0];
+        case 2: return (int16_t)((uint16_t)b[1] << 8 | b[0]);
+        case 3: return (int32_t)((uint32_t)b[2] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[0] << 8) >> 8;
+    }
+    return 0;
+}
+
+/* shifts the sample history back by a frame and windows what's left
+ * of it into the last hop, the downmix fills in the rest */
+static void audio_shift(audio_processor *processor) {
+    audio_analysis *a = &(processor->analysis);
+    unsigned int i = 0;
+    unsigned int o = a->buffer_len - processor->sample_window_len;
+    unsigned int w = a->chunk_len - processor->sample_window_len;
+    audio_float *in = a->fftw_in + ((a->hops - 1) * a->chunk_len);
+    const audio_float *buffer = a->fftw_buffer + (a->buffer_len - a->chunk_len);
+
+    while(i<o) {
+        a->fftw_buffer[i] = a->fftw_buffer[processor->sample_window_len+i];
         i++;
     }
+
+    for(i=0;i<w;i++) {
+        in[i] = buffer[i] * a->window[i];
+    }
 }
 
+/* windows the earlier hops, once the downmix has filled in the frame */
+static void audio_hops(audio_processor *processor) {
+    audio_analysis *a = &(processor->analysis);
+    unsigned int i = 0;
+    unsigned int k = 0;
+    audio_float *in = NULL;
+    const audio_float *buffer = NULL;
+
+    for(k=0;k+1<a->hops;k++) {
+        in = a->fftw_in + (k * a->chunk_len);
+        buffer = a->fftw_buffer + a->buffer_len - processor->sample_window_len - a->chunk_len
+          + (processor->sample_window_len * (k + 1) / a->hops);
+        for(i=0;i<a->chunk_len;i++) {
+            in[i] = buffer[i] * a->window[i];
+        }
+    }
+}
 
-static void stereo_downmix(audio_processor *processor) {
+static void spectrogram_push(audio_spectrogram *s, const audio_float *amps) {
+    unsigned int i = 0;
+    uint8_t *u8 = NULL;
+    float *f = NULL;
+
+    s->head = (s->head + 1) % s->depth;
+    if(s->count < s->depth) {
+        s->count++;
+    }
+
+    if(s->format == AUDIO_SPECTROGRAM_FLOAT) {
+        f = (float *)s->data + (s->head * s->width);
+        for(i=0;i<s->width;i++) {
+            f[i] = (float)amps[i];
+        }
+    }
+    else {
+        u8 = (uint8_t *)s->data + (s->head * s->width);
+        for(i=0;i<s->width;i++) {
+            u8[i] = (uint8_t)(amps[i] * 255.0f + 0.5f);
+        }
+    }
+}
+
+static void lookahead_push(audio_lookahead *l, const audio_float *amps) {
+    audio_float *row = l->rows + (l->pos * l->width);
+
+    memcpy(l->current,row,sizeof(audio_float) * l->width);
+    memcpy(row,amps,sizeof(audio_float) * l->width);
+    l->pos = (l->pos + 1) % l->frames;
+}
+
+static int lookahead_resize(audio_lookahead *l, unsigned int frames, unsigned int width) {
+    audio_float *rows = NULL;
+
+    if(frames) {
+        rows = (audio_float *)malloc(sizeof(audio_float) * (frames + 1) * width);
+        if(!rows) {
+            return 0;
+        }
+        memset(rows,0,sizeof(audio_float) * (frames + 1) * width);
+    }
+
+    if(l->rows) free(l->rows);
+    l->rows = rows;
+    l->current = rows ? rows + (frames * width) : NULL;
+    l->frames = frames;
+    l->width = width;
+    l->pos = 0;
+    return 1;
+}
+
+static int spectrogram_resize(audio_spectrogram *s, unsigned int depth, unsigned int width, unsigned int format) {
+    size_t size = format == AUDIO_SPECTROGRAM_FLOAT ? sizeof(float) : sizeof(uint8_t);
+    void *data = NULL;
+
+    if(depth) {
+        data = malloc(size * depth * width);
+        if(!data) {
+            return 0;
+        }
+        memset(data,0,size * depth * width);
+    }
+
+    if(s->data) free(s->data);
+    s->data = data;
+    s->depth = depth;
+    s->width = width;
+    s->format = format;
+    s->head = depth ? depth - 1 : 0;
+    s->count = 0;
+    return 1;
+}
+
+static void mono_downmix(audio_processor *processor) {
+    audio_analysis *a = &(processor->analysis);
     unsigned int i = 0;
-    unsigned int s = 0;
-    unsigned int o = processor->chunk_len - processor->sample_window_len;
-    int32_t l = 0;
-    int32_t r = 0;
-    int32_t m = 0;
-    int64_t t = 0;
-
-    char *buffer = processor->output_buffer;
-
-    while(i+processor->sample_window_len < processor->chunk_len) {
-        processor->fftw_buffer[i] = processor->fftw_buffer[processor->sample_window_len+i];
-        processor->fftw_in[i] = processor->fftw_buffer[i];
-        processor->fftw_in[i] *= processor->window[i];
+    unsigned int o = a->buffer_len - processor->sample_window_len;
+    unsigned int w = a->chunk_len - processor->sample_window_len;
+    audio_float *in = a->fftw_in + ((a->hops - 1) * a->chunk_len);
+    audio_float *mono = processor->waveform;
+    audio_float *left = processor->waveform + processor->sample_window_len;
+    audio_float *side = processor->stereo.points;
+    audio_float *mid = processor->stereo.points + processor->stereo.points_len;
+    unsigned int p = 0;
+    unsigned int next = 0;
+
+    const uint8_t *buffer = (const uint8_t *)processor->output_buffer;
+
+    audio_shift(processor);
+    meter_begin(&(processor->meter));
+
+    while(i<processor->sample_window_len) {
+        mono[i] = (audio_float)audio_sample(buffer,processor->samplesize) / processor->sample_max_val;
+        left[i] = mono[i];
+        meter_sample(&(processor->meter),0,mono[i]);
+        if(i == next && p < processor->stereo.points_len) {
+            side[p] = 0.0f;
+            mid[p] = mono[i];
+            next += processor->stereo.points_step;
+            p++;
+        }
+        a->fftw_buffer[o+i] = mono[i];
+        in[w+i] = mono[i] * a->window[w+i];
+        buffer += processor->samplesize;
         i++;
     }
 
-    i=0;
+    meter_end(&(processor->meter),1,processor->sample_window_len);
+}
+
+static void stereo_downmix(audio_processor *processor) {
+    audio_analysis *a = &(processor->analysis);
+    unsigned int i = 0;
+    unsigned int o = a->buffer_len - processor->sample_window_len;
+    unsigned int w = a->chunk_len - processor->sample_window_len;
+    audio_float *in = a->fftw_in + ((a->hops - 1) * a->chunk_len);
+    audio_float *mono = processor->waveform;
+    audio_float *left = processor->waveform + processor->sample_window_len;
+    audio_float *right = processor->waveform + (processor->sample_window_len * 2);
+    audio_float *side = processor->stereo.points;
+    audio_float *mid = processor->stereo.points + processor->stereo.points_len;
+    unsigned int p = 0;
+    unsigned int next = 0;
+    double lr = 0.0f;
+
+    const uint8_t *buffer = (const uint8_t *)processor->output_buffer;
+
+    audio_shift(processor);
+    meter_begin(&(processor->meter));
 
     while(i<processor->sample_window_len) {
-        s = i * processor->samplesize * 2;
-        switch(processor->samplesize) {
-            case 1: {
-                l = buffer[s];
-                r = buffer[s+1];
-                break;
+        left[i] = (audio_float)audio_sample(buffer,processor->samplesize) / processor->sample_max_val;
+        right[i] = (audio_float)audio_sample(buffer + processor->samplesize,processor->samplesize) / processor->sample_max_val;
+        meter_sample(&(processor->meter),0,left[i]);
+        meter_sample(&(processor->meter),1,right[i]);
+        mono[i] = (left[i] + right[i]) / 2.0f;
+        lr += left[i] * right[i];
+        if(i == next && p < processor->stereo.points_len) {
+            side[p] = (right[i] - left[i]) / 2.0f;
+            mid[p] = mono[i];
+            next += processor->stereo.points_step;
+            p++;
+        }
+        a->fftw_buffer[o+i] = mono[i];
+        in[w+i] = mono[i] * a->window[w+i];
+        buffer += processor->samplesize * 2;
+        i++;
+    }
+
+    stereo_end(&(processor->stereo),&(processor->meter),lr);
+    meter_end(&(processor->meter),2,processor->sample_window_len);
+}
+
+
+static void
+spectrum_log(audio_analysis *a, double bin_size, double freq_min, double freq_max) {
+    unsigned int i = 0;
+    double octaves = ceil(log2(freq_max / freq_min));
+    double interval = 1.0f / (octaves / (double)a->spectrum_len);
+    /*
+    if(ceil(interval) - interval <= 0.5) {
+        interval = ceil(interval);
+    } else {
+        interval = floor(interval);
+    }
+    */
+
+    for(i=0;i<a->spectrum_len+1;i++) {
+        if(i==0) {
+            a->spectrum_cur[i].freq = freq_min;
+        }
+        else {
+            /* see http://www.zytrax.com/tech/audio/calculator.html#centers_calc */
+            a->spectrum_cur[i].freq = a->spectrum_cur[i-1].freq * pow(10, 3 / (10 * interval));
+        }
+
+        /* fudging this a bit to avoid overlap */
+        double upper_freq = a->spectrum_cur[i].freq * pow(10, (3 * 1) / (10 * 2 * floor(interval)));
+        double lower_freq = a->spectrum_cur[i].freq / pow(10, (3 * 1) / (10 * 2 * ceil(interval)));
+
+        a->spectrum_cur[i].first_bin = (unsigned int)floor(lower_freq / bin_size);
+        a->spectrum_cur[i].last_bin = (unsigned int)floor(upper_freq / bin_size);
+    }
+}
+
+static void
+spectrum_linear(audio_analysis *a, double bin_size, double freq_min, double freq_max) {
+    unsigned int i = 0;
+    double width = (freq_max - freq_min) / (double)a->spectrum_len;
+
+    for(i=0;i<a->spectrum_len+1;i++) {
+        a->spectrum_cur[i].freq = freq_min + (width * i) + (width / 2.0f);
+        a->spectrum_cur[i].first_bin = (unsigned int)floor((freq_min + (width * i)) / bin_size);
+        a->spectrum_cur[i].last_bin = (unsigned int)floor((freq_min + (width * (i+1))) / bin_size);
+        if(a->spectrum_cur[i].last_bin > a->spectrum_cur[i].first_bin) {
+            /* the next band starts on that bin */
+            a->spectrum_cur[i].last_bin--;
+        }
+    }
+}
+
+/* constant-Q bands, using the efficient algorithm from Brown and Puckette,
+ * "An efficient algorithm for the calculation of a constant Q transform".
+ * Each band's windowed complex exponential is transformed once, the
+ * significant part of its spectrum is kept, and applying it to a frame
+ * is a short dot product with the regular FFT output.
+ * Kernels are aligned to the end of the frame, so every band looks at
+ * the most recent audio */
+static int
+spectrum_cqt(audio_processor *processor, audio_analysis *a, double freq_min, double freq_max) {
+    unsigned int i = 0;
+    unsigned int j = 0;
+    unsigned int n = 0;
+    unsigned int len = 0;
+    unsigned int first = 0;
+    unsigned int last = 0;
+    double w = 0.0f;
+    double ph = 0.0f;
+    double mag = 0.0f;
+    double peak = 0.0f;
+    double bins = (double)a->spectrum_len / log2(freq_max / freq_min); /* bands per octave */
+    double q = 1.0f / (pow(2, 1.0f / bins) - 1.0f);
+    audio_complex *temporal = NULL;
+    audio_complex *spectral = NULL;
+    audio_complex *tmp = NULL;
+    audio_plan plan = NULL;
+    int r = 0;
+
+    temporal = (audio_complex *)AUDIO_FFTW(malloc)(sizeof(audio_complex) * a->chunk_len);
+    spectral = (audio_complex *)AUDIO_FFTW(malloc)(sizeof(audio_complex) * a->chunk_len);
+    if(!temporal || !spectral) {
+        goto done;
+    }
+
+    plan = AUDIO_FFTW(plan_dft_1d)(a->chunk_len,temporal,spectral,FFTW_FORWARD,FFTW_ESTIMATE);
+    if(!plan) {
+        goto done;
+    }
+
+    for(i=0;i<a->spectrum_len;i++) {
+        a->spectrum_cur[i].freq = freq_min * pow(2, (double)i / bins);
+
+        len = (unsigned int)ceil(q * processor->samplerate / a->spectrum_cur[i].freq);
+        len = audio_max(len,CQT_MIN_LEN);
+        len = audio_min(len,a->chunk_len);
+
+        memset(temporal,0,sizeof(audio_complex) * a->chunk_len);
+        for(n=0;n<len;n++) {
+            w = window_funcs[a->config.window](n,len) / len;
+            ph = 2.0f * M_PI * a->spectrum_cur[i].freq * n / processor->samplerate;
+            temporal[a->chunk_len - len + n] = (audio_float)(w * cos(ph)) + (audio_float)(w * sin(ph)) * I;
+        }
+
+        AUDIO_FFTW(execute)(plan);
+
+        peak = 0.0f;
+        for(j=0;j<=a->chunk_len/2;j++) {
+            peak = audio_max(peak,cabs(spectral[j]));
+        }
+
+        first = a->chunk_len / 2;
+        last = 0;
+        for(j=0;j<=a->chunk_len/2;j++) {
+            mag = cabs(spectral[j]);
+            if(mag >= peak * CQT_SPARSITY) {
+                first = audio_min(first,j);
+                last = audio_max(last,j);
             }
-            case 2: {
-                if(buffer[s+1] & 0x80) {
-                    l = 0xffff << 16 | buffer[s+1] << 8 | buffer[s];
-                }
-                else {
-                    l = buffer[s+1] << 8 | buffer[s];
-                }
-                if(buffer[s+3] & 0x80) {
-                    r = 0xffff << 16 | buffer[s+3] << 8 | buffer[s+2];
+        }
+        if(first > last) {
+            first = last;
+        }
+
+        tmp = (audio_complex *)realloc(a->cqt_kernel,sizeof(audio_complex) * (a->cqt_kernel_len + (last - first + 1)));
+        if(!tmp) {
+            goto done;
+        }
+        a->cqt_kernel = tmp;
+
+        a->spectrum_cur[i].first_bin = first;
+        a->spectrum_cur[i].last_bin = last;
+        a->spectrum_cur[i].kernel_offset = a->cqt_kernel_len;
+
+        for(j=first;j<=last;j++) {
+            a->cqt_kernel[a->cqt_kernel_len++] = conj(spectral[j]) / a->chunk_len;
+        }
+    }
+
+    a->spectrum_cur[i].freq = freq_min * pow(2, (double)i / bins);
+    a->spectrum_cur[i].first_bin = 0;
+    a->spectrum_cur[i].last_bin = 0;
+    a->spectrum_cur[i].kernel_offset = 0;
+    r = 1;
+
+    done:
+    if(plan) AUDIO_FFTW(destroy_plan)(plan);
+    if(temporal) AUDIO_FFTW(free)(temporal);
+    if(spectral) AUDIO_FFTW(free)(spectral);
+    return r;
+}
+
+static void
+audio_analysis_free(audio_analysis *a) {
+    if(a->window) free(a->window);
+    if(a->plan) AUDIO_FFTW(destroy_plan)(a->plan);
+    if(a->fftw_in) AUDIO_FFTW(free)(a->fftw_in);
+    if(a->fftw_out) AUDIO_FFTW(free)(a->fftw_out);
+    if(a->fftw_buffer) AUDIO_FFTW(free)(a->fftw_buffer);
+    if(a->spectrum_cur) free(a->spectrum_cur);
+    if(a->amps) free(a->amps);
+    if(a->cqt_kernel) free(a->cqt_kernel);
+    if(a->flux_prev) free(a->flux_prev);
+    if(a->chroma_bins) free(a->chroma_bins);
+    if(a->harmonic) free(a->harmonic);
+
+    a->window = NULL;
+    a->plan = NULL;
+    a->fftw_in = NULL;
+    a->fftw_out = NULL;
+    a->fftw_buffer = NULL;
+    a->spectrum_cur = NULL;
+    a->amps = NULL;
+    a->peaks = NULL;
+    a->freqs = NULL;
+    a->substeps = NULL;
+    a->cqt_kernel = NULL;
+    a->cqt_kernel_len = 0;
+    a->flux_prev = NULL;
+    a->chroma_bins = NULL;
+    a->harmonic = NULL;
+    a->percussive = NULL;
+    a->hpss_in = NULL;
+    a->hpss_history = NULL;
+    a->hpss_sorted = NULL;
+    a->flux_primed = 0;
+}
+
+static int
+audio_config_check(audio_processor *processor, const audio_config *config) {
+    if(config->spectrum_len == 0 || config->spectrum_len > AUDIO_BARS_MAX) {
+        strerr_warn1x("error: bars must be between 1 and 16384");
+        return 0;
+    }
+    if(config->window > AUDIO_WINDOW_NONE) {
+        strerr_warn1x("error: unknown window function");
+        return 0;
+    }
+    if(config->engine > AUDIO_ENGINE_CQT) {
+        strerr_warn1x("error: unknown analysis engine");
+        return 0;
+    }
+    if(config->scale > AUDIO_SCALE_LINEAR) {
+        strerr_warn1x("error: unknown band scale");
+        return 0;
+    }
+    /* written so NaN fails too */
+    if(!isfinite(config->freq_min) || isnan(config->freq_max) ||
+       !(config->freq_min > 0.0f) ||
+       !(config->freq_min < audio_min(config->freq_max,processor->samplerate / 2))) {
+        strerr_warn1x("error: minimum frequency must be above 0 and below the maximum frequency");
+        return 0;
+    }
+    if(config->hops == 0 || config->hops > AUDIO_HOPS_MAX) {
+        strerr_warn1x("error: hops must be between 1 and 16");
+        return 0;
+    }
+    if(config->hop_mode > AUDIO_HOP_MEAN) {
+        strerr_warn1x("error: unknown hop mode");
+        return 0;
+    }
+    if(config->fft_len > (1 << 20)) {
+        strerr_warn1x("error: FFT size too big, max is 1048576");
+        return 0;
+    }
+    return 1;
+}
+
+/* builds everything in a->config, this is called on
+ * the audio thread after startup */
+static int
+audio_analysis_init(audio_processor *processor, audio_analysis *a) {
+    unsigned int i = 0;
+    double bin_size = 0.0f;
+    double kernel_len = 0.0f;
+    double freq_min = a->config.freq_min;
+    double freq_max = audio_min(a->config.freq_max,processor->samplerate / 2);
+
+    if(!audio_config_check(processor,&(a->config))) {
+        return 0;
+    }
+
+    /* the FFT always covers at least one frame worth of samples */
+    a->chunk_len = 64;
+    while(a->chunk_len < a->config.fft_len || a->chunk_len < processor->sample_window_len) {
+        a->chunk_len = a->chunk_len * 2;
+    }
+
+    /* the constant-Q engine also needs room for the lowest band's kernel */
+    if(a->config.engine == AUDIO_ENGINE_CQT) {
+        kernel_len = ceil(processor->samplerate / (freq_min * (pow(freq_max / freq_min, 1.0f / a->config.spectrum_len) - 1.0f)));
+        while(a->chunk_len < kernel_len && a->chunk_len < (1 << 20)) {
+            a->chunk_len = a->chunk_len * 2;
+        }
+    }
+
+    bin_size = (double)processor->samplerate / (double)a->chunk_len;
+
+    a->fftw_len = (a->chunk_len / 2) + 1;
+    a->spectrum_len = a->config.spectrum_len;
+    a->hops = audio_min(a->config.hops,processor->sample_window_len);
+
+    /* earlier hops reach back into the previous frame */
+    a->buffer_len = a->chunk_len;
+    if(a->hops > 1) {
+        a->buffer_len += processor->sample_window_len;
+    }
+
+    a->window = (audio_float *)malloc(sizeof(audio_float) * a->chunk_len);
+    if(!a->window) {
+        goto fail;
+    }
+    /* constant-Q kernels carry their own windows */
+    for(i=0;i<a->chunk_len;i++) {
+        a->window[i] = window_funcs[a->config.engine == AUDIO_ENGINE_CQT ? AUDIO_WINDOW_NONE : a->config.window](i,a->chunk_len);
+    }
+
+    a->fftw_buffer = (audio_float *)AUDIO_FFTW(malloc)(sizeof(audio_float) * a->buffer_len);
+    if(!a->fftw_buffer) {
+        goto fail;
+    }
+
+    a->fftw_in = (audio_float *)AUDIO_FFTW(malloc)(sizeof(audio_float) * a->chunk_len * a->hops);
+    if(!a->fftw_in) {
+        goto fail;
+    }
+
+    a->fftw_out = (audio_complex *)AUDIO_FFTW(malloc)(sizeof(audio_complex) * a->fftw_len * a->hops);
+    if(!a->fftw_out) {
+        goto fail;
+    }
+
+    if(!audio_analysis_plan(processor,a)) {
+        goto fail;
+    }
+
+    a->flux_prev = (audio_float *)malloc(sizeof(audio_float) * a->fftw_len);
+    if(!a->flux_prev) {
+        goto fail;
+    }
+    memset(a->flux_prev,0,sizeof(audio_float) * a->fftw_len);
+    a->flux_first = audio_max(1,(unsigned int)floor(freq_min / bin_size));
+    a->flux_last = audio_min(a->fftw_len - 1,(unsigned int)ceil(freq_max / bin_size));
+    a->flux_primed = 0;
+
+    /* pitch class of each bin, 69 is A4 in MIDI */
+    a->chroma_first = (unsigned int)ceil(audio_max(CHROMA_FREQ_MIN,bin_size / (pow(2, 1.0f / 12.0f) - 1.0f)) / bin_size);
+    a->chroma_last = audio_min(a->fftw_len - 1,(unsigned int)floor(audio_min(CHROMA_FREQ_MAX,processor->samplerate / 2) / bin_size));
+    if(a->chroma_first > a->chroma_last) {
+        a->chroma_first = a->chroma_last;
+    }
+    a->chroma_bins = (uint8_t *)malloc(a->chroma_last - a->chroma_first + 1);
+    if(!a->chroma_bins) {
+        goto fail;
+    }
+    for(i=a->chroma_first;i<=a->chroma_last;i++) {
+        a->chroma_bins[i - a->chroma_first] = (uint8_t)(((long)floor(12.0f * log2(i * bin_size / 440.0f) + 69.5f)) % 12);
+    }
+
+    memset(a->fftw_buffer,0,sizeof(audio_float) * a->buffer_len);
+    memset(a->fftw_in,0,sizeof(audio_float) * a->chunk_len * a->hops);
+
+    a->spectrum_cur = (frange *)malloc(sizeof(frange) * (a->spectrum_len + 1));
+    if(!a->spectrum_cur) {
+        goto fail;
+    }
+
+    a->amps = (audio_float *)malloc(sizeof(audio_float) * a->spectrum_len * (3 + a->hops));
+    if(!a->amps) {
+        goto fail;
+    }
+    a->peaks = a->amps + a->spectrum_len;
+    a->freqs = a->amps + (a->spectrum_len * 2);
+    a->substeps = a->amps + (a->spectrum_len * 3);
+    memset(a->substeps,0,sizeof(audio_float) * a->spectrum_len * a->hops);
+
+    if(a->config.hpss) {
+        a->harmonic = (audio_float *)malloc(sizeof(audio_float) * a->spectrum_len * (3 + AUDIO_HPSS_TIME * 2));
+        if(!a->harmonic) {
+            goto fail;
+        }
+        memset(a->harmonic,0,sizeof(audio_float) * a->spectrum_len * (3 + AUDIO_HPSS_TIME * 2));
+        a->percussive = a->harmonic + a->spectrum_len;
+        a->hpss_in = a->harmonic + (a->spectrum_len * 2);
+        a->hpss_history = a->harmonic + (a->spectrum_len * 3);
+        a->hpss_sorted = a->hpss_history + (a->spectrum_len * AUDIO_HPSS_TIME);
+        a->hpss_pos = 0;
+        a->hpss_count = 0;
+    }
+
+    if(a->config.engine == AUDIO_ENGINE_CQT) {
+        if(!spectrum_cqt(processor,a,freq_min,freq_max)) {
+            goto fail;
+        }
+    }
+    else if(a->config.scale == AUDIO_SCALE_LINEAR) {
+        spectrum_linear(a,bin_size,freq_min,freq_max);
+    }
+    else {
+        spectrum_log(a,bin_size,freq_min,freq_max);
+    }
+
+    for(i=0;i<a->spectrum_len+1;i++) {
+        a->spectrum_cur[i].amp = 0.0f;
+        a->spectrum_cur[i].prevamp = 0.0f;
+
+        if(a->spectrum_cur[i].last_bin > a->chunk_len / 2) {
+            a->spectrum_cur[i].last_bin = a->chunk_len / 2;
+        }
+        if(a->spectrum_cur[i].first_bin > a->spectrum_cur[i].last_bin) {
+            a->spectrum_cur[i].first_bin = a->spectrum_cur[i].last_bin;
+        }
+        /* figure out the ITU-R 468 weighting to apply */
+        a->spectrum_cur[i].boost = itur_468(a->spectrum_cur[i].freq);
+    }
+
+    for(i=0;i<a->spectrum_len;i++) {
+        a->amps[i] = 0.0f;
+        a->peaks[i] = 0.0f;
+        a->freqs[i] = a->spectrum_cur[i].freq;
+    }
+
+    return 1;
+
+    fail:
+    audio_analysis_free(a);
+    return 0;
+}
+
+enum AUDIO_JOB {
+    AUDIO_JOB_BUILD,
+    AUDIO_JOB_FREE,
+    AUDIO_JOB_QUIT,
+};
+
+typedef struct audio_job {
+    unsigned int type;
+    audio_analysis analysis;
+} audio_job;
+
+static int
+audio_processor_thread(void *userdata) {
+    audio_processor *processor = (audio_processor *)userdata;
+    audio_job *job = NULL;
+
+    while(1) {
+        job = (audio_job *)thread_queue_consume(&(processor->jobs));
+
+        switch(job->type) {
+            case AUDIO_JOB_BUILD: {
+                if(audio_analysis_init(processor,&(job->analysis))) {
+                    thread_queue_produce(&(processor->results),job);
                 }
                 else {
-                    r = buffer[s+3] << 8 | buffer[s+2];
+                    strerr_warn1x("warning: unable to apply audio configuration");
+                    free(job);
                 }
                 break;
             }
-            case 3: {
-                if(buffer[s+2] & 0x80) {
-                    l = 0xff << 24 | buffer[s+2] << 16 | buffer[s+1] << 8 | buffer[s];
-                }
-                else {
-                    l = buffer[s+2] << 16 | buffer[s+1] << 8 | buffer[s];
-                }
-                if(buffer[s+5] & 0x80) {
-                    r = 0xff << 24 | buffer[s+5] << 16 | buffer[s+4] << 8 | buffer[s+3];
-                }
-                else {
-                    r = buffer[s+5] << 16 | buffer[s+4] << 8 | buffer[s+3];
-                }
+            case AUDIO_JOB_FREE: {
+                audio_analysis_free(&(job->analysis));
+                free(job);
                 break;
             }
+            default: {
+                thread_exit(0);
+            }
         }
-        t = l;
-        t += r;
-        m = t / 2;
-        processor->fftw_buffer[o+i] = (double)m / processor->sample_max_val;
-        processor->fftw_in[o+i] = processor->fftw_buffer[o+i] * processor->window[i+o];
-        i++;
     }
-
+    return 0;
 }
 
+/* called between frames, replaces the current analysis
+ * with any newly-built ones and sends the old one off to be freed */
+static void
+audio_processor_swap(audio_processor *processor) {
+    audio_job *job = NULL;
+    audio_analysis old;
+    audio_analysis *a = NULL;
+    unsigned int len = 0;
+    unsigned int i = 0;
+
+    while(thread_queue_count(&(processor->results)) > 0) {
+        job = (audio_job *)thread_queue_consume(&(processor->results));
+        old = processor->analysis;
+        a = &(job->analysis);
+
+        /* carry over the sample history */
+        len = audio_min(old.buffer_len,a->buffer_len);
+        memcpy(a->fftw_buffer + a->buffer_len - len,
+               old.fftw_buffer + old.buffer_len - len,
+               sizeof(audio_float) * len);
+
+        if(old.spectrum_len == a->spectrum_len) {
+            for(i=0;i<a->spectrum_len;i++) {
+                a->spectrum_cur[i].amp = old.spectrum_cur[i].amp;
+                a->spectrum_cur[i].prevamp = old.spectrum_cur[i].prevamp;
+                a->amps[i] = old.amps[i];
+                a->peaks[i] = old.peaks[i];
+            }
+        }
+
+        processor->analysis = *a;
+        processor->config = a->config;
+        processor->reconfigured = 1;
+        processor->generation++;
+
+        if(processor->spectrogram.depth && processor->spectrogram.width != a->spectrum_len) {
+            if(!spectrogram_resize(&(processor->spectrogram),processor->spectrogram.depth,a->spectrum_len,processor->spectrogram.format)) {
+                strerr_warn1x("error: out of memory, disabling spectrogram");
+                spectrogram_resize(&(processor->spectrogram),0,0,processor->spectrogram.format);
+            }
+        }
+
+        if(processor->lookahead.frames && processor->lookahead.width != a->spectrum_len) {
+            if(!lookahead_resize(&(processor->lookahead),processor->lookahead.frames,a->spectrum_len)) {
+                strerr_warn1x("error: out of memory, disabling look-ahead bars");
+                lookahead_resize(&(processor->lookahead),0,0);
+            }
+        }
+
+        job->analysis = old;
+        job->type = AUDIO_JOB_FREE;
+        thread_queue_produce(&(processor->jobs),job);
+    }
+}
 
 void audio_processor_fftw(audio_processor *processor) {
+    audio_analysis *a = NULL;
+    audio_float fall = PEAK_FALL * processor->sample_window_len / processor->samplerate;
     if(ringbuf_memcpy_from(processor->output_buffer,processor->samples,processor->output_buffer_len) == NULL) {
         fprintf(stderr,"Warning - tried to underflow\n");
         return;
     }
+    audio_processor_swap(processor);
+    a = &(processor->analysis);
+
     (processor->audio_downmix_func)(processor);
+    audio_hops(processor);
 
     unsigned int i = 0;
+    unsigned int k = 0;
+    audio_float *sub = NULL;
 
-    if(!processor->plan) {
-        processor->plan = fftw_plan_dft_r2c_1d(processor->chunk_len,processor->fftw_in,processor->fftw_out,FFTW_MEASURE);
-    }
-
-    fftw_execute(processor->plan);
+    AUDIO_FFTW(execute)(a->plan);
 
-    for(i=0;i<processor->spectrum_len;i++) {
-        processor->spectrum_cur[i].amp = find_amplitude_max(processor->fftw_out,processor->spectrum_cur[i].first_bin,processor->spectrum_cur[i].last_bin,processor->chunk_len);
-
-        if(!isfinite(processor->spectrum_cur[i].amp)) {
-            processor->spectrum_cur[i].amp = -999.0f; /* filtered out next line */
+    for(k=0;k<a->hops;k++) {
+        if(a->config.engine == AUDIO_ENGINE_CQT) {
+            cqt_amplitudes(a,a->fftw_out + (k * a->fftw_len));
         }
-
-        processor->spectrum_cur[i].amp += processor->spectrum_cur[i].boost;
-
-        if(processor->spectrum_cur[i].amp <= -AMP_MIN) {
-            processor->spectrum_cur[i].amp = -AMP_MIN;
+        else {
+            fft_amplitudes(a,a->fftw_out + (k * a->fftw_len));
         }
 
-        processor->spectrum_cur[i].amp += AMP_MIN;
-
-        if(processor->spectrum_cur[i].amp > AMP_MAX) {
-            processor->spectrum_cur[i].amp = AMP_MAX;
+        sub = a->substeps + (k * a->spectrum_len);
+        for(i=0;i<a->spectrum_len;i++) {
+            sub[i] = amp_scale(a->spectrum_cur[i].amp,a->spectrum_cur[i].boost);
         }
+    }
 
-        processor->spectrum_cur[i].amp /= AMP_MAX;
+    rhythm_update(&(processor->rhythm),a);
+    chroma_update(&(processor->chroma),a);
 
-        processor->spectrum_cur[i].amp *= AMP_BOOST; /* i seem to rarely get results near 1.0, let's give this a boost */
+    for(i=0;i<a->spectrum_len;i++) {
+        a->spectrum_cur[i].amp = a->substeps[i];
+        for(k=1;k<a->hops;k++) {
+            sub = a->substeps + (k * a->spectrum_len);
+            if(a->config.hop_mode == AUDIO_HOP_MEAN) {
+                a->spectrum_cur[i].amp += sub[i];
+            }
+            else {
+                a->spectrum_cur[i].amp = audio_max(a->spectrum_cur[i].amp,sub[i]);
+            }
+        }
+        if(a->config.hop_mode == AUDIO_HOP_MEAN) {
+            a->spectrum_cur[i].amp /= a->hops;
+        }
 
-        if(processor->spectrum_cur[i].amp > 1.0f) {
-            processor->spectrum_cur[i].amp = 1.0f;
+        if(a->hpss_in) {
+            a->hpss_in[i] = a->spectrum_cur[i].amp;
         }
 
         if(processor->firstflag) {
-            if(processor->spectrum_cur[i].amp < processor->spectrum_cur[i].prevamp) {
-                processor->spectrum_cur[i].amp =
-                  processor->spectrum_cur[i].amp * SMOOTH_DOWN +
-                  processor->spectrum_cur[i].prevamp * ( 1 - SMOOTH_DOWN);
+            if(a->spectrum_cur[i].amp < a->spectrum_cur[i].prevamp) {
+                a->spectrum_cur[i].amp =
+                  a->spectrum_cur[i].amp * SMOOTH_DOWN +
+                  a->spectrum_cur[i].prevamp * ( 1 - SMOOTH_DOWN);
             }
             else {
-                processor->spectrum_cur[i].amp =
-                  processor->spectrum_cur[i].amp * SMOOTH_UP +
-                  processor->spectrum_cur[i].prevamp * ( 1 - SMOOTH_UP);
+                a->spectrum_cur[i].amp =
+                  a->spectrum_cur[i].amp * SMOOTH_UP +
+                  a->spectrum_cur[i].prevamp * ( 1 - SMOOTH_UP);
             }
         }
-        processor->spectrum_cur[i].prevamp = processor->spectrum_cur[i].amp;
+        a->spectrum_cur[i].prevamp = a->spectrum_cur[i].amp;
+
+        a->amps[i] = a->spectrum_cur[i].amp;
+        a->peaks[i] = audio_max(a->amps[i],a->peaks[i] - fall);
+    }
+
+    if(a->hpss_in) {
+        hpss_update(a);
+    }
+
+    if(processor->spectrogram.depth) {
+        spectrogram_push(&(processor->spectrogram),a->amps);
+    }
+
+    if(processor->lookahead.frames) {
+        lookahead_push(&(processor->lookahead),a->amps);
     }
 }
 
+int
+audio_processor_spectrogram(audio_processor *processor, unsigned int depth, unsigned int format) {
+    if(format > AUDIO_SPECTROGRAM_FLOAT) {
+        strerr_warn1x("error: unknown spectrogram format");
+        return 0;
+    }
+    if(depth > (1 << 16)) {
+        strerr_warn1x("error: spectrogram too deep, max is 65536");
+        return 0;
+    }
+    return spectrogram_resize(&(processor->spectrogram),depth,processor->analysis.spectrum_len,format);
+}
+
+int
+audio_processor_lookahead(audio_processor *processor, unsigned int frames) {
+    if(frames > AUDIO_LOOKAHEAD_MAX) {
+        strerr_warn1x("error: look-ahead too long, max is 300 frames");
+        return 0;
+    }
+    processor->generation++;
+    return lookahead_resize(&(processor->lookahead),frames,processor->analysis.spectrum_len);
+}
+
+int
+audio_processor_configure(audio_processor *processor, const audio_config *config) {
+    audio_analysis zero = AUDIO_ANALYSIS_ZERO;
+    audio_job *job = NULL;
+
+    if(!processor->thread) {
+        return 0;
+    }
+
+    if(!audio_config_check(processor,config)) {
+        return 0;
+    }
+
+    /* keeps the result queue from ever filling up */
+    if(thread_queue_count(&(processor->jobs)) + thread_queue_count(&(processor->results)) >= AUDIO_JOB_QUEUE_LEN / 2) {
+        strerr_warn1x("warning: too many audio configurations pending");
+        return 0;
+    }
+
+    job = (audio_job *)malloc(sizeof(audio_job));
+    if(!job) {
+        return 0;
+    }
+
+    job->type = AUDIO_JOB_BUILD;
+    job->analysis = zero;
+    job->analysis.config = *config;
+
+    thread_queue_produce(&(processor->jobs),job);
+    return 1;
+}
+
 int
 audio_processor_reload(audio_processor *processor) {
     if(processor->channels == 2) {
@@ -285,23 +1654,6 @@ int
 audio_processor_init(audio_processor *processor) {
     if(!processor) return 0;
 
-    unsigned int i = 0;
-    double bin_size = 0.0f;
-    double freq_min = 50.0f;
-    double freq_max = processor->samplerate / 2;
-    if(freq_max > 10000.0f) {
-        freq_max = 10000.0f;
-    }
-    double octaves = ceil(log2(freq_max / freq_min));
-    double interval = 1.0f / (octaves / (double)processor->spectrum_len);
-    /*
-    if(ceil(interval) - interval <= 0.5) {
-        interval = ceil(interval);
-    } else {
-        interval = floor(interval);
-    }
-    */
-
     if(processor->channels > 2) {
         strerr_warn1x("error: too many channels, max is 2");
         return 0;
@@ -311,19 +1663,13 @@ audio_processor_init(audio_processor *processor) {
         return 0;
     }
 
-    processor->chunk_len = 4096;
     processor->samples_available = 0;
 
     processor->samples_len = processor->samplerate * 4;
     processor->sample_window_len = processor->samplerate / processor->framerate;
-    while(processor->chunk_len < processor->sample_window_len) {
-        processor->chunk_len = processor->chunk_len * 2;
-    }
-
-    bin_size = (double)processor->samplerate / (double)processor->chunk_len;
 
-    processor->fftw_len = (processor->chunk_len / 2) + 1;
     processor->firstflag = 0;
+    processor->generation = 0;
     if(processor->samplesize > 1) {
         processor->sample_max_val = pow(2,(8*processor->samplesize-1));
     }
@@ -340,31 +1686,27 @@ audio_processor_init(audio_processor *processor) {
         processor->audio_downmix_func = &mono_downmix;
     }
 
-    processor->samples = ringbuf_new(processor->chunk_len * processor->samplesize * processor->channels);
-    if(!processor->samples) {
+    processor->analysis.config = processor->config;
+    if(!audio_analysis_init(processor,&(processor->analysis))) {
         return audio_processor_free(processor);
     }
 
-    processor->window = (double *)malloc(sizeof(double) * processor->chunk_len);
-    if(!processor->window) {
+    if(!rhythm_init(processor,&(processor->rhythm))) {
         return audio_processor_free(processor);
     }
-    for(i=0;i<processor->chunk_len;i++) {
-        processor->window[i] = window_blackman_harris(i,processor->chunk_len);
-    }
 
-    processor->fftw_buffer = (double *)fftw_malloc(sizeof(double) * processor->chunk_len);
-    if(!processor->fftw_buffer) {
+    if(!meter_init(processor,&(processor->meter))) {
         return audio_processor_free(processor);
     }
 
-    processor->fftw_in = (double *)fftw_malloc(sizeof(double) * processor->chunk_len);
-    if(!processor->fftw_in) {
+    if(!stereo_init(processor,&(processor->stereo))) {
         return audio_processor_free(processor);
     }
 
-    processor->fftw_out = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * processor->chunk_len);
-    if(!processor->fftw_out) {
+    chroma_init(processor,&(processor->chroma));
+
+    processor->samples = ringbuf_new(processor->analysis.chunk_len * processor->samplesize * processor->channels);
+    if(!processor->samples) {
         return audio_processor_free(processor);
     }
 
@@ -374,57 +1716,61 @@ audio_processor_init(audio_processor *processor) {
     }
 
     memset(processor->output_buffer,0,processor->output_buffer_len);
-    memset(processor->fftw_buffer,0,sizeof(double) * processor->chunk_len);
-    memset(processor->fftw_in,0,sizeof(double) * processor->chunk_len);
 
-    processor->spectrum_cur = (frange *)malloc(sizeof(frange) * (processor->spectrum_len + 1));
-    if(!processor->spectrum_cur) {
+    processor->waveform = (audio_float *)malloc(sizeof(audio_float) * processor->sample_window_len * (processor->channels + 1));
+    if(!processor->waveform) {
         return audio_processor_free(processor);
     }
-
-
-    for(i=0;i<processor->spectrum_len+1;i++) {
-        processor->spectrum_cur[i].amp = 0.0f;
-        processor->spectrum_cur[i].prevamp = 0.0f;
-        if(i==0) {
-            processor->spectrum_cur[i].freq = freq_min;
-        }
-        else {
-            /* see http://www.zytrax.com/tech/audio/calculator.html#centers_calc */
-            processor->spectrum_cur[i].freq = processor->spectrum_cur[i-1].freq * pow(10, 3 / (10 * interval));
-        }
-
-        /* fudging this a bit to avoid overlap */
-        double upper_freq = processor->spectrum_cur[i].freq * pow(10, (3 * 1) / (10 * 2 * floor(interval)));
-        double lower_freq = processor->spectrum_cur[i].freq / pow(10, (3 * 1) / (10 * 2 * ceil(interval)));
-
-        processor->spectrum_cur[i].first_bin = (unsigned int)floor(lower_freq / bin_size);
-        processor->spectrum_cur[i].last_bin = (unsigned int)floor(upper_freq / bin_size);
-
-        if(processor->spectrum_cur[i].last_bin > processor->chunk_len / 2) {
-            processor->spectrum_cur[i].last_bin = processor->chunk_len / 2;
-        }
-        /* figure out the ITU-R 468 weighting to apply */
-        processor->spectrum_cur[i].boost = itur_468(processor->spectrum_cur[i].freq);
-
+    memset(processor->waveform,0,sizeof(audio_float) * processor->sample_window_len * (processor->channels + 1));
+
+    thread_queue_init(&(processor->jobs),AUDIO_JOB_QUEUE_LEN,processor->job_values,0);
+    thread_queue_init(&(processor->results),AUDIO_JOB_QUEUE_LEN,processor->result_values,0);
+    processor->thread = thread_create(audio_processor_thread,processor,"audio thread",THREAD_STACK_SIZE_DEFAULT);
+    if(!processor->thread) {
+        thread_queue_term(&(processor->jobs));
+        thread_queue_term(&(processor->results));
+        return audio_processor_free(processor);
     }
+
     return 1;
 }
 
 int
 audio_processor_free(audio_processor *processor) {
+    audio_job quit;
+    audio_job *job = NULL;
+
+    if(processor->thread) {
+        quit.type = AUDIO_JOB_QUIT;
+        thread_queue_produce(&(processor->jobs),&quit);
+        thread_join(processor->thread);
+        thread_destroy(processor->thread);
+        processor->thread = NULL;
+
+        while(thread_queue_count(&(processor->results)) > 0) {
+            job = (audio_job *)thread_queue_consume(&(processor->results));
+            audio_analysis_free(&(job->analysis));
+            free(job);
+        }
+        thread_queue_term(&(processor->jobs));
+        thread_queue_term(&(processor->results));
+    }
+
     if(processor->samples) {
         ringbuf_free(&(processor->samples));
     }
 
-    if(processor->window) free(processor->window);
     if(processor->output_buffer) free(processor->output_buffer);
-    if(processor->plan) fftw_destroy_plan(processor->plan);
-    if(processor->fftw_in) fftw_free(processor->fftw_in);
-    if(processor->fftw_out) fftw_free(processor->fftw_out);
-    if(processor->fftw_buffer) fftw_free(processor->fftw_buffer);
-    if(processor->spectrum_cur) free(processor->spectrum_cur);
-    fftw_cleanup();
+    processor->output_buffer = NULL;
+    if(processor->waveform) free(processor->waveform);
+    processor->waveform = NULL;
+    audio_analysis_free(&(processor->analysis));
+    rhythm_free(&(processor->rhythm));
+    meter_free(&(processor->meter));
+    stereo_free(&(processor->stereo));
+    spectrogram_resize(&(processor->spectrogram),0,0,processor->spectrogram.format);
+    lookahead_resize(&(processor->lookahead),0,0);
+    AUDIO_FFTW(cleanup)();
     return 0;
 }
 
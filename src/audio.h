@@ -5,20 +5,363 @@
 #include <complex.h>
 #include <fftw3.h>
 #include "ringbuf.h"
+#include "thread.h"
 
 #define audio_min(a,b) ((a) < (b) ? (a) : (b) )
 #define audio_max(a,b) ((a) > (b) ? (a) : (b) )
 #define audio_notzero(a,b) ( ((a) == 0) ? (b) : (a) )
 
+/* build with -DAUDIO_FLOAT to run the analysis in single precision (fftw3f) */
+#ifdef AUDIO_FLOAT
+typedef float audio_float;
+typedef fftwf_complex audio_complex;
+typedef fftwf_plan audio_plan;
+#define AUDIO_FFTW(f) fftwf_ ## f
+#else
+typedef double audio_float;
+typedef fftw_complex audio_complex;
+typedef fftw_plan audio_plan;
+#define AUDIO_FFTW(f) fftw_ ## f
+#endif
+
+enum AUDIO_PLAN_EFFORT {
+    AUDIO_PLAN_MEASURE,
+    AUDIO_PLAN_ESTIMATE,
+    AUDIO_PLAN_PATIENT,
+};
+
+enum AUDIO_WINDOW {
+    AUDIO_WINDOW_BLACKMAN_HARRIS,
+    AUDIO_WINDOW_BLACKMAN,
+    AUDIO_WINDOW_HANN,
+    AUDIO_WINDOW_NONE,
+};
+
+enum AUDIO_SCALE {
+    AUDIO_SCALE_LOG,
+    AUDIO_SCALE_LINEAR,
+};
+
+enum AUDIO_ENGINE {
+    AUDIO_ENGINE_FFT,
+    AUDIO_ENGINE_CQT,
+};
+
+enum AUDIO_HOP_MODE {
+    AUDIO_HOP_MAX,
+    AUDIO_HOP_MEAN,
+};
+
+/* most analysis hops per video frame */
+#define AUDIO_HOPS_MAX 16
+
+/* most bars (spectrum_len) */
+#define AUDIO_BARS_MAX 16384
+
+enum AUDIO_SPECTROGRAM_FORMAT {
+    AUDIO_SPECTROGRAM_U8,
+    AUDIO_SPECTROGRAM_FLOAT,
+};
+
+#define AUDIO_JOB_QUEUE_LEN 8
+
 typedef struct frange {
-    double freq;
-    double amp;
-    double prevamp;
-    double boost;
+    audio_float freq;
+    audio_float amp;
+    audio_float prevamp;
+    audio_float boost;
     unsigned int first_bin;
     unsigned int last_bin;
+    unsigned int kernel_offset; /* constant-Q only, cqt_kernel[kernel_offset] is first_bin's weight */
 } frange;
 
+typedef struct audio_config {
+    unsigned int window;       /* AUDIO_WINDOW_BLACKMAN_HARRIS */
+    unsigned int fft_len;      /* minimum FFT size, rounded up to a power of 2 */
+    unsigned int spectrum_len; /* number of bars */
+    unsigned int scale;        /* AUDIO_SCALE_LOG, ignored by the constant-Q engine */
+    unsigned int engine;       /* AUDIO_ENGINE_FFT */
+    unsigned int hpss;         /* 0, set to split bars into harmonic/percussive parts */
+    unsigned int hops;         /* 1, FFTs per video frame */
+    unsigned int hop_mode;     /* AUDIO_HOP_MAX, how hops are combined into amps */
+    double freq_min;           /* 50 */
+    double freq_max;           /* 10000, capped at samplerate / 2 */
+} audio_config;
+
+#define AUDIO_CONFIG_ZERO { \
+    .window = AUDIO_WINDOW_BLACKMAN_HARRIS, \
+    .fft_len = 4096, \
+    .spectrum_len = 0, \
+    .scale = AUDIO_SCALE_LOG, \
+    .engine = AUDIO_ENGINE_FFT, \
+    .hpss = 0, \
+    .hops = 1, \
+    .hop_mode = AUDIO_HOP_MAX, \
+    .freq_min = 50.0f, \
+    .freq_max = 10000.0f, \
+}
+
+/* everything derived from an audio_config, built in one go
+ * so it can be replaced between frames */
+typedef struct audio_analysis {
+    audio_config config;
+
+    unsigned int chunk_len;         /* 4096 */
+    unsigned int fftw_len;   /* chunk_len / 2 + 1 */
+    unsigned int hops;
+    unsigned int buffer_len; /* chunk_len, plus a frame when there's more than one hop */
+
+    audio_float *window; /* window[chunk_len] */
+
+    /* hop k ends (k + 1) / hops of the way through the frame,
+     * all hops are transformed by one plan */
+    audio_float *fftw_buffer;   /* samples_mono[buffer_len] */
+    audio_float *fftw_in;   /* samples_mono[hops * chunk_len], windowed */
+    audio_complex *fftw_out; /*fftw_output[hops * fftw_len] */
+    audio_plan plan;
+
+    unsigned int spectrum_len;
+    frange *spectrum_cur;
+
+    /* per-band results, kept contiguous so Lua can read them in place.
+     * one allocation, amps[spectrum_len] then peaks, freqs and substeps */
+    audio_float *amps;
+    audio_float *peaks; /* amps, held and falling slowly */
+    audio_float *freqs;
+    audio_float *substeps; /* each hop's bars before smoothing, substeps[hops * spectrum_len] */
+
+    unsigned int cqt_kernel_len;
+    audio_complex *cqt_kernel; /* sparse spectral kernels, conjugated and scaled by 1/chunk_len */
+
+    unsigned int flux_first; /* bins used for spectral flux */
+    unsigned int flux_last;
+    int flux_primed; /* flux_prev holds the previous frame */
+    audio_float *flux_prev; /* compressed magnitudes, flux_prev[fftw_len] */
+
+    unsigned int chroma_first; /* bins folded into the chromagram */
+    unsigned int chroma_last;
+    uint8_t *chroma_bins; /* pitch class (0 = C) of each bin from chroma_first */
+
+    /* harmonic/percussive separation, only allocated when config.hpss is set.
+     * one allocation: harmonic, percussive and hpss_in are [spectrum_len],
+     * hpss_history and hpss_sorted are [AUDIO_HPSS_TIME * spectrum_len] */
+    audio_float *harmonic;
+    audio_float *percussive;
+    audio_float *hpss_in; /* this frame's bars, before smoothing */
+    audio_float *hpss_history; /* ring of hpss_in, by frame */
+    audio_float *hpss_sorted; /* each bar's history, sorted */
+    unsigned int hpss_pos;
+    unsigned int hpss_count;
+} audio_analysis;
+
+#define AUDIO_ANALYSIS_ZERO { \
+    .config = AUDIO_CONFIG_ZERO, \
+    .chunk_len = 0, \
+    .fftw_len = 0, \
+    .hops = 0, \
+    .buffer_len = 0, \
+    .window = NULL, \
+    .fftw_buffer = NULL, \
+    .fftw_in = NULL, \
+    .fftw_out = NULL, \
+    .plan = NULL, \
+    .spectrum_len = 0, \
+    .spectrum_cur = NULL, \
+    .amps = NULL, \
+    .peaks = NULL, \
+    .freqs = NULL, \
+    .substeps = NULL, \
+    .cqt_kernel_len = 0, \
+    .cqt_kernel = NULL, \
+    .flux_first = 0, \
+    .flux_last = 0, \
+    .flux_primed = 0, \
+    .flux_prev = NULL, \
+    .chroma_first = 0, \
+    .chroma_last = 0, \
+    .chroma_bins = NULL, \
+    .harmonic = NULL, \
+    .percussive = NULL, \
+    .hpss_in = NULL, \
+    .hpss_history = NULL, \
+    .hpss_sorted = NULL, \
+    .hpss_pos = 0, \
+    .hpss_count = 0, \
+}
+
+/* pitch classes and key, updated once per frame */
+typedef struct audio_chroma {
+    audio_float smooth; /* per-frame smoothing factors */
+    audio_float key_smooth;
+    audio_float chroma[12]; /* 0.0 - 1.0, chroma[0] is C */
+    audio_float profile[12]; /* long-term chroma, for the key */
+    unsigned int pitch; /* 0 - 11, strongest pitch class */
+    unsigned int key; /* 0 - 11 */
+    int minor;
+} audio_chroma;
+
+#define AUDIO_CHROMA_ZERO { \
+    .smooth = 0.0f, \
+    .key_smooth = 0.0f, \
+    .chroma = { 0.0f }, \
+    .profile = { 0.0f }, \
+    .pitch = 0, \
+    .key = 0, \
+    .minor = 0, \
+}
+
+/* the last depth rows of amps, as a ring.
+ * row r is data[r * width .. (r + 1) * width] */
+typedef struct audio_spectrogram {
+    unsigned int depth; /* 0 when disabled */
+    unsigned int width; /* spectrum_len */
+    unsigned int format; /* AUDIO_SPECTROGRAM_U8 */
+    unsigned int head; /* row written last */
+    unsigned int count; /* rows written so far, up to depth */
+    void *data; /* uint8_t (0 - 255) or float (0.0 - 1.0) */
+} audio_spectrogram;
+
+#define AUDIO_SPECTROGRAM_ZERO { \
+    .depth = 0, \
+    .width = 0, \
+    .format = AUDIO_SPECTROGRAM_U8, \
+    .head = 0, \
+    .count = 0, \
+    .data = NULL, \
+}
+
+/* most frames the analysis can run ahead */
+#define AUDIO_LOOKAHEAD_MAX 300
+
+/* amps from the last few frames, for when the analysis runs ahead of
+ * what's being played. rows is a ring, current is the oldest row */
+typedef struct audio_lookahead {
+    unsigned int frames; /* 0 when disabled */
+    unsigned int width; /* spectrum_len */
+    unsigned int pos; /* next row to replace */
+    audio_float *rows; /* rows[frames * width], then current[width] */
+    audio_float *current;
+} audio_lookahead;
+
+#define AUDIO_LOOKAHEAD_ZERO { \
+    .frames = 0, \
+    .width = 0, \
+    .pos = 0, \
+    .rows = NULL, \
+    .current = NULL, \
+}
+
+/* frames in the harmonic median filter */
+#define AUDIO_HPSS_TIME 17
+
+/* most bars on each side in the percussive median filter */
+#define AUDIO_HPSS_FREQ_HALF 32
+
+/* taps per phase of the 4x true-peak interpolator */
+#define AUDIO_TRUEPEAK_TAPS 12
+
+/* levels and loudness (ITU-R BS.1770), accumulated by the downmix */
+typedef struct audio_meter {
+    audio_float rms[2]; /* per channel, 0.0 - 1.0 */
+    audio_float peak[2];
+    audio_float true_peak[2];
+    double lufs_momentary; /* 400ms */
+    double lufs_short; /* 3s */
+
+    double sum[2]; /* per-frame accumulators */
+    double ksum;
+
+    double k1[5]; /* K-weighting biquads, b0 b1 b2 a1 a2 */
+    double k2[5];
+    double kz[2][4]; /* filter state per channel */
+
+    audio_float tp_coef[4][AUDIO_TRUEPEAK_TAPS];
+    audio_float tp_hist[2][AUDIO_TRUEPEAK_TAPS * 2]; /* written twice, read without wrapping */
+    unsigned int tp_pos[2];
+
+    unsigned int blocks_len; /* K-weighted mean square of each frame, for 3s */
+    unsigned int blocks_pos;
+    unsigned int blocks_count;
+    unsigned int momentary_len; /* frames in 400ms */
+    double *blocks;
+} audio_meter;
+
+#define AUDIO_METER_ZERO { \
+    .rms = { 0.0f, 0.0f }, \
+    .peak = { 0.0f, 0.0f }, \
+    .true_peak = { 0.0f, 0.0f }, \
+    .lufs_momentary = -70.0f, \
+    .lufs_short = -70.0f, \
+    .sum = { 0.0f, 0.0f }, \
+    .ksum = 0.0f, \
+    .k1 = { 0.0f }, \
+    .k2 = { 0.0f }, \
+    .kz = { { 0.0f } }, \
+    .tp_coef = { { 0.0f } }, \
+    .tp_hist = { { 0.0f } }, \
+    .tp_pos = { 0, 0 }, \
+    .blocks_len = 0, \
+    .blocks_pos = 0, \
+    .blocks_count = 0, \
+    .momentary_len = 0, \
+    .blocks = NULL, \
+}
+
+/* most vectorscope points kept per frame */
+#define AUDIO_VECTORSCOPE_POINTS 512
+
+/* stereo field, accumulated by the downmix */
+typedef struct audio_stereo {
+    audio_float correlation; /* -1.0 (out of phase) - 1.0 (mono) */
+    audio_float balance; /* -1.0 (left) - 1.0 (right) */
+
+    unsigned int points_step; /* samples per point */
+    unsigned int points_len;
+    audio_float *points; /* side (x) then mid (y), points[points_len * 2] */
+} audio_stereo;
+
+#define AUDIO_STEREO_ZERO { \
+    .correlation = 1.0f, \
+    .balance = 0.0f, \
+    .points_step = 0, \
+    .points_len = 0, \
+    .points = NULL, \
+}
+
+/* onset strength, beats and tempo, updated once per frame */
+typedef struct audio_rhythm {
+    audio_float fps; /* samplerate / sample_window_len */
+    audio_float decay; /* per-frame decay of flux_max */
+    audio_float flux_max;
+    audio_float flux[2]; /* flux of the previous two frames */
+
+    unsigned int history_len; /* onset envelope, for tempo */
+    unsigned int history_pos;
+    unsigned int history_count;
+    audio_float *history;
+
+    unsigned int since_beat; /* frames */
+
+    audio_float onset; /* 0.0 - 1.0 */
+    int beat; /* set on frames with a beat */
+    audio_float bpm; /* 0 until there's enough history */
+} audio_rhythm;
+
+#define AUDIO_RHYTHM_ZERO { \
+    .fps = 0.0f, \
+    .decay = 0.0f, \
+    .flux_max = 0.0f, \
+    .flux = { 0.0f, 0.0f }, \
+    .history_len = 0, \
+    .history_pos = 0, \
+    .history_count = 0, \
+    .history = NULL, \
+    .since_beat = 0, \
+    .onset = 0.0f, \
+    .beat = 0, \
+    .bpm = 0.0f, \
+}
+
 typedef struct audio_processor {
     unsigned int samplerate;
     unsigned int channels;
@@ -29,24 +372,39 @@ typedef struct audio_processor {
 
     unsigned int samples_len; /* samplerate * 4 */
     unsigned int sample_window_len; /* samplerate/framerate */
-    unsigned int chunk_len;         /* 2048 */
-    unsigned int fftw_len;   /* chunk_len / 2 - 1 */
-    double sample_max_val; /* pow(2,(8*samplesize-1)) */
+    audio_float sample_max_val; /* pow(2,(8*samplesize-1)) */
     int firstflag;
 
     ringbuf_t samples;
-    double *window; /* window[chunk_len] */
 
-    double *fftw_buffer;   /* samples_mono[chunk_len] */
-    double *fftw_in;   /* samples_mono[chunk_len] */
-    fftw_complex *fftw_out; /*fftw_output[fftw_len] */
-    fftw_plan plan;
+    audio_config config; /* used by audio_processor_init */
+    audio_analysis analysis;
+    int reconfigured; /* set when a new analysis was swapped in */
+    unsigned int generation; /* bumped whenever the analysis or look-ahead arrays are replaced */
+    audio_rhythm rhythm;
+    audio_spectrogram spectrogram;
+    audio_lookahead lookahead;
+    audio_meter meter;
+    audio_stereo stereo;
+    audio_chroma chroma;
 
-    unsigned int spectrum_len;
-    frange *spectrum_cur;
+    const char *wisdom_file; /* optional, imported before and exported after planning */
+    unsigned int plan_effort; /* AUDIO_PLAN_MEASURE */
+
+    /* analyses are planned/freed on a separate thread,
+     * since the FFTW planner can take a while */
+    thread_ptr_t thread;
+    thread_queue_t jobs;
+    thread_queue_t results;
+    void *job_values[AUDIO_JOB_QUEUE_LEN];
+    void *result_values[AUDIO_JOB_QUEUE_LEN];
 
     unsigned int output_buffer_len;
     char *output_buffer; /* output_buffer[sample_window_len * samplesize * channels] */
+
+    /* the current frame's samples, filled by the downmix.
+     * waveform[0 .. sample_window_len] is mono, followed by each channel */
+    audio_float *waveform;
     void (*audio_downmix_func)(struct audio_processor *);
 
 } audio_processor;
@@ -59,19 +417,24 @@ typedef struct audio_processor {
     .samples_available = 0, \
     .samples_len = 0, \
     .sample_window_len = 0, \
-    .chunk_len = 0, \
-    .fftw_len = 0, \
     .sample_max_val = 0.0f, \
     .firstflag = 0, \
     .samples = NULL, \
-    .window = NULL, \
-    .fftw_in = NULL, \
-    .fftw_out = NULL, \
-    .plan = NULL, \
-    .spectrum_len = 0, \
-    .spectrum_cur = NULL, \
+    .config = AUDIO_CONFIG_ZERO, \
+    .analysis = AUDIO_ANALYSIS_ZERO, \
+    .reconfigured = 0, \
+    .rhythm = AUDIO_RHYTHM_ZERO, \
+    .spectrogram = AUDIO_SPECTROGRAM_ZERO, \
+    .lookahead = AUDIO_LOOKAHEAD_ZERO, \
+    .meter = AUDIO_METER_ZERO, \
+    .stereo = AUDIO_STEREO_ZERO, \
+    .chroma = AUDIO_CHROMA_ZERO, \
+    .wisdom_file = NULL, \
+    .plan_effort = AUDIO_PLAN_MEASURE, \
+    .thread = NULL, \
     .output_buffer_len = 0, \
     .output_buffer = NULL, \
+    .waveform = NULL, \
     .audio_downmix_func = NULL, \
 }
 
@@ -88,6 +451,23 @@ audio_processor_reload(audio_processor *processor);
 int
 audio_processor_free(audio_processor *processor);
 
+int
+audio_processor_configure(audio_processor *processor, const audio_config *config);
+
+int audio_window_scan(const char *s, unsigned int *window);
+int audio_scale_scan(const char *s, unsigned int *scale);
+int audio_engine_scan(const char *s, unsigned int *engine);
+int audio_hop_mode_scan(const char *s, unsigned int *mode);
+int audio_spectrogram_format_scan(const char *s, unsigned int *format);
+
+/* resizes (and clears) the spectrogram, depth 0 disables it */
+int
+audio_processor_spectrogram(audio_processor *processor, unsigned int depth, unsigned int format);
+
+/* lookahead.current follows amps, frames behind. 0 disables it */
+int
+audio_processor_lookahead(audio_processor *processor, unsigned int frames);
+
 void audio_processor_fftw(audio_processor *processor);
 void write_mono_buffer(int fd, audio_processor *p);
 void audio_processor_copy_amps(audio_processor *processor);
@@ -0,0 +1,488 @@
+#include "font.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FONT_LINE 512
+
+/* bytes of scaled glyph masks kept per font */
+#define FONT_MASK_BUDGET (4 * 1024 * 1024)
+
+/* bytes of rendered strings kept per font, no one string gets more
+ * than a quarter of it */
+#define FONT_STRING_BUDGET (8 * 1024 * 1024)
+
+/* glyph masks are reference counted, the cache holds one reference and
+ * font_mask_ref adds more */
+typedef struct font_mask_data {
+    unsigned int refs;
+    uint8_t mask[];
+} font_mask_data;
+
+#define font_mask_data_of(m) ((font_mask_data *)((m) - offsetof(font_mask_data,mask)))
+
+static int
+font_keyword(const char *line, const char *keyword) {
+    size_t len = strlen(keyword);
+    return strncmp(line,keyword,len) == 0;
+}
+
+static int
+font_hex(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int
+font_grow(void **ptr, unsigned int *size, unsigned int need, unsigned int member) {
+    unsigned int s = *size ? *size : 64;
+    void *t;
+    if(need <= *size) return 0;
+    while(s < need) s *= 2;
+    t = realloc(*ptr,(size_t)s * member);
+    if(t == NULL) return 1;
+    *ptr = t;
+    *size = s;
+    return 0;
+}
+
+static int
+font_glyph_cmp(const void *a, const void *b) {
+    const font_glyph *ga = (const font_glyph *)a;
+    const font_glyph *gb = (const font_glyph *)b;
+    if(ga->codepoint != gb->codepoint) return ga->codepoint < gb->codepoint ? -1 : 1;
+    /* duplicates keep file order, the last one wins */
+    return ga->offset < gb->offset ? -1 : ga->offset > gb->offset;
+}
+
+/* sets the bits of one BITMAP line, columns start at the glyph's
+ * BBX x offset and anything past the advance width is dropped */
+static void
+font_row(font *f, const font_glyph *g, unsigned int row, int bbx, const char *line) {
+    uint8_t *dst = f->bits + g->offset + (row * ((g->width + 7) / 8));
+    unsigned int i = 0;
+    unsigned int j = 0;
+    int x = 0;
+    int n = 0;
+
+    for(i=0;(n = font_hex(line[i])) != -1;i++) {
+        for(j=0;j<4;j++) {
+            if(!(n & (8 >> j))) continue;
+            x = bbx + (int)(i * 4 + j);
+            if(x < 0 || (unsigned int)x >= g->width) continue;
+            dst[x / 8] |= (uint8_t)(0x80 >> (x % 8));
+        }
+    }
+}
+
+font *
+font_load(const char *filename) {
+    FILE *file = NULL;
+    font *f = NULL;
+    font_glyph *g = NULL;
+    char line[FONT_LINE];
+    unsigned int glyphs_size = 0;
+    unsigned int bits_size = 0;
+    unsigned int len = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+    long encoding = -1;
+    int dwidth = 0;
+    int cur_width = 0;
+    int cur_height = 0;
+    int cur_bbx = 0;
+    int cur_bby = 0;
+    int bitmap_line = -1;
+    int rel_line = 0;
+    int have_bbox = 0;
+    int c = 0;
+
+    file = fopen(filename,"rb");
+    if(file == NULL) return NULL;
+
+    f = (font *)malloc(sizeof(font));
+    if(f == NULL) goto error;
+    memset(f,0,sizeof(font));
+
+    while(fgets(line,FONT_LINE,file) != NULL) {
+        len = strlen(line);
+        if(len == FONT_LINE - 1 && line[len-1] != '\n') {
+            /* overlong line, nothing we use is this long */
+            while((c = fgetc(file)) != EOF && c != '\n');
+            line[0] = '\0';
+        }
+
+        if(bitmap_line >= 0) {
+            if(font_keyword(line,"ENDCHAR")) {
+                bitmap_line = -1;
+                g = NULL;
+                continue;
+            }
+            if(g != NULL) {
+                rel_line = (int)f->height - (cur_height - bitmap_line - f->bby + cur_bby);
+                if(rel_line >= 0 && rel_line < (int)f->height) {
+                    font_row(f,g,(unsigned int)rel_line,cur_bbx,line);
+                }
+            }
+            bitmap_line++;
+        }
+        else if(font_keyword(line,"FONTBOUNDINGBOX")) {
+            if(sscanf(line + 15,"%d %d %d %d",&cur_width,&cur_height,&f->bbx,&f->bby) != 4
+              || cur_width < 0 || cur_height <= 0) goto error;
+            f->width = (unsigned int)cur_width;
+            f->height = (unsigned int)cur_height;
+            have_bbox = 1;
+        }
+        else if(font_keyword(line,"ENCODING")) {
+            if(sscanf(line + 8,"%ld",&encoding) != 1) encoding = -1;
+        }
+        else if(font_keyword(line,"DWIDTH")) {
+            sscanf(line + 6,"%d",&dwidth);
+        }
+        else if(font_keyword(line,"BBX")) {
+            sscanf(line + 3,"%d %d %d %d",&cur_width,&cur_height,&cur_bbx,&cur_bby);
+        }
+        else if(font_keyword(line,"BITMAP")) {
+            if(!have_bbox) goto error;
+            bitmap_line = 0;
+            if(encoding < 0 || encoding > 0x10ffff) continue;
+
+            if(cur_bbx < 0) {
+                dwidth -= cur_bbx;
+                cur_bbx = 0;
+            }
+            if(cur_bbx + cur_width > dwidth) {
+                dwidth = cur_bbx + cur_width;
+            }
+            if(dwidth < 0) dwidth = 0;
+
+            len = ((unsigned int)dwidth + 7) / 8 * f->height;
+            if(font_grow((void **)&f->glyphs,&glyphs_size,f->count + 1,sizeof(font_glyph))) goto error;
+            if(font_grow((void **)&f->bits,&bits_size,f->bits_len + len,1)) goto error;
+
+            g = &f->glyphs[f->count++];
+            g->codepoint = (uint32_t)encoding;
+            g->width = (unsigned int)dwidth;
+            g->offset = f->bits_len;
+            memset(f->bits + f->bits_len,0,len);
+            f->bits_len += len;
+        }
+    }
+
+    if(ferror(file) || !have_bbox) goto error;
+    fclose(file);
+    file = NULL;
+
+    qsort(f->glyphs,f->count,sizeof(font_glyph),font_glyph_cmp);
+    for(i=0,j=0;i<f->count;i++) {
+        if(i + 1 < f->count && f->glyphs[i+1].codepoint == f->glyphs[i].codepoint) continue;
+        f->glyphs[j++] = f->glyphs[i];
+    }
+    f->count = j;
+
+    for(i=0;i<256;i++) {
+        f->latin[i] = -1;
+    }
+    for(i=0;i<f->count && f->glyphs[i].codepoint < 256;i++) {
+        f->latin[f->glyphs[i].codepoint] = (int)i;
+    }
+
+    return f;
+
+    error:
+    if(file != NULL) fclose(file);
+    font_free(f);
+    return NULL;
+}
+
+uint8_t *
+font_mask_ref(const font_mask *m) {
+    font_mask_data_of(m->mask)->refs++;
+    return m->mask;
+}
+
+void
+font_mask_unref(const uint8_t *mask) {
+    font_mask_data *d = font_mask_data_of((uint8_t *)mask);
+    if(--d->refs == 0) free(d);
+}
+
+static void
+font_masks_clear(font *f) {
+    unsigned int i = 0;
+    for(i=0;i<f->masks_size;i++) {
+        if(f->masks[i].mask != NULL) font_mask_unref(f->masks[i].mask);
+        f->masks[i].mask = NULL;
+    }
+    f->masks_count = 0;
+    f->masks_bytes = 0;
+}
+
+/* whether width x height scaled by scale fits in limit bytes, checked
+ * without overflowing */
+static int
+font_mask_fits(unsigned long width, unsigned long height, unsigned int scale, unsigned long limit) {
+    if(scale == 0 || scale > FONT_SCALE_MAX) return 0;
+    if(width > limit / scale || height > limit / scale) return 0;
+    width *= scale;
+    height *= scale;
+    return width == 0 || height <= limit / width;
+}
+
+static unsigned int
+font_mask_slot(const font_mask *masks, unsigned int size, uint32_t codepoint, unsigned int scale) {
+    unsigned int i = ((codepoint * 2654435761u) ^ (scale * 40503u)) & (size - 1);
+    while(masks[i].mask != NULL && (masks[i].codepoint != codepoint || masks[i].scale != scale)) {
+        i = (i + 1) & (size - 1);
+    }
+    return i;
+}
+
+static int
+font_masks_grow(font *f) {
+    unsigned int size = f->masks_size ? f->masks_size * 2 : 256;
+    unsigned int i = 0;
+    font_mask *masks = (font_mask *)calloc(size,sizeof(font_mask));
+    if(masks == NULL) return 1;
+
+    for(i=0;i<f->masks_size;i++) {
+        if(f->masks[i].mask == NULL) continue;
+        masks[font_mask_slot(masks,size,f->masks[i].codepoint,f->masks[i].scale)] = f->masks[i];
+    }
+    free(f->masks);
+    f->masks = masks;
+    f->masks_size = size;
+    return 0;
+}
+
+const font_mask *
+font_glyph_mask(font *f, const font_glyph *g, unsigned int scale) {
+    font_mask *m = NULL;
+    font_mask_data *d = NULL;
+    uint8_t *row = NULL;
+    unsigned int len = 0;
+    unsigned int x = 0;
+    unsigned int y = 0;
+    unsigned int i = 0;
+
+    if(!font_mask_fits(g->width,f->height,scale,FONT_MASK_BUDGET)) return NULL;
+
+    if(f->masks_size) {
+        m = &f->masks[font_mask_slot(f->masks,f->masks_size,g->codepoint,scale)];
+        if(m->mask != NULL) return m;
+    }
+
+    len = g->width * scale * f->height * scale;
+    if(f->masks_bytes + len > FONT_MASK_BUDGET) {
+        font_masks_clear(f);
+    }
+    if((f->masks_count + 1) * 2 > f->masks_size) {
+        if(font_masks_grow(f)) return NULL;
+    }
+
+    m = &f->masks[font_mask_slot(f->masks,f->masks_size,g->codepoint,scale)];
+    d = (font_mask_data *)malloc(sizeof(font_mask_data) + len);
+    if(d == NULL) return NULL;
+    d->refs = 1;
+    m->mask = d->mask;
+    m->codepoint = g->codepoint;
+    m->scale = scale;
+    m->width = g->width * scale;
+    m->height = f->height * scale;
+    f->masks_count++;
+    f->masks_bytes += len;
+
+    /* widen each row once, then repeat it */
+    for(y=0;y<f->height;y++) {
+        row = m->mask + (y * scale * m->width);
+        for(x=0;x<g->width;x++) {
+            memset(row + (x * scale),font_glyph_pixel(f,g,x,y) ? 255 : 0,scale);
+        }
+        for(i=1;i<scale;i++) {
+            memcpy(row + (i * m->width),row,m->width);
+        }
+    }
+
+    return m;
+}
+
+static void
+font_string_evict(font *f, font_string *s) {
+    f->strings_bytes -= (s->mask.width * s->mask.height) + s->len;
+    free(s->text);
+    free(s->mask.mask);
+    memset(s,0,sizeof(font_string));
+}
+
+static uint32_t
+font_string_hash(const char *str, unsigned int len, unsigned int scale) {
+    uint32_t h = 2166136261u ^ scale;
+    unsigned int i = 0;
+    for(i=0;i<len;i++) {
+        h = (h ^ (uint8_t)str[i]) * 16777619u;
+    }
+    return h;
+}
+
+static const font_glyph *
+font_glyph_or_space(const font *f, uint32_t codepoint) {
+    const font_glyph *g = font_glyph_find(f,codepoint);
+    return g == NULL ? font_glyph_find(f,32) : g;
+}
+
+const font_mask *
+font_string_mask(font *f, const char *str, unsigned int len, unsigned int scale) {
+    uint32_t hash = font_string_hash(str,len,scale);
+    font_string *s = NULL;
+    font_string *oldest = NULL;
+    const font_glyph *g = NULL;
+    const font_mask *m = NULL;
+    const char *p = NULL;
+    const char *end = str + len;
+    unsigned long width = 0;
+    unsigned long bytes = 0;
+    unsigned int x = 0;
+    unsigned int y = 0;
+    unsigned int i = 0;
+
+    if(scale == 0 || scale > FONT_SCALE_MAX) return NULL;
+    f->strings_tick++;
+
+    for(i=0;i<FONT_STRINGS;i++) {
+        s = &f->strings[i];
+        if(s->text != NULL && s->hash == hash && s->len == len && s->mask.scale == scale
+           && memcmp(s->text,str,len) == 0) {
+            s->used = f->strings_tick;
+            return &s->mask;
+        }
+    }
+
+    for(p=str;p<end;) {
+        g = font_glyph_or_space(f,font_utf8_next(&p,end));
+        if(g != NULL) width += g->width;
+        if(width > FONT_STRING_BUDGET) return NULL;
+    }
+    if(len > FONT_STRING_BUDGET / 4
+       || !font_mask_fits(width,f->height,scale,FONT_STRING_BUDGET / 4 - len)) return NULL;
+    width *= scale;
+    bytes = (width * f->height * scale) + len;
+
+    for(;;) {
+        s = NULL;
+        oldest = NULL;
+        for(i=0;i<FONT_STRINGS;i++) {
+            if(f->strings[i].text == NULL) {
+                if(s == NULL) s = &f->strings[i];
+            }
+            else if(oldest == NULL || f->strings_tick - f->strings[i].used > f->strings_tick - oldest->used) {
+                oldest = &f->strings[i];
+            }
+        }
+        if(s != NULL && f->strings_bytes + bytes <= FONT_STRING_BUDGET) break;
+        font_string_evict(f,oldest);
+    }
+
+    s->text = (char *)malloc(len ? len : 1);
+    s->mask.mask = (uint8_t *)calloc(bytes - len ? bytes - len : 1,1);
+    if(s->text == NULL || s->mask.mask == NULL) {
+        free(s->text);
+        free(s->mask.mask);
+        memset(s,0,sizeof(font_string));
+        return NULL;
+    }
+    memcpy(s->text,str,len);
+    s->len = len;
+    s->hash = hash;
+    s->used = f->strings_tick;
+    s->mask.scale = scale;
+    s->mask.width = width;
+    s->mask.height = f->height * scale;
+    f->strings_bytes += bytes;
+
+    /* copy each scaled glyph into place */
+    for(p=str;p<end;) {
+        g = font_glyph_or_space(f,font_utf8_next(&p,end));
+        if(g == NULL) continue;
+        m = font_glyph_mask(f,g,scale);
+        if(m == NULL) {
+            font_string_evict(f,s);
+            return NULL;
+        }
+        for(y=0;y<m->height;y++) {
+            memcpy(s->mask.mask + (y * s->mask.width) + x,m->mask + (y * m->width),m->width);
+        }
+        x += m->width;
+    }
+
+    return &s->mask;
+}
+
+void
+font_free(font *f) {
+    unsigned int i = 0;
+    if(f == NULL) return;
+    for(i=0;i<FONT_STRINGS;i++) {
+        if(f->strings[i].text != NULL) font_string_evict(f,&f->strings[i]);
+    }
+    font_masks_clear(f);
+    free(f->masks);
+    free(f->glyphs);
+    free(f->bits);
+    free(f);
+}
+
+const font_glyph *
+font_glyph_find(const font *f, uint32_t codepoint) {
+    unsigned int lo = 0;
+    unsigned int hi = f->count;
+    unsigned int mid = 0;
+
+    if(codepoint < 256) {
+        return f->latin[codepoint] == -1 ? NULL : &f->glyphs[f->latin[codepoint]];
+    }
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(f->glyphs[mid].codepoint == codepoint) return &f->glyphs[mid];
+        if(f->glyphs[mid].codepoint < codepoint) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+uint32_t
+font_utf8_next(const char **s, const char *end) {
+    const uint8_t *p = (const uint8_t *)*s;
+    uint32_t val = p[0];
+    unsigned int seq = 0;
+    unsigned int i = 0;
+
+    if(val < 0x80) seq = 0;
+    else if(val >= 0xc0 && val < 0xe0) { seq = 1; val &= 0x1f; }
+    else if(val >= 0xe0 && val < 0xf0) { seq = 2; val &= 0x0f; }
+    else if(val >= 0xf0 && val < 0xf8) { seq = 3; val &= 0x07; }
+
+    for(i=1;i<=seq;i++) {
+        if((const char *)p + i >= end || (p[i] & 0xc0) != 0x80) {
+            /* broken sequence, pass the lead byte through */
+            *s += 1;
+            return p[0];
+        }
+        val = (val << 6) | (p[i] & 0x3f);
+    }
+
+    *s += seq + 1;
+    return val;
+}
+
+#ifdef __cplusplus
+}
+#endif
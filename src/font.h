@@ -0,0 +1,111 @@
+#ifndef FONT_H
+#define FONT_H
+
+#include <stdint.h>
+
+/* one glyph, its bitmap is font->height rows of (width + 7) / 8 bytes
+ * starting at font->bits + offset, top row first, most significant
+ * bit is the leftmost pixel */
+typedef struct font_glyph {
+    uint32_t codepoint;
+    unsigned int width;
+    unsigned int offset;
+} font_glyph;
+
+/* a glyph scaled up for drawing, one coverage byte per pixel
+ * (0 or 255), top row first */
+typedef struct font_mask {
+    uint32_t codepoint;
+    unsigned int scale;
+    unsigned int width;
+    unsigned int height;
+    uint8_t *mask;
+} font_mask;
+
+/* the largest scale glyphs and strings are drawn at */
+#define FONT_SCALE_MAX 256
+
+/* rendered strings kept per font, see font_string_mask */
+#define FONT_STRINGS 64
+
+typedef struct font_string {
+    char *text; /* NULL for an empty slot */
+    unsigned int len;
+    uint32_t hash;
+    unsigned int used; /* last lookup, the oldest is evicted first */
+    font_mask mask;
+} font_string;
+
+typedef struct font {
+    unsigned int width;  /* FONTBOUNDINGBOX */
+    unsigned int height;
+    int bbx;
+    int bby;
+    unsigned int count;
+    font_glyph *glyphs; /* sorted by codepoint */
+    uint8_t *bits;
+    unsigned int bits_len;
+    int latin[256]; /* glyph index of the first 256 codepoints, or -1 */
+    font_mask *masks; /* open addressed by codepoint and scale */
+    unsigned int masks_size;
+    unsigned int masks_count;
+    unsigned int masks_bytes;
+    font_string strings[FONT_STRINGS];
+    unsigned int strings_bytes;
+    unsigned int strings_tick;
+} font;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* parses a BDF file, returns NULL on error */
+font *
+font_load(const char *filename);
+
+void
+font_free(font *f);
+
+const font_glyph *
+font_glyph_find(const font *f, uint32_t codepoint);
+
+/* returns g scaled by scale, cached on the font. the cache is emptied
+ * when it grows past its budget, so the mask is only good until the
+ * next call. NULL if scale is 0 or over FONT_SCALE_MAX, if the mask
+ * wouldn't fit in the cache's budget, or if memory runs out */
+const font_mask *
+font_glyph_mask(font *f, const font_glyph *g, unsigned int scale);
+
+/* keeps a mask from font_glyph_mask alive after the cache lets go of it,
+ * even past font_free, until font_mask_unref. returns m->mask */
+uint8_t *
+font_mask_ref(const font_mask *m);
+
+void
+font_mask_unref(const uint8_t *mask);
+
+/* returns str (len bytes of UTF-8) drawn at scale as one mask, codepoints
+ * the font doesn't have are drawn as a space. rendered strings are cached
+ * on the font and the least recently used are evicted to stay under a
+ * memory budget, the mask is good until the next call. NULL if the string
+ * is too big to cache or memory runs out */
+const font_mask *
+font_string_mask(font *f, const char *str, unsigned int len, unsigned int scale);
+
+/* x and y are 0-based, y = 0 is the top row */
+static inline int
+font_glyph_pixel(const font *f, const font_glyph *g, unsigned int x, unsigned int y) {
+    if(x >= g->width || y >= f->height) return 0;
+    return (f->bits[g->offset + (y * ((g->width + 7) / 8)) + (x / 8)] >> (7 - (x % 8))) & 1;
+}
+
+/* decodes the codepoint at *s and advances it, invalid bytes are
+ * returned as-is */
+uint32_t
+font_utf8_next(const char **s, const char *end);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
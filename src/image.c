@@ -1,4 +1,10 @@
 #include "image.h"
+#include <string.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -51,24 +57,1637 @@ flip_and_bgr(uint8_t *image, unsigned int width, unsigned int height, unsigned i
     free(temp_row);
 }
 
+/* blend kernels, all modes use the same fixed-point lerp:
+ * dst = (dst * (256 - a) + src * (1 + a)) >> 8,
+ * which is exact at a = 0 and a = 255 and never overflows 16 bits */
+
+static const char * const blend_mode_names[] = {
+    "alpha",
+    "add",
+    "multiply",
+    NULL,
+};
+
+typedef void (*blend_func)(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a);
+
+typedef struct blend_ops {
+    const char *name;
+    blend_func modes[3]; /* indexed by IMAGE_BLEND_MODE, len is in bytes */
+    blend_func rgba; /* BGRA over BGR, len is in pixels */
+} blend_ops;
+
+static void
+blend_alpha_scalar(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a) {
+    unsigned int alpha = 1 + a;
+    unsigned int alpha_inv = 256 - a;
+    unsigned int i = 0;
+
+    for(i=0;i<len;i++) {
+        dst[i] = ((dst[i] * alpha_inv) + (src[i] * alpha)) >> 8;
+    }
+}
+
+static void
+blend_add_scalar(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a) {
+    unsigned int alpha = 1 + a;
+    unsigned int v = 0;
+    unsigned int i = 0;
+
+    for(i=0;i<len;i++) {
+        v = dst[i] + ((src[i] * alpha) >> 8);
+        dst[i] = v > 255 ? 255 : v;
+    }
+}
+
+static void
+blend_multiply_scalar(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a) {
+    unsigned int alpha = 1 + a;
+    unsigned int alpha_inv = 256 - a;
+    unsigned int m = 0;
+    unsigned int i = 0;
+
+    for(i=0;i<len;i++) {
+        m = (dst[i] * (src[i] + 1)) >> 8;
+        dst[i] = ((dst[i] * alpha_inv) + (m * alpha)) >> 8;
+    }
+}
+
+static void
+blend_rgba_scalar(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a) {
+    unsigned int pa = 0;
+    unsigned int i = 0;
+
+    for(i=0;i<len;i++) {
+        pa = (src[3] * (1 + a)) >> 8;
+        dst[0] = ((dst[0] * (256 - pa)) + (src[0] * (1 + pa))) >> 8;
+        dst[1] = ((dst[1] * (256 - pa)) + (src[1] * (1 + pa))) >> 8;
+        dst[2] = ((dst[2] * (256 - pa)) + (src[2] * (1 + pa))) >> 8;
+        dst += 3;
+        src += 4;
+    }
+}
+
+static const blend_ops blend_scalar = {
+    "scalar",
+    { blend_alpha_scalar, blend_add_scalar, blend_multiply_scalar },
+    blend_rgba_scalar,
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_BLEND_X86
+
+/* 8 lanes of dst * inv + src * al, shifted back down to 0-255 */
+static inline __attribute__((target("sse2"))) __m128i
+lerp_sse2(__m128i d, __m128i s, __m128i inv, __m128i al) {
+    return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(d,inv),_mm_mullo_epi16(s,al)),8);
+}
+
+static __attribute__((target("sse2"))) void
+blend_alpha_sse2(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i inv = _mm_set1_epi16(256 - a);
+    __m128i al = _mm_set1_epi16(1 + a);
+    __m128i d;
+    __m128i s;
+    unsigned int i = 0;
+
+    for(i=0;i + 16 <= len;i+=16) {
+        d = _mm_loadu_si128((const __m128i *)(dst + i));
+        s = _mm_loadu_si128((const __m128i *)(src + i));
+        d = _mm_packus_epi16(
+          lerp_sse2(_mm_unpacklo_epi8(d,zero),_mm_unpacklo_epi8(s,zero),inv,al),
+          lerp_sse2(_mm_unpackhi_epi8(d,zero),_mm_unpackhi_epi8(s,zero),inv,al));
+        _mm_storeu_si128((__m128i *)(dst + i),d);
+    }
+    blend_alpha_scalar(dst + i,src + i,len - i,a);
+}
+
+static __attribute__((target("sse2"))) void
+blend_add_sse2(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i al = _mm_set1_epi16(1 + a);
+    __m128i d;
+    __m128i s;
+    unsigned int i = 0;
+
+    for(i=0;i + 16 <= len;i+=16) {
+        d = _mm_loadu_si128((const __m128i *)(dst + i));
+        s = _mm_loadu_si128((const __m128i *)(src + i));
+        s = _mm_packus_epi16(
+          _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s,zero),al),8),
+          _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s,zero),al),8));
+        _mm_storeu_si128((__m128i *)(dst + i),_mm_adds_epu8(d,s));
+    }
+    blend_add_scalar(dst + i,src + i,len - i,a);
+}
+
+static __attribute__((target("sse2"))) void
+blend_multiply_sse2(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi16(1);
+    __m128i inv = _mm_set1_epi16(256 - a);
+    __m128i al = _mm_set1_epi16(1 + a);
+    __m128i d;
+    __m128i s;
+    __m128i lo;
+    __m128i hi;
+    unsigned int i = 0;
+
+    for(i=0;i + 16 <= len;i+=16) {
+        d = _mm_loadu_si128((const __m128i *)(dst + i));
+        s = _mm_loadu_si128((const __m128i *)(src + i));
+        lo = _mm_unpacklo_epi8(d,zero);
+        hi = _mm_unpackhi_epi8(d,zero);
+        lo = lerp_sse2(lo,_mm_srli_epi16(_mm_mullo_epi16(lo,_mm_add_epi16(_mm_unpacklo_epi8(s,zero),one)),8),inv,al);
+        hi = lerp_sse2(hi,_mm_srli_epi16(_mm_mullo_epi16(hi,_mm_add_epi16(_mm_unpackhi_epi8(s,zero),one)),8),inv,al);
+        _mm_storeu_si128((__m128i *)(dst + i),_mm_packus_epi16(lo,hi));
+    }
+    blend_multiply_scalar(dst + i,src + i,len - i,a);
+}
+
+/* SSE2 has no byte shuffle, so BGRA over BGR stays scalar here */
+static const blend_ops blend_sse2 = {
+    "sse2",
+    { blend_alpha_sse2, blend_add_sse2, blend_multiply_sse2 },
+    blend_rgba_scalar,
+};
+
+static inline __attribute__((target("avx2"))) __m256i
+lerp_avx2(__m256i d, __m256i s, __m256i inv, __m256i al) {
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(d,inv),_mm256_mullo_epi16(s,al)),8);
+}
+
+/* unpack/pack work within 128-bit lanes, so byte order comes back out as it went in */
+static __attribute__((target("avx2"))) void
+blend_alpha_avx2(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i inv = _mm256_set1_epi16(256 - a);
+    __m256i al = _mm256_set1_epi16(1 + a);
+    __m256i d;
+    __m256i s;
+    unsigned int i = 0;
+
+    for(i=0;i + 32 <= len;i+=32) {
+        d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        s = _mm256_loadu_si256((const __m256i *)(src + i));
+        d = _mm256_packus_epi16(
+          lerp_avx2(_mm256_unpacklo_epi8(d,zero),_mm256_unpacklo_epi8(s,zero),inv,al),
+          lerp_avx2(_mm256_unpackhi_epi8(d,zero),_mm256_unpackhi_epi8(s,zero),inv,al));
+        _mm256_storeu_si256((__m256i *)(dst + i),d);
+    }
+    blend_alpha_sse2(dst + i,src + i,len - i,a);
+}
+
+static __attribute__((target("avx2"))) void
+blend_add_avx2(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i al = _mm256_set1_epi16(1 + a);
+    __m256i d;
+    __m256i s;
+    unsigned int i = 0;
+
+    for(i=0;i + 32 <= len;i+=32) {
+        d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        s = _mm256_loadu_si256((const __m256i *)(src + i));
+        s = _mm256_packus_epi16(
+          _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s,zero),al),8),
+          _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s,zero),al),8));
+        _mm256_storeu_si256((__m256i *)(dst + i),_mm256_adds_epu8(d,s));
+    }
+    blend_add_sse2(dst + i,src + i,len - i,a);
+}
+
+static __attribute__((target("avx2"))) void
+blend_multiply_avx2(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i one = _mm256_set1_epi16(1);
+    __m256i inv = _mm256_set1_epi16(256 - a);
+    __m256i al = _mm256_set1_epi16(1 + a);
+    __m256i d;
+    __m256i s;
+    __m256i lo;
+    __m256i hi;
+    unsigned int i = 0;
+
+    for(i=0;i + 32 <= len;i+=32) {
+        d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        s = _mm256_loadu_si256((const __m256i *)(src + i));
+        lo = _mm256_unpacklo_epi8(d,zero);
+        hi = _mm256_unpackhi_epi8(d,zero);
+        lo = lerp_avx2(lo,_mm256_srli_epi16(_mm256_mullo_epi16(lo,_mm256_add_epi16(_mm256_unpacklo_epi8(s,zero),one)),8),inv,al);
+        hi = lerp_avx2(hi,_mm256_srli_epi16(_mm256_mullo_epi16(hi,_mm256_add_epi16(_mm256_unpackhi_epi8(s,zero),one)),8),inv,al);
+        _mm256_storeu_si256((__m256i *)(dst + i),_mm256_packus_epi16(lo,hi));
+    }
+    blend_multiply_sse2(dst + i,src + i,len - i,a);
+}
+
+/* 4 pixels at a time: dst is spread out to BGRx, each pixel's alpha is
+ * copied across its channels, and the result is packed back to BGR.
+ * dst is read 16 bytes at a time, so this stops 2 pixels early and the
+ * 4 bytes past the last pixel are written back unchanged */
+static __attribute__((target("avx2"))) void
+blend_rgba_avx2(uint8_t *dst, const uint8_t *src, unsigned int len, unsigned int a) {
+    const __m128i spread = _mm_setr_epi8(0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+    const __m128i pack = _mm_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+    const __m128i alpha_lo = _mm_setr_epi8(3,-1,3,-1,3,-1,-1,-1,7,-1,7,-1,7,-1,-1,-1);
+    const __m128i alpha_hi = _mm_setr_epi8(11,-1,11,-1,11,-1,-1,-1,15,-1,15,-1,15,-1,-1,-1);
+    const __m128i keep = _mm_setr_epi8(0,0,0,0,0,0,0,0,0,0,0,0,-1,-1,-1,-1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i k256 = _mm_set1_epi16(256);
+    const __m128i k1 = _mm_set1_epi16(1);
+    const __m128i ga = _mm_set1_epi16(1 + a);
+    __m128i d;
+    __m128i dx;
+    __m128i s;
+    __m128i pa;
+    __m128i lo;
+    __m128i hi;
+    unsigned int i = 0;
+
+    for(i=0;i + 6 <= len;i+=4) {
+        d = _mm_loadu_si128((const __m128i *)(dst + (i * 3)));
+        s = _mm_loadu_si128((const __m128i *)(src + (i * 4)));
+        dx = _mm_shuffle_epi8(d,spread);
+
+        pa = _mm_srli_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(s,alpha_lo),ga),8);
+        lo = lerp_sse2(_mm_unpacklo_epi8(dx,zero),_mm_unpacklo_epi8(s,zero),_mm_sub_epi16(k256,pa),_mm_add_epi16(k1,pa));
+        pa = _mm_srli_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(s,alpha_hi),ga),8);
+        hi = lerp_sse2(_mm_unpackhi_epi8(dx,zero),_mm_unpackhi_epi8(s,zero),_mm_sub_epi16(k256,pa),_mm_add_epi16(k1,pa));
+
+        dx = _mm_shuffle_epi8(_mm_packus_epi16(lo,hi),pack);
+        _mm_storeu_si128((__m128i *)(dst + (i * 3)),_mm_or_si128(dx,_mm_and_si128(d,keep)));
+    }
+    blend_rgba_scalar(dst + (i * 3),src + (i * 4),len - i,a);
+}
+
+static const blend_ops blend_avx2 = {
+    "avx2",
+    { blend_alpha_avx2, blend_add_avx2, blend_multiply_avx2 },
+    blend_rgba_avx2,
+};
+#endif
+
+static const blend_ops *blend = NULL;
+
+/* picks the widest kernels the CPU supports, on first use */
+static const blend_ops *
+blend_select(void) {
+    if(blend) return blend;
+    blend = &blend_scalar;
+#ifdef IMAGE_BLEND_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        blend = &blend_avx2;
+    }
+    else if(__builtin_cpu_supports("sse2")) {
+        blend = &blend_sse2;
+    }
+#endif
+    return blend;
+}
+
+int
+image_blend_mode_scan(const char *s, unsigned int *mode) {
+    unsigned int i = 0;
+    for(i=0;blend_mode_names[i] != NULL;i++) {
+        if(strcmp(blend_mode_names[i],s) == 0) {
+            *mode = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const char *
+image_blend_isa(void) {
+    return blend_select()->name;
+}
+
+void
+image_blend_mode(uint8_t *dst, const uint8_t *src, unsigned int len, uint8_t a, unsigned int mode) {
+    if(mode > IMAGE_BLEND_MULTIPLY) return;
+    blend_select()->modes[mode](dst,src,len,a);
+}
+
+void
+image_blend_rgba(uint8_t *dst, const uint8_t *src, unsigned int pixels, uint8_t a) {
+    blend_select()->rgba(dst,src,pixels,a);
+}
+
 void
 image_blend(uint8_t *dst, uint8_t *src, unsigned int len, uint8_t a) {
-    int alpha = 1 + a;
-    int alpha_inv = 256 - a;
+    blend_select()->modes[IMAGE_BLEND_ALPHA](dst,src,len,a);
+}
+
+/* stamp row kernels, one per source layout, flip and alpha mode.
+ * alpha is the effective alpha of the pixel at s, 0 skips it */
+#define STAMP_ROW(name,sc,step,alpha) \
+static void \
+name(uint8_t *d, const uint8_t *s, unsigned int w, unsigned int dc, unsigned int aa) { \
+    unsigned int a = 0; \
+    (void)aa; \
+    while(w--) { \
+        a = (alpha); \
+        if(a == 255) { \
+            d[0] = s[0]; \
+            d[1] = s[1]; \
+            d[2] = s[2]; \
+        } \
+        else if(a) { \
+            d[0] = ((d[0] * (256 - a)) + (s[0] * (1 + a))) >> 8; \
+            d[1] = ((d[1] * (256 - a)) + (s[1] * (1 + a))) >> 8; \
+            d[2] = ((d[2] * (256 - a)) + (s[2] * (1 + a))) >> 8; \
+        } \
+        d += dc; \
+        s += (step) * (sc); \
+    } \
+}
+
+STAMP_ROW(stamp_rgb_opaque,3,1,255)
+STAMP_ROW(stamp_rgb_const,3,1,aa)
+STAMP_ROW(stamp_rgba_opaque,4,1,s[3] ? 255 : 0)
+STAMP_ROW(stamp_rgba_const,4,1,s[3] ? aa : 0)
+STAMP_ROW(stamp_rgba_pixel,4,1,s[3])
+STAMP_ROW(stamp_rgb_opaque_hflip,3,-1,255)
+STAMP_ROW(stamp_rgb_const_hflip,3,-1,aa)
+STAMP_ROW(stamp_rgba_opaque_hflip,4,-1,s[3] ? 255 : 0)
+STAMP_ROW(stamp_rgba_const_hflip,4,-1,s[3] ? aa : 0)
+STAMP_ROW(stamp_rgba_pixel_hflip,4,-1,s[3])
+
+#undef STAMP_ROW
+
+enum STAMP_MODE {
+    STAMP_OPAQUE, /* RGB, or RGBA pixels with any alpha */
+    STAMP_CONST, /* like STAMP_OPAQUE, blended with a fixed alpha */
+    STAMP_PIXEL, /* RGBA, each pixel's own alpha */
+};
+
+typedef void (*stamp_row)(uint8_t *d, const uint8_t *s, unsigned int w, unsigned int dc, unsigned int aa);
 
+/* [rgba][hflip][mode] */
+static const stamp_row stamp_rows[2][2][3] = {
+    {
+        { stamp_rgb_opaque, stamp_rgb_const, NULL },
+        { stamp_rgb_opaque_hflip, stamp_rgb_const_hflip, NULL },
+    },
+    {
+        { stamp_rgba_opaque, stamp_rgba_const, stamp_rgba_pixel },
+        { stamp_rgba_opaque_hflip, stamp_rgba_const_hflip, stamp_rgba_pixel_hflip },
+    },
+};
+
+void
+image_stamp(
+  uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const uint8_t *src, unsigned int src_width, unsigned int src_height, unsigned int src_channels,
+  int x, int y, unsigned int flags,
+  int mask_left, int mask_right, int mask_top, int mask_bottom,
+  int alpha) {
+
+    /* visible part of the source, 1-based in destination order,
+     * negative masks would reach outside it so they count as 0 */
+    long xi = 1 + (mask_left > 0 ? mask_left : 0);
+    long yi = 1 + (mask_top > 0 ? mask_top : 0);
+    long xm = (long)src_width - (mask_right > 0 ? mask_right : 0);
+    long ym = (long)src_height - (mask_bottom > 0 ? mask_bottom : 0);
+    long row = 0;
+    unsigned int mode = STAMP_OPAQUE;
+    unsigned int hflip = !!(flags & IMAGE_STAMP_HFLIP);
+    unsigned int w = 0;
+    unsigned int src_stride = src_width * src_channels;
+    unsigned int dst_stride = width * channels;
+    stamp_row kernel = NULL;
+    uint8_t *d = NULL;
+    const uint8_t *s = NULL;
+
+    if(channels < 3 || (src_channels != 3 && src_channels != 4)) return;
+
+    xi = xi > 2 - (long)x ? xi : 2 - (long)x;
+    yi = yi > 2 - (long)y ? yi : 2 - (long)y;
+    xm = xm < (long)width - x + 1 ? xm : (long)width - x + 1;
+    ym = ym < (long)height - y + 1 ? ym : (long)height - y + 1;
+    if(xi > xm || yi > ym) return;
+    w = xm - xi + 1;
+
+    if(alpha == 0) return;
+    if(alpha > 0 && alpha < 255) {
+        mode = STAMP_CONST;
+    }
+    else if(alpha < 0 && src_channels == 4) {
+        mode = STAMP_PIXEL;
+    }
+
+    kernel = stamp_rows[src_channels == 4][hflip][mode];
+
+    for(row=yi;row<=ym;row++) {
+        /* rows are stored bottom-up */
+        d = dst + ((height - (y - 1 + row)) * dst_stride) + ((x - 1 + xi - 1) * channels);
+        s = src + ((flags & IMAGE_STAMP_VFLIP) ? row - 1 : src_height - row) * src_stride;
+        s += (hflip ? src_width - xi : xi - 1) * src_channels;
+
+        if(!hflip && channels == 3) {
+            if(src_channels == 3 && mode == STAMP_OPAQUE) {
+                memcpy(d,s,w * 3);
+                continue;
+            }
+            if(src_channels == 3) {
+                image_blend_mode(d,s,w * 3,alpha,IMAGE_BLEND_ALPHA);
+                continue;
+            }
+            if(mode == STAMP_PIXEL) {
+                image_blend_rgba(d,s,w,255);
+                continue;
+            }
+        }
+        kernel(d,s,w,channels,alpha);
+    }
+}
+
+/* fills and gradients build up to FILL_SPAN pixels of colour at a
+ * time, then copy or blend them into each row they cover */
+#define FILL_SPAN 256
+
+/* spans narrower than this are filled inline */
+#define FILL_NARROW 16
+
+/* sorts and clips a rectangle to the image, 1-based and inclusive */
+static int
+fill_clip(int *x1, int *y1, int *x2, int *y2, unsigned int width, unsigned int height) {
+    int t = 0;
+    if(*x1 > *x2) { t = *x1; *x1 = *x2; *x2 = t; }
+    if(*y1 > *y2) { t = *y1; *y1 = *y2; *y2 = t; }
+    if(*x2 < 1 || *y2 < 1) return 0;
+    if(*x1 > (int)width || *y1 > (int)height) return 0;
+    if(*x1 < 1) *x1 = 1;
+    if(*y1 < 1) *y1 = 1;
+    if(*x2 > (int)width) *x2 = width;
+    if(*y2 > (int)height) *y2 = height;
+    return 1;
+}
+
+/* writes pixels of the BGR span p into d */
+static void
+fill_put(uint8_t *d, const uint8_t *p, unsigned int pixels, unsigned int channels, uint8_t a) {
+    unsigned int alpha = 1 + a;
+    unsigned int alpha_inv = 256 - a;
+
+    if(channels == 3) {
+        if(a == 255) memcpy(d,p,pixels * 3);
+        else image_blend_mode(d,p,pixels * 3,a,IMAGE_BLEND_ALPHA);
+        return;
+    }
+    while(pixels--) {
+        if(a == 255) {
+            d[0] = p[0];
+            d[1] = p[1];
+            d[2] = p[2];
+        }
+        else {
+            d[0] = ((d[0] * alpha_inv) + (p[0] * alpha)) >> 8;
+            d[1] = ((d[1] * alpha_inv) + (p[1] * alpha)) >> 8;
+            d[2] = ((d[2] * alpha_inv) + (p[2] * alpha)) >> 8;
+        }
+        d += channels;
+        p += 3;
+    }
+}
+
+/* same, for BGRA spans, with each pixel's alpha */
+static void
+fill_put_rgba(uint8_t *d, const uint8_t *p, unsigned int pixels, unsigned int channels) {
+    unsigned int a = 0;
+
+    if(channels == 3) {
+        image_blend_rgba(d,p,pixels,255);
+        return;
+    }
+    while(pixels--) {
+        a = p[3];
+        d[0] = ((d[0] * (256 - a)) + (p[0] * (1 + a))) >> 8;
+        d[1] = ((d[1] * (256 - a)) + (p[1] * (1 + a))) >> 8;
+        d[2] = ((d[2] * (256 - a)) + (p[2] * (1 + a))) >> 8;
+        d += channels;
+        p += 4;
+    }
+}
+
+/* fills a span with one BGR colour, doubling what's written so far */
+static void
+fill_pattern(uint8_t *p, unsigned int pixels, uint8_t r, uint8_t g, uint8_t b) {
+    unsigned int len = pixels * 3;
+    unsigned int done = 3;
+    p[0] = b;
+    p[1] = g;
+    p[2] = r;
+    while(done < len) {
+        memcpy(p + done, p, done * 2 <= len ? done : len - done);
+        done *= 2;
+    }
+}
+
+static inline uint8_t
+fill_mix(uint8_t from, uint8_t to, unsigned int i, unsigned int n) {
+    if(n == 0) return from;
+    return ((from * (n - i)) + (to * i) + (n / 2)) / n;
+}
+
+int
+image_fill(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    uint8_t pattern[FILL_SPAN * 3];
+    unsigned int stride = width * channels;
+    unsigned int alpha = 1 + a;
+    unsigned int alpha_inv = 256 - a;
+    unsigned int w = 0;
+    unsigned int n = 0;
+    unsigned int i = 0;
+    int y = 0;
+    uint8_t *d = NULL;
+
+    if(channels < 3) return 0;
+    if(!fill_clip(&x1,&y1,&x2,&y2,width,height)) return 0;
+    if(a == 0) return 1;
+
+    w = x2 - x1 + 1;
+
+    if(w < FILL_NARROW) {
+        /* too short to be worth a call per row */
+        for(y=y2;y>=y1;y--) {
+            d = dst + ((height - y) * stride) + ((x1 - 1) * channels);
+            for(i=0;i<w;i++) {
+                if(a == 255) {
+                    d[0] = b;
+                    d[1] = g;
+                    d[2] = r;
+                }
+                else {
+                    d[0] = ((d[0] * alpha_inv) + (b * alpha)) >> 8;
+                    d[1] = ((d[1] * alpha_inv) + (g * alpha)) >> 8;
+                    d[2] = ((d[2] * alpha_inv) + (r * alpha)) >> 8;
+                }
+                d += channels;
+            }
+        }
+        return 1;
+    }
+
+    fill_pattern(pattern, w < FILL_SPAN ? w : FILL_SPAN, r, g, b);
+
+    /* bottom-up, so rows are visited in memory order */
+    for(y=y2;y>=y1;y--) {
+        d = dst + ((height - y) * stride) + ((x1 - 1) * channels);
+        for(i=0;i<w;i+=n) {
+            n = w - i < FILL_SPAN ? w - i : FILL_SPAN;
+            fill_put(d + (i * channels), pattern, n, channels, a);
+        }
+    }
+    return 1;
+}
+
+int
+image_gradient_linear(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  int x1, int y1, int x2, int y2, const uint8_t *from, const uint8_t *to, unsigned int vertical) {
+    uint8_t pattern[FILL_SPAN * 4];
+    unsigned int stride = width * channels;
+    unsigned int span = 0;
+    unsigned int w = 0;
+    unsigned int n = 0;
     unsigned int i = 0;
-    for(i=0;i<len;i+=8) {
-        dst[i] =   ((dst[i] * alpha_inv) + (src[i] * alpha)) >> 8;
-        dst[i+1] = ((dst[i+1] * alpha_inv) + (src[i+1] * alpha)) >> 8;
-        dst[i+2] = ((dst[i+2] * alpha_inv) + (src[i+2] * alpha)) >> 8;
-        dst[i+3] = ((dst[i+3] * alpha_inv) + (src[i+3] * alpha)) >> 8;
-        dst[i+4] = ((dst[i+4] * alpha_inv) + (src[i+4] * alpha)) >> 8;
-        dst[i+5] = ((dst[i+5] * alpha_inv) + (src[i+5] * alpha)) >> 8;
-        dst[i+6] = ((dst[i+6] * alpha_inv) + (src[i+6] * alpha)) >> 8;
-        dst[i+7] = ((dst[i+7] * alpha_inv) + (src[i+7] * alpha)) >> 8;
+    unsigned int j = 0;
+    unsigned int k = 0;
+    int origin = vertical ? y1 : x1;
+    int xs = x1, ys = y1, xe = x2, ye = y2;
+    int y = 0;
+    int col = 0;
+    uint8_t a = 0;
+    uint8_t *p = NULL;
+    uint8_t *d = NULL;
+
+    if(channels < 3) return 0;
+    if(!fill_clip(&xs,&ys,&xe,&ye,width,height)) return 0;
+
+    span = vertical ? (y1 > y2 ? y1 - y2 : y2 - y1) : (x1 > x2 ? x1 - x2 : x2 - x1);
+    w = xe - xs + 1;
+
+    if(vertical) {
+        /* one colour per row */
+        for(y=ye;y>=ys;y--) {
+            j = y > origin ? y - origin : origin - y;
+            a = fill_mix(from[3],to[3],j,span);
+            if(a == 0) continue;
+            fill_pattern(pattern, w < FILL_SPAN ? w : FILL_SPAN,
+              fill_mix(from[0],to[0],j,span),
+              fill_mix(from[1],to[1],j,span),
+              fill_mix(from[2],to[2],j,span));
+            d = dst + ((height - y) * stride) + ((xs - 1) * channels);
+            for(i=0;i<w;i+=n) {
+                n = w - i < FILL_SPAN ? w - i : FILL_SPAN;
+                fill_put(d + (i * channels), pattern, n, channels, a);
+            }
+        }
+        return 1;
+    }
+
+    /* one colour per column, the same for every row */
+    for(i=0;i<w;i+=n) {
+        n = w - i < FILL_SPAN ? w - i : FILL_SPAN;
+        p = pattern;
+        for(k=0;k<n;k++) {
+            col = xs + (int)(i + k);
+            j = col > origin ? col - origin : origin - col;
+            p[0] = fill_mix(from[2],to[2],j,span);
+            p[1] = fill_mix(from[1],to[1],j,span);
+            p[2] = fill_mix(from[0],to[0],j,span);
+            p[3] = fill_mix(from[3],to[3],j,span);
+            p += 4;
+        }
+        for(y=ye;y>=ys;y--) {
+            d = dst + ((height - y) * stride) + ((xs - 1 + i) * channels);
+            fill_put_rgba(d, pattern, n, channels);
+        }
     }
+    return 1;
 }
 
+/* radial gradients mix colours over at most this many steps, so huge
+ * radii don't overflow fill_mix */
+#define RADIAL_STEPS 65536
+
+int
+image_gradient_radial(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  int x, int y, unsigned int radius, const uint8_t *from, const uint8_t *to) {
+    uint8_t pattern[FILL_SPAN * 4];
+    unsigned int stride = width * channels;
+    unsigned int steps = radius < RADIAL_STEPS ? radius : RADIAL_STEPS;
+    unsigned int n = 0;
+    unsigned int j = 0;
+    unsigned int k = 0;
+    /* radius can be up to UINT_MAX, so anything relative to it is 64-bit */
+    int64_t r = radius;
+    int64_t dy = 0;
+    int64_t half = 0;
+    int64_t dx = 0;
+    int xs = 0, ys = 0, xe = 0, ye = 0;
+    int row = 0;
+    int col = 0;
+    double scale = (double)steps / (radius ? radius : 1);
+    double dist = 0.0;
+    uint8_t *p = NULL;
+    uint8_t *d = NULL;
+
+    if(channels < 3) return 0;
+    if((int64_t)x + r < 1 || (int64_t)y + r < 1) return 0;
+    if((int64_t)x - r > (int64_t)width || (int64_t)y - r > (int64_t)height) return 0;
+    ys = (int64_t)y - r > 1 ? y - r : 1;
+    ye = (int64_t)y + r < (int64_t)height ? y + r : (int)height;
+
+    for(row=ye;row>=ys;row--) {
+        /* only the part of the row inside the circle */
+        dy = (int64_t)row - y;
+        half = (int64_t)sqrt(((double)r * r) - ((double)dy * dy));
+        xs = (int64_t)x - half > 1 ? x - half : 1;
+        xe = (int64_t)x + half < (int64_t)width ? x + half : (int)width;
+        d = dst + ((height - row) * stride);
+
+        for(col=xs;col<=xe;col+=n) {
+            n = xe - col + 1 < FILL_SPAN ? xe - col + 1 : FILL_SPAN;
+            p = pattern;
+            for(k=0;k<n;k++) {
+                dx = (int64_t)col + k - x;
+                dist = sqrt(((double)dx * dx) + ((double)dy * dy)) * scale;
+                j = dist + 0.5 < steps ? (unsigned int)(dist + 0.5) : steps;
+                p[0] = fill_mix(from[2],to[2],j,steps);
+                p[1] = fill_mix(from[1],to[1],j,steps);
+                p[2] = fill_mix(from[0],to[0],j,steps);
+                p[3] = fill_mix(from[3],to[3],j,steps);
+                p += 4;
+            }
+            fill_put_rgba(d + ((col - 1) * channels), pattern, n, channels);
+        }
+    }
+    return 1;
+}
+
+void
+image_stamp_mask(
+  uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const uint8_t *mask, unsigned int mask_width, unsigned int mask_height,
+  int x, int y,
+  int mask_left, int mask_right, int mask_top, int mask_bottom,
+  uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    uint8_t pattern[FILL_SPAN * 3];
+    /* negative masks would reach outside the mask, so they count as 0 */
+    long xi = 1 + (mask_left > 0 ? mask_left : 0);
+    long yi = 1 + (mask_top > 0 ? mask_top : 0);
+    long xm = (long)mask_width - (mask_right > 0 ? mask_right : 0);
+    long ym = (long)mask_height - (mask_bottom > 0 ? mask_bottom : 0);
+    long row = 0;
+    unsigned int stride = width * channels;
+    unsigned int w = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+    unsigned int n = 0;
+    unsigned int alpha = 0;
+    uint64_t zero = 0;
+    const uint8_t *m = NULL;
+    uint8_t *d = NULL;
+
+    if(channels < 3 || a == 0) return;
+
+    xi = xi > 2 - (long)x ? xi : 2 - (long)x;
+    yi = yi > 2 - (long)y ? yi : 2 - (long)y;
+    xm = xm < (long)width - x + 1 ? xm : (long)width - x + 1;
+    ym = ym < (long)height - y + 1 ? ym : (long)height - y + 1;
+    if(xi > xm || yi > ym) return;
+    w = xm - xi + 1;
+
+    fill_pattern(pattern, w < FILL_SPAN ? w : FILL_SPAN, r, g, b);
+
+    for(row=yi;row<=ym;row++) {
+        d = dst + ((height - (y - 1 + row)) * stride) + ((x - 1 + xi - 1) * channels);
+        m = mask + ((row - 1) * mask_width) + (xi - 1);
+
+        i = 0;
+        while(i < w) {
+            /* text masks are mostly empty, skip them 8 bytes at a time */
+            while(i + 8 <= w) {
+                memcpy(&zero,m + i,8);
+                if(zero) break;
+                i += 8;
+            }
+            while(i < w && m[i] == 0) i++;
+
+            /* runs of full coverage are filled like a rectangle, short
+             * ones inline */
+            for(j=i;j<w && m[j] == 255;j++);
+            if(a == 255 && j - i < FILL_NARROW) {
+                for(;i<j;i++) {
+                    d[(i * channels)] = b;
+                    d[(i * channels)+1] = g;
+                    d[(i * channels)+2] = r;
+                }
+            }
+            for(;i<j;i+=n) {
+                n = j - i < FILL_SPAN ? j - i : FILL_SPAN;
+                fill_put(d + (i * channels), pattern, n, channels, a);
+            }
+
+            for(;i<w && m[i] != 0 && m[i] != 255;i++) {
+                alpha = ((m[i] * a) + 127) / 255;
+                d[(i * channels)] = ((d[(i * channels)] * (256 - alpha)) + (b * (1 + alpha))) >> 8;
+                d[(i * channels)+1] = ((d[(i * channels)+1] * (256 - alpha)) + (g * (1 + alpha))) >> 8;
+                d[(i * channels)+2] = ((d[(i * channels)+2] * (256 - alpha)) + (r * (1 + alpha))) >> 8;
+            }
+        }
+    }
+}
+
+/* antialiased shapes. everything but thin lines is built as a path of
+ * closed contours, in pixel units with 0,0 at the top-left corner of the
+ * image (pixel 1,1 covers 0,0 to 1,1). the path's edges are accumulated
+ * as signed area into a buffer covering its bounding box, a running sum
+ * along each row then gives every pixel's coverage, which is drawn with
+ * image_stamp_mask. contours winding the same way merge, opposite ones
+ * cut holes */
+
+/* how far a curve may stray from the true shape, in pixels */
+#define AA_TOLERANCE 0.05f
+
+/* turns sharper than this (in pixels of gap) get a round join */
+#define AA_JOIN 0.05f
+
+typedef struct aa_path {
+    float *pts; /* x,y pairs */
+    unsigned int len;
+    unsigned int size;
+    unsigned int start; /* first point of the open contour */
+    unsigned int *ends; /* one past the last point of each contour */
+    unsigned int contours;
+    unsigned int contours_size;
+    unsigned int failed;
+} aa_path;
+
+#define AA_PATH_ZERO { NULL, 0, 0, 0, NULL, 0, 0, 0 }
+
+static void
+aa_path_free(aa_path *p) {
+    free(p->pts);
+    free(p->ends);
+}
+
+static void
+aa_path_point(aa_path *p, float x, float y) {
+    float *t = NULL;
+    unsigned int size = 0;
+
+    if(p->failed) return;
+    if(p->len == p->size) {
+        size = p->size ? p->size * 2 : 64;
+        t = (float *)realloc(p->pts,sizeof(float) * 2 * size);
+        if(t == NULL) {
+            p->failed = 1;
+            return;
+        }
+        p->pts = t;
+        p->size = size;
+    }
+    p->pts[(p->len * 2)] = x;
+    p->pts[(p->len * 2)+1] = y;
+    p->len++;
+}
+
+/* ends the current contour. orient > 0 makes it wind clockwise (on
+ * screen), < 0 anticlockwise, 0 leaves it as it is */
+static void
+aa_path_close(aa_path *p, int orient) {
+    unsigned int *t = NULL;
+    unsigned int size = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+    float area = 0;
+    float f = 0;
+
+    if(p->failed) return;
+    if(p->len - p->start < 3) {
+        p->len = p->start;
+        return;
+    }
+
+    if(orient) {
+        for(i=p->start;i<p->len;i++) {
+            j = i + 1 < p->len ? i + 1 : p->start;
+            area += (p->pts[(i*2)] * p->pts[(j*2)+1]) - (p->pts[(j*2)] * p->pts[(i*2)+1]);
+        }
+        if((area < 0 && orient > 0) || (area > 0 && orient < 0)) {
+            for(i=p->start,j=p->len-1;i<j;i++,j--) {
+                f = p->pts[(i*2)]; p->pts[(i*2)] = p->pts[(j*2)]; p->pts[(j*2)] = f;
+                f = p->pts[(i*2)+1]; p->pts[(i*2)+1] = p->pts[(j*2)+1]; p->pts[(j*2)+1] = f;
+            }
+        }
+    }
+
+    if(p->contours == p->contours_size) {
+        size = p->contours_size ? p->contours_size * 2 : 16;
+        t = (unsigned int *)realloc(p->ends,sizeof(unsigned int) * size);
+        if(t == NULL) {
+            p->failed = 1;
+            return;
+        }
+        p->ends = t;
+        p->contours_size = size;
+    }
+    p->ends[p->contours++] = p->len;
+    p->start = p->len;
+}
+
+/* segments needed for a full turn at radius r */
+static unsigned int
+aa_segments(float r) {
+    float step = 0;
+    unsigned int n = 0;
+    if(r <= AA_TOLERANCE) return 8;
+    step = acosf(1.0f - (AA_TOLERANCE / r));
+    n = (unsigned int)ceilf((float)(2 * M_PI) / step);
+    if(n < 8) n = 8;
+    if(n > 4096) n = 4096;
+    return n;
+}
+
+/* adds points along an arc, from angle a0 to a1 (radians) inclusive */
+static void
+aa_path_arc(aa_path *p, float x, float y, float radius, float a0, float a1) {
+    unsigned int n = 0;
+    unsigned int i = 0;
+    float t = 0;
+
+    n = (unsigned int)ceilf(aa_segments(radius) * fabsf(a1 - a0) / (float)(2 * M_PI));
+    if(n < 1) n = 1;
+    for(i=0;i<=n;i++) {
+        t = a0 + ((a1 - a0) * i / n);
+        aa_path_point(p, x + (radius * cosf(t)), y + (radius * sinf(t)));
+    }
+}
+
+static void
+aa_path_circle(aa_path *p, float x, float y, float radius, int orient) {
+    unsigned int n = aa_segments(radius);
+    unsigned int i = 0;
+    for(i=0;i<n;i++) {
+        aa_path_point(p, x + (radius * cosf((float)(2 * M_PI) * i / n)), y + (radius * sinf((float)(2 * M_PI) * i / n)));
+    }
+    aa_path_close(p,orient);
+}
+
+/* one edge of the path into the accumulation buffer, x is already
+ * within 0 - w. rows outside 0 - h are skipped */
+static void
+aa_line(float *acc, unsigned int stride, unsigned int w, unsigned int h, float x0, float y0, float x1, float y1) {
+    float dir = 1.0f;
+    float dxdy = 0;
+    float x = 0;
+    float xnext = 0;
+    float xa = 0;
+    float xb = 0;
+    float dy = 0;
+    float d = 0;
+    float xmf = 0;
+    float s = 0;
+    float x0f = 0;
+    float x1f = 0;
+    float a0 = 0;
+    float a1 = 0;
+    float a2 = 0;
+    float am = 0;
+    float t = 0;
+    float *row = NULL;
+    int x0i = 0;
+    int x1i = 0;
+    int xi = 0;
+    int y = 0;
+    int ye = 0;
+
+    if(y0 == y1) return;
+    if(y0 > y1) {
+        dir = -1.0f;
+        t = x0; x0 = x1; x1 = t;
+        t = y0; y0 = y1; y1 = t;
+    }
+    if(y1 <= 0 || y0 >= (float)h) return;
+
+    dxdy = (x1 - x0) / (y1 - y0);
+    x = x0;
+    if(y0 < 0) {
+        x -= y0 * dxdy;
+        y0 = 0;
+    }
+    ye = (int)ceilf(y1 < (float)h ? y1 : (float)h);
+
+    for(y=(int)y0;y<ye;y++) {
+        row = acc + ((unsigned int)y * stride);
+        dy = ((float)(y + 1) < y1 ? (float)(y + 1) : y1) - ((float)y > y0 ? (float)y : y0);
+        xnext = x + (dxdy * dy);
+        d = dy * dir;
+
+        xa = x < xnext ? x : xnext;
+        xb = x < xnext ? xnext : x;
+        if(xa < 0) xa = 0;
+        if(xb > (float)w) xb = (float)w;
+        if(xb < xa) xb = xa;
+
+        x0i = (int)floorf(xa);
+        x1i = (int)ceilf(xb);
+        if(x1i <= x0i + 1) {
+            xmf = (0.5f * (xa + xb)) - (float)x0i;
+            row[x0i] += d - (d * xmf);
+            row[x0i + 1] += d * xmf;
+        }
+        else {
+            s = 1.0f / (xb - xa);
+            x0f = xa - (float)x0i;
+            a0 = 0.5f * s * (1.0f - x0f) * (1.0f - x0f);
+            x1f = xb - (float)x1i + 1.0f;
+            am = 0.5f * s * x1f * x1f;
+            row[x0i] += d * a0;
+            if(x1i == x0i + 2) {
+                row[x0i + 1] += d * (1.0f - a0 - am);
+            }
+            else {
+                a1 = s * (1.5f - x0f);
+                row[x0i + 1] += d * (a1 - a0);
+                for(xi=x0i+2;xi<x1i-1;xi++) {
+                    row[xi] += d * s;
+                }
+                a2 = a1 + ((float)(x1i - x0i - 3) * s);
+                row[x1i - 1] += d * (1.0f - a2 - am);
+            }
+            row[x1i] += d * am;
+        }
+        x = xnext;
+    }
+}
+
+/* an edge of a path, relative to the bounding box */
+typedef struct aa_seg {
+    float x0;
+    float y0;
+    float x1;
+    float y1;
+    int first; /* first and last band it touches */
+    int last;
+} aa_seg;
+
+/* shapes are resolved a band of rows at a time so the accumulation
+ * buffer stays small */
+#define AA_BAND 16
+
+static void
+aa_seg_push(aa_seg *segs, unsigned int *n, unsigned int h, float x0, float y0, float x1, float y1) {
+    float ymin = y0 < y1 ? y0 : y1;
+    float ymax = y0 < y1 ? y1 : y0;
+    aa_seg *s = NULL;
+
+    if(y0 == y1 || ymax <= 0 || ymin >= (float)h) return;
+    s = &segs[(*n)++];
+    s->x0 = x0;
+    s->y0 = y0;
+    s->x1 = x1;
+    s->y1 = y1;
+    s->first = ymin < 0 ? 0 : (int)ymin / AA_BAND;
+    s->last = ymax >= (float)h ? (int)(h - 1) / AA_BAND : (int)ceilf(ymax - 1) / AA_BAND;
+    if(s->last < s->first) s->last = s->first;
+}
+
+/* splits an edge where it leaves 0 - w, the parts outside run along
+ * the side they left by so the rows still see them. adds up to 3 */
+static void
+aa_seg_split(aa_seg *segs, unsigned int *n, unsigned int w, unsigned int h, float x0, float y0, float x1, float y1) {
+    float ts[4];
+    float xa = 0;
+    float xb = 0;
+    float t = 0;
+    unsigned int k = 0;
+    unsigned int i = 0;
+
+    ts[k++] = 0;
+    if((x0 < 0) != (x1 < 0)) ts[k++] = (0 - x0) / (x1 - x0);
+    if((x0 > (float)w) != (x1 > (float)w)) ts[k++] = ((float)w - x0) / (x1 - x0);
+    if(k == 3 && ts[1] > ts[2]) {
+        t = ts[1]; ts[1] = ts[2]; ts[2] = t;
+    }
+    ts[k++] = 1;
+
+    for(i=0;i+1<k;i++) {
+        xa = x0 + ((x1 - x0) * ts[i]);
+        xb = x0 + ((x1 - x0) * ts[i+1]);
+        xa = xa < 0 ? 0 : xa > (float)w ? (float)w : xa;
+        xb = xb < 0 ? 0 : xb > (float)w ? (float)w : xb;
+        aa_seg_push(segs,n,h,xa,y0 + ((y1 - y0) * ts[i]),xb,y0 + ((y1 - y0) * ts[i+1]));
+    }
+}
+
+static int
+aa_fill(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  aa_path *p, uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    float minx = 0, miny = 0, maxx = 0, maxy = 0;
+    float sum = 0;
+    float c = 0;
+    float *acc = NULL;
+    float *row = NULL;
+    uint8_t *mask = NULL;
+    aa_seg *segs = NULL;
+    unsigned int *order = NULL;
+    unsigned int *active = NULL;
+    unsigned int *starts = NULL;
+    unsigned int nsegs = 0;
+    unsigned int nactive = 0;
+    unsigned int bands = 0;
+    unsigned int band = 0;
+    unsigned int rows = 0;
+    unsigned int stride = 0;
+    unsigned int w = 0;
+    unsigned int h = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+    unsigned int k = 0;
+    unsigned int first = 0;
+    int bx = 0;
+    int by = 0;
+    int bx2 = 0;
+    int by2 = 0;
+    int ret = 0;
+
+    if(p->failed || p->contours == 0 || a == 0 || channels < 3) return 0;
+
+    minx = maxx = p->pts[0];
+    miny = maxy = p->pts[1];
+    for(i=0;i<p->len;i++) {
+        if(!isfinite(p->pts[(i*2)]) || !isfinite(p->pts[(i*2)+1])) return 0;
+        if(p->pts[(i*2)] < minx) minx = p->pts[(i*2)];
+        if(p->pts[(i*2)] > maxx) maxx = p->pts[(i*2)];
+        if(p->pts[(i*2)+1] < miny) miny = p->pts[(i*2)+1];
+        if(p->pts[(i*2)+1] > maxy) maxy = p->pts[(i*2)+1];
+    }
+    if(maxx <= 0 || maxy <= 0 || minx >= (float)width || miny >= (float)height) return 0;
+
+    bx = minx < 0 ? 0 : (int)floorf(minx);
+    by = miny < 0 ? 0 : (int)floorf(miny);
+    bx2 = maxx > (float)width ? (int)width : (int)ceilf(maxx);
+    by2 = maxy > (float)height ? (int)height : (int)ceilf(maxy);
+    if(bx2 <= bx || by2 <= by) return 0;
+    w = bx2 - bx;
+    h = by2 - by;
+    stride = w + 2;
+    bands = (h + AA_BAND - 1) / AA_BAND;
+
+    segs = (aa_seg *)malloc(sizeof(aa_seg) * 3 * p->len);
+    order = (unsigned int *)malloc(sizeof(unsigned int) * 3 * p->len);
+    active = (unsigned int *)malloc(sizeof(unsigned int) * 3 * p->len);
+    starts = (unsigned int *)calloc(bands + 1,sizeof(unsigned int));
+    acc = (float *)calloc((size_t)stride * AA_BAND,sizeof(float));
+    mask = (uint8_t *)malloc((size_t)w * AA_BAND);
+    if(segs == NULL || order == NULL || active == NULL || starts == NULL || acc == NULL || mask == NULL) {
+        goto done;
+    }
+
+    for(k=0,first=0;k<p->contours;first=p->ends[k++]) {
+        for(i=first;i<p->ends[k];i++) {
+            j = i + 1 < p->ends[k] ? i + 1 : first;
+            aa_seg_split(segs,&nsegs,w,h,
+              p->pts[(i*2)] - bx, p->pts[(i*2)+1] - by,
+              p->pts[(j*2)] - bx, p->pts[(j*2)+1] - by);
+        }
+    }
+
+    /* counting sort by first band */
+    for(i=0;i<nsegs;i++) {
+        starts[segs[i].first + 1]++;
+    }
+    for(i=0;i<bands;i++) {
+        starts[i+1] += starts[i];
+    }
+    for(i=0;i<nsegs;i++) {
+        order[starts[segs[i].first]++] = i;
+    }
+    for(i=bands;i>0;i--) {
+        starts[i] = starts[i-1];
+    }
+    starts[0] = 0;
+
+    for(band=0;band<bands;band++) {
+        for(i=starts[band];i<starts[band+1];i++) {
+            active[nactive++] = order[i];
+        }
+        if(nactive == 0) continue;
+
+        rows = h - (band * AA_BAND) < AA_BAND ? h - (band * AA_BAND) : AA_BAND;
+        for(i=0,j=0;i<nactive;i++) {
+            aa_line(acc,stride,w,rows,
+              segs[active[i]].x0, segs[active[i]].y0 - (float)(band * AA_BAND),
+              segs[active[i]].x1, segs[active[i]].y1 - (float)(band * AA_BAND));
+            if(segs[active[i]].last > (int)band) active[j++] = active[i];
+        }
+        nactive = j;
+
+        /* running sums give coverage, the buffer is cleared on the way */
+        for(j=0;j<rows;j++) {
+            row = acc + (j * stride);
+            sum = 0;
+            for(i=0;i<w;i++) {
+                sum += row[i];
+                row[i] = 0;
+                c = fabsf(sum);
+                c = c < 1.0f ? c : 1.0f;
+                mask[(j * w) + i] = (uint8_t)((c * 255.0f) + 0.5f);
+            }
+            row[w] = 0;
+            row[w+1] = 0;
+        }
+
+        image_stamp_mask(dst,width,height,channels,mask,w,rows,bx + 1,by + (band * AA_BAND) + 1,0,0,0,0,r,g,b,a);
+    }
+    ret = 1;
+
+    done:
+    free(segs);
+    free(order);
+    free(active);
+    free(starts);
+    free(acc);
+    free(mask);
+    return ret;
+}
+
+/* blends one pixel of a thin line, x,y 1-based */
+static inline void
+aa_plot(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  int x, int y, float c, uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    unsigned int alpha = 0;
+    uint8_t *d = NULL;
+
+    if(x < 1 || y < 1 || x > (int)width || y > (int)height) return;
+    alpha = (unsigned int)((c * a) + 0.5f);
+    if(alpha == 0) return;
+    if(alpha > 255) alpha = 255;
+
+    d = dst + ((height - y) * width * channels) + ((x - 1) * channels);
+    d[0] = ((d[0] * (256 - alpha)) + (b * (1 + alpha))) >> 8;
+    d[1] = ((d[1] * (256 - alpha)) + (g * (1 + alpha))) >> 8;
+    d[2] = ((d[2] * (256 - alpha)) + (r * (1 + alpha))) >> 8;
+}
+
+/* clips a line to a box (Liang-Barsky), 0 if none of it is inside */
+static int
+aa_clip(float *x0, float *y0, float *x1, float *y1, float xmin, float ymin, float xmax, float ymax) {
+    float dx = *x1 - *x0;
+    float dy = *y1 - *y0;
+    float p[4];
+    float q[4];
+    float t0 = 0;
+    float t1 = 1;
+    float t = 0;
+    unsigned int i = 0;
+
+    p[0] = -dx; q[0] = *x0 - xmin;
+    p[1] = dx;  q[1] = xmax - *x0;
+    p[2] = -dy; q[2] = *y0 - ymin;
+    p[3] = dy;  q[3] = ymax - *y0;
+
+    for(i=0;i<4;i++) {
+        if(p[i] == 0) {
+            if(q[i] < 0) return 0;
+            continue;
+        }
+        t = q[i] / p[i];
+        if(p[i] < 0) {
+            if(t > t1) return 0;
+            if(t > t0) t0 = t;
+        }
+        else {
+            if(t < t0) return 0;
+            if(t < t1) t1 = t;
+        }
+    }
+
+    *x1 = *x0 + (t1 * dx);
+    *y1 = *y0 + (t1 * dy);
+    *x0 = *x0 + (t0 * dx);
+    *y0 = *y0 + (t0 * dy);
+    return 1;
+}
+
+/* Xiaolin Wu's line, coordinates are pixel centres (1-based) */
+static void
+aa_wu_line(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  float x0, float y0, float x1, float y1, uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    int steep = 0;
+    float t = 0;
+    float gradient = 0;
+    float xend = 0;
+    float yend = 0;
+    float xgap = 0;
+    float intery = 0;
+    int xp1 = 0;
+    int xp2 = 0;
+    int yp = 0;
+    int x = 0;
+
+    if(!isfinite(x0) || !isfinite(y0) || !isfinite(x1) || !isfinite(y1)) return;
+    if(!aa_clip(&x0,&y0,&x1,&y1,-1.0f,-1.0f,(float)width + 2.0f,(float)height + 2.0f)) return;
+    steep = fabsf(y1 - y0) > fabsf(x1 - x0);
+
+#define AA_WU_PLOT(px,py,c) \
+    do { \
+        if(steep) aa_plot(dst,width,height,channels,(py),(px),(c),r,g,b,a); \
+        else aa_plot(dst,width,height,channels,(px),(py),(c),r,g,b,a); \
+    } while(0)
+
+    if(steep) {
+        t = x0; x0 = y0; y0 = t;
+        t = x1; x1 = y1; y1 = t;
+    }
+    if(x0 > x1) {
+        t = x0; x0 = x1; x1 = t;
+        t = y0; y0 = y1; y1 = t;
+    }
+    gradient = x1 - x0 == 0 ? 1.0f : (y1 - y0) / (x1 - x0);
+
+    xend = floorf(x0 + 0.5f);
+    yend = y0 + (gradient * (xend - x0));
+    xgap = 1.0f - ((x0 + 0.5f) - floorf(x0 + 0.5f));
+    xp1 = (int)xend;
+    yp = (int)floorf(yend);
+    AA_WU_PLOT(xp1,yp,(1.0f - (yend - floorf(yend))) * xgap);
+    AA_WU_PLOT(xp1,yp + 1,(yend - floorf(yend)) * xgap);
+    intery = yend + gradient;
+
+    xend = floorf(x1 + 0.5f);
+    yend = y1 + (gradient * (xend - x1));
+    xgap = (x1 + 0.5f) - floorf(x1 + 0.5f);
+    xp2 = (int)xend;
+    if(xp2 != xp1) {
+        yp = (int)floorf(yend);
+        AA_WU_PLOT(xp2,yp,(1.0f - (yend - floorf(yend))) * xgap);
+        AA_WU_PLOT(xp2,yp + 1,(yend - floorf(yend)) * xgap);
+    }
+
+    for(x=xp1+1;x<xp2;x++) {
+        yp = (int)floorf(intery);
+        AA_WU_PLOT(x,yp,1.0f - (intery - (float)yp));
+        AA_WU_PLOT(x,yp + 1,intery - (float)yp);
+        intery += gradient;
+    }
+
+#undef AA_WU_PLOT
+}
+
+/* adds a segment of a thick line, x,y already in path units */
+static void
+aa_path_segment(aa_path *p, float x0, float y0, float x1, float y1, float half) {
+    float dx = x1 - x0;
+    float dy = y1 - y0;
+    float len = sqrtf((dx * dx) + (dy * dy));
+    float nx = 0;
+    float ny = 0;
+
+    if(len == 0) return;
+    nx = -dy / len * half;
+    ny = dx / len * half;
+    aa_path_point(p, x0 + nx, y0 + ny);
+    aa_path_point(p, x1 + nx, y1 + ny);
+    aa_path_point(p, x1 - nx, y1 - ny);
+    aa_path_point(p, x0 - nx, y0 - ny);
+    aa_path_close(p,1);
+}
+
+int
+image_draw_line(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  float x1, float y1, float x2, float y2, float thickness, uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    aa_path p = AA_PATH_ZERO;
+    int ret = 0;
+
+    if(channels < 3 || a == 0) return 0;
+    if(thickness <= 1.0f) {
+        aa_wu_line(dst,width,height,channels,x1,y1,x2,y2,r,g,b,a);
+        return 1;
+    }
+
+    aa_path_segment(&p,x1 - 0.5f,y1 - 0.5f,x2 - 0.5f,y2 - 0.5f,thickness / 2);
+    ret = aa_fill(dst,width,height,channels,&p,r,g,b,a);
+    aa_path_free(&p);
+    return ret;
+}
+
+int
+image_draw_polyline(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const float *points, unsigned int count, float thickness, unsigned int closed,
+  uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    aa_path p = AA_PATH_ZERO;
+    float half = thickness / 2;
+    float ax = 0, ay = 0, bx = 0, by = 0, cx = 0, cy = 0;
+    float cross = 0;
+    float la = 0;
+    float lb = 0;
+    unsigned int segments = closed ? count : count - 1;
+    unsigned int i = 0;
+    int ret = 0;
+
+    if(channels < 3 || a == 0 || count < 2) return 0;
+
+    if(thickness <= 1.0f) {
+        for(i=0;i<segments;i++) {
+            aa_wu_line(dst,width,height,channels,
+              points[(i*2)], points[(i*2)+1],
+              points[((i+1)%count)*2], points[(((i+1)%count)*2)+1],
+              r,g,b,a);
+        }
+        return 1;
+    }
+
+    /* a quad per segment and a round join wherever the line turns enough
+     * to leave a gap, all merged in one pass */
+    for(i=0;i<segments;i++) {
+        aa_path_segment(&p,
+          points[(i*2)] - 0.5f, points[(i*2)+1] - 0.5f,
+          points[((i+1)%count)*2] - 0.5f, points[(((i+1)%count)*2)+1] - 0.5f,
+          half);
+    }
+    for(i=closed ? 0 : 1;i<(closed ? count : count - 1);i++) {
+        ax = points[((i+count-1)%count)*2]; ay = points[(((i+count-1)%count)*2)+1];
+        bx = points[(i*2)]; by = points[(i*2)+1];
+        cx = points[((i+1)%count)*2]; cy = points[(((i+1)%count)*2)+1];
+        la = sqrtf(((bx - ax) * (bx - ax)) + ((by - ay) * (by - ay)));
+        lb = sqrtf(((cx - bx) * (cx - bx)) + ((cy - by) * (cy - by)));
+        if(la == 0 || lb == 0) continue;
+        cross = (((bx - ax) * (cy - by)) - ((by - ay) * (cx - bx))) / (la * lb);
+        if(fabsf(cross) * half < AA_JOIN && ((bx - ax) * (cx - bx)) + ((by - ay) * (cy - by)) > 0) continue;
+        aa_path_circle(&p,bx - 0.5f,by - 0.5f,half,1);
+    }
+
+    ret = aa_fill(dst,width,height,channels,&p,r,g,b,a);
+    aa_path_free(&p);
+    return ret;
+}
+
+int
+image_fill_polygon(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const float *points, unsigned int count, uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    aa_path p = AA_PATH_ZERO;
+    unsigned int i = 0;
+    int ret = 0;
+
+    for(i=0;i<count;i++) {
+        aa_path_point(&p,points[(i*2)] - 0.5f,points[(i*2)+1] - 0.5f);
+    }
+    aa_path_close(&p,0);
+    ret = aa_fill(dst,width,height,channels,&p,r,g,b,a);
+    aa_path_free(&p);
+    return ret;
+}
+
+int
+image_draw_circle(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  float x, float y, float radius, float thickness, uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    aa_path p = AA_PATH_ZERO;
+    float outer = thickness > 0 ? radius + (thickness / 2) : radius;
+    float inner = radius - (thickness / 2);
+    int ret = 0;
+
+    if(!(radius > 0) || !isfinite(outer)) return 0;
+    aa_path_circle(&p,x - 0.5f,y - 0.5f,outer,1);
+    if(thickness > 0 && inner > 0) {
+        aa_path_circle(&p,x - 0.5f,y - 0.5f,inner,-1);
+    }
+    ret = aa_fill(dst,width,height,channels,&p,r,g,b,a);
+    aa_path_free(&p);
+    return ret;
+}
+
+int
+image_draw_arc(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  float x, float y, float radius, float start, float finish, float thickness,
+  uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    aa_path p = AA_PATH_ZERO;
+    float a0 = start * (float)M_PI / 180.0f;
+    float a1 = finish * (float)M_PI / 180.0f;
+    float outer = thickness > 0 ? radius + (thickness / 2) : radius;
+    float inner = radius - (thickness / 2);
+    float t = 0;
+    int ret = 0;
+
+    if(!(radius > 0) || !isfinite(outer) || !isfinite(a0) || !isfinite(a1) || a0 == a1) return 0;
+    if(a1 < a0) {
+        t = a0; a0 = a1; a1 = t;
+    }
+    if(a1 - a0 > (float)(2 * M_PI)) a1 = a0 + (float)(2 * M_PI);
+
+    x -= 0.5f;
+    y -= 0.5f;
+    aa_path_arc(&p,x,y,outer,a0,a1);
+    if(thickness > 0 && inner > 0) {
+        aa_path_arc(&p,x,y,inner,a1,a0);
+    }
+    else {
+        aa_path_point(&p,x,y);
+    }
+    aa_path_close(&p,0);
+    ret = aa_fill(dst,width,height,channels,&p,r,g,b,a);
+    aa_path_free(&p);
+    return ret;
+}
+
+/* rows per band in image_draw, sized so a 1080p band stays in L2 */
+#define DRAW_BAND 64
+
+/* top and bottom rows a command can touch, 0 if it's off the image */
+static int
+draw_rows(const image_cmd *c, unsigned int width, unsigned int height, int *top, int *bottom) {
+    int x1 = c->x1;
+    int y1 = c->y1;
+    int x2 = c->x2;
+    int y2 = c->y2;
+
+    switch(c->type) {
+        case IMAGE_CMD_RECTANGLE: break;
+        case IMAGE_CMD_PIXEL: {
+            x2 = x1;
+            y2 = y1;
+            break;
+        }
+        case IMAGE_CMD_STAMP:
+        case IMAGE_CMD_MASK: {
+            x1 += c->mask_left;
+            y1 += c->mask_top;
+            x2 = c->x1 + (int)c->src_width - 1 - c->mask_right;
+            y2 = c->y1 + (int)c->src_height - 1 - c->mask_bottom;
+            if(x1 > x2 || y1 > y2) return 0;
+            break;
+        }
+        default: return 0;
+    }
+    if(!fill_clip(&x1,&y1,&x2,&y2,width,height)) return 0;
+    *top = y1;
+    *bottom = y2;
+    return 1;
+}
+
+static void
+draw_cmd(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const image_cmd *c, int top, int bottom) {
+    switch(c->type) {
+        case IMAGE_CMD_RECTANGLE: {
+            image_fill(dst,width,height,channels,c->x1,top,c->x2,bottom,c->r,c->g,c->b,c->a);
+            break;
+        }
+        case IMAGE_CMD_PIXEL: {
+            image_fill(dst,width,height,channels,c->x1,c->y1,c->x1,c->y1,c->r,c->g,c->b,c->a);
+            break;
+        }
+        case IMAGE_CMD_STAMP: {
+            /* trim the stamp to the band with its masks */
+            image_stamp(dst,width,height,channels,
+              c->src,c->src_width,c->src_height,c->src_channels,
+              c->x1,c->y1,c->flags,
+              c->mask_left,c->mask_right,
+              top - c->y1,
+              (c->y1 + (int)c->src_height - 1) - bottom,
+              c->alpha);
+            break;
+        }
+        case IMAGE_CMD_MASK: {
+            image_stamp_mask(dst,width,height,channels,
+              c->src,c->src_width,c->src_height,
+              c->x1,c->y1,
+              c->mask_left,c->mask_right,
+              top - c->y1,
+              (c->y1 + (int)c->src_height - 1) - bottom,
+              c->r,c->g,c->b,c->a);
+            break;
+        }
+    }
+}
+
+void
+image_draw(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const image_cmd *cmds, unsigned int count) {
+    unsigned int bands = (height + DRAW_BAND - 1) / DRAW_BAND;
+    unsigned int *start = NULL; /* bands+1 offsets into list */
+    unsigned int *list = NULL; /* command indices, grouped by band */
+    int *rows = NULL; /* top, bottom per command */
+    unsigned int total = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+    int band = 0;
+    int top = 0;
+    int bottom = 0;
+
+    if(channels < 3 || count == 0 || bands == 0) return;
+
+    rows = malloc(sizeof(int) * 2 * count);
+    start = calloc(bands + 1, sizeof(unsigned int));
+
+    /* clip everything once, and count the bands each command touches */
+    for(i=0;rows != NULL && start != NULL && i<count;i++) {
+        if(!draw_rows(&cmds[i],width,height,&top,&bottom)) {
+            rows[i*2] = 0;
+            continue;
+        }
+        rows[i*2] = top;
+        rows[(i*2)+1] = bottom;
+        for(j=(top-1)/DRAW_BAND;j<=(unsigned int)(bottom-1)/DRAW_BAND;j++) {
+            start[j+1]++;
+        }
+    }
+
+    if(rows != NULL && start != NULL) {
+        for(j=0;j<bands;j++) {
+            start[j+1] += start[j];
+        }
+        total = start[bands];
+        list = malloc(sizeof(unsigned int) * (total ? total : 1));
+    }
+
+    if(list == NULL) {
+        /* no bands, just run them in order */
+        for(i=0;i<count;i++) {
+            if(!draw_rows(&cmds[i],width,height,&top,&bottom)) continue;
+            draw_cmd(dst,width,height,channels,&cmds[i],top,bottom);
+        }
+        free(rows);
+        free(start);
+        return;
+    }
+
+    /* stable counting sort into bands, so each band keeps the
+     * commands' order */
+    for(i=0;i<count;i++) {
+        if(rows[i*2] == 0) continue;
+        for(j=(rows[i*2]-1)/DRAW_BAND;j<=(unsigned int)(rows[(i*2)+1]-1)/DRAW_BAND;j++) {
+            list[start[j]++] = i;
+        }
+    }
+
+    /* start[j] is now the end of band j, bottom-up so bands are
+     * visited in memory order */
+    for(j=bands;j-->0;) {
+        band = (j * DRAW_BAND) + 1;
+        for(i=j ? start[j-1] : 0;i<start[j];i++) {
+            top = rows[list[i]*2];
+            bottom = rows[(list[i]*2)+1];
+            draw_cmd(dst,width,height,channels,&cmds[list[i]],
+              top > band ? top : band,
+              bottom < band + DRAW_BAND - 1 ? bottom : band + DRAW_BAND - 1);
+        }
+    }
+
+    free(list);
+    free(rows);
+    free(start);
+}
+
+#undef DRAW_BAND
+#undef FILL_SPAN
+#undef FILL_NARROW
+
 int
 image_probe(const char *filename, unsigned int *width, unsigned int *height, unsigned int *channels) {
     int x = 0;
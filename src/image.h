@@ -10,6 +10,48 @@ typedef struct gif_result_t {
 } gif_result;
 
 
+enum IMAGE_BLEND_MODE {
+    IMAGE_BLEND_ALPHA,
+    IMAGE_BLEND_ADD,
+    IMAGE_BLEND_MULTIPLY,
+};
+
+/* image_stamp flags */
+#define IMAGE_STAMP_HFLIP 1
+#define IMAGE_STAMP_VFLIP 2
+
+/* batched drawing, see image_draw */
+enum IMAGE_CMD {
+    IMAGE_CMD_RECTANGLE,
+    IMAGE_CMD_PIXEL,
+    IMAGE_CMD_STAMP,
+    IMAGE_CMD_MASK,
+};
+
+typedef struct image_cmd {
+    unsigned int type;
+    int x1; /* rectangle corners, pixels, stamps and masks use x1,y1 */
+    int y1;
+    int x2;
+    int y2;
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+    uint8_t a;
+    const uint8_t *src; /* stamps take image_stamp's arguments, masks are
+                         * drawn in r,g,b,a like image_stamp_mask, with
+                         * src_channels, flags and alpha unused */
+    unsigned int src_width;
+    unsigned int src_height;
+    unsigned int src_channels;
+    unsigned int flags;
+    int mask_left;
+    int mask_right;
+    int mask_top;
+    int mask_bottom;
+    int alpha;
+} image_cmd;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -17,9 +59,108 @@ extern "C" {
 int
 image_probe (const char *filename, unsigned int *width, unsigned int *height, unsigned int *channels);
 
+/* blends len bytes of src into dst, a is 0 (keep dst) - 255 (all src).
+ * kernels are picked at runtime for the CPU (scalar, SSE2 or AVX2) */
 void
 image_blend(uint8_t *dst, uint8_t *src, unsigned int len, uint8_t a);
 
+/* like image_blend, IMAGE_BLEND_ADD adds src scaled by a (saturating),
+ * IMAGE_BLEND_MULTIPLY blends towards dst * src */
+void
+image_blend_mode(uint8_t *dst, const uint8_t *src, unsigned int len, uint8_t a, unsigned int mode);
+
+/* blends pixels BGRA pixels over BGR pixels, each pixel's alpha is scaled by a */
+void
+image_blend_rgba(uint8_t *dst, const uint8_t *src, unsigned int pixels, uint8_t a);
+
+int
+image_blend_mode_scan(const char *s, unsigned int *mode);
+
+/* "avx2", "sse2" or "scalar" */
+const char *
+image_blend_isa(void);
+
+/* draws src on top of dst with its top-left corner at x,y (1-based, from the top).
+ * the mask_ values trim the edges of the stamp as it's drawn, after flipping,
+ * so with IMAGE_STAMP_HFLIP mask_left still trims the left side, negative ones
+ * are treated as 0. alpha is -1 to use
+ * src's own alpha (if it has any), otherwise it replaces it for every
+ * pixel that isn't fully transparent. dst has to be at least 3 channels */
+void
+image_stamp(
+  uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const uint8_t *src, unsigned int src_width, unsigned int src_height, unsigned int src_channels,
+  int x, int y, unsigned int flags,
+  int mask_left, int mask_right, int mask_top, int mask_bottom,
+  int alpha);
+
+/* fills x1,y1 to x2,y2 (1-based, inclusive, from the top) with one colour.
+ * returns 0 if the rectangle is entirely outside the image */
+int
+image_fill(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+/* fills x1,y1 to x2,y2 fading from one RGBA colour to another, from x1
+ * to x2 (or y1 to y2 when vertical) */
+int
+image_gradient_linear(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  int x1, int y1, int x2, int y2, const uint8_t *from, const uint8_t *to, unsigned int vertical);
+
+/* fills a circle around x,y fading from one RGBA colour at the centre to
+ * another at radius */
+int
+image_gradient_radial(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  int x, int y, unsigned int radius, const uint8_t *from, const uint8_t *to);
+
+/* draws one colour through a coverage mask (one byte per pixel, top row
+ * first) with its top-left corner at x,y. the mask_ values trim its edges
+ * like image_stamp, a scales the coverage */
+void
+image_stamp_mask(
+  uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const uint8_t *mask, unsigned int mask_width, unsigned int mask_height,
+  int x, int y,
+  int mask_left, int mask_right, int mask_top, int mask_bottom,
+  uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+/* antialiased shapes, coordinates are 1-based pixel centres from the top
+ * and may be fractional. each returns 0 if nothing could be drawn.
+ * lines up to 1 pixel thick are drawn with Wu's algorithm, everything
+ * else through a coverage rasterizer */
+int
+image_draw_line(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  float x1, float y1, float x2, float y2, float thickness, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+/* points holds count x,y pairs. thick polylines get round joins */
+int
+image_draw_polyline(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const float *points, unsigned int count, float thickness, unsigned int closed,
+  uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+/* fills the polygon through count x,y pairs, overlapping parts are
+ * filled once (non-zero winding) */
+int
+image_fill_polygon(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const float *points, unsigned int count, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+/* a thickness of 0 fills the circle, otherwise it's a ring centred on radius */
+int
+image_draw_circle(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  float x, float y, float radius, float thickness, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+/* an arc from start to finish in degrees, clockwise from 3 o'clock. a
+ * thickness of 0 fills the pie slice instead */
+int
+image_draw_arc(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  float x, float y, float radius, float start, float finish, float thickness,
+  uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
+/* runs a list of drawing commands. the image is drawn a band of rows at a
+ * time, each band running every command that touches it, in order */
+void
+image_draw(uint8_t *dst, unsigned int width, unsigned int height, unsigned int channels,
+  const image_cmd *cmds, unsigned int count);
+
 uint8_t *
 image_load(
   const char *filename,
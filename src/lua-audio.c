@@ -1,46 +1,969 @@
 #include "audio.h"
 #include "lua-audio.h"
+#include "lua-image.h"
 
 #include <lua.h>
 #include <lauxlib.h>
 #include <skalibs/skalibs.h>
+#include <limits.h>
+#include <string.h>
+#include <math.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#if !defined(luaL_newlibtable) \
+  && (!defined LUA_VERSION_NUM || LUA_VERSION_NUM==501)
+static void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
+  luaL_checkstack(L, nup+1, "too many upvalues");
+  for (; l->name != NULL; l++) {  /* fill the table with given functions */
+    int i;
+    lua_pushlstring(L, l->name,strlen(l->name));
+    for (i = 0; i < nup; i++)  /* copy upvalues to the top */
+      lua_pushvalue(L, -(nup+1));
+    lua_pushcclosure(L, l->func, nup);  /* closure with those upvalues */
+    lua_settable(L, -(nup + 3));
+  }
+  lua_pop(L, nup);  /* remove upvalues */
+}
+#endif
+
+#ifdef AUDIO_FLOAT
+#define AUDIO_FLOAT_TYPE "float"
+#else
+#define AUDIO_FLOAT_TYPE "double"
+#endif
+
+/* read-only view of an array owned by the audio processor,
+ * views of the analysis arrays remember the processor's generation
+ * and refuse to read once configure{} has replaced them */
+typedef struct lua_audio_buffer {
+    const audio_float *data;
+    unsigned int len;
+    const audio_processor *processor; /* NULL for arrays that live as long as the processor */
+    unsigned int generation;
+} lua_audio_buffer;
+
+static lua_audio_buffer *
+lua_audio_check_buffer(lua_State *L, int idx) {
+    lua_audio_buffer *b = luaL_checkudata(L,idx,"audio_buffer");
+    if(b->processor && b->processor->generation != b->generation) {
+        luaL_error(L,"audio buffer is stale, call arrays() again");
+    }
+    return b;
+}
+
 static int
-lua_amp_index(lua_State *L) {
-    int index = 0;
-    audio_processor *a = NULL;
+lua_audio_buffer_index(lua_State *L) {
+    lua_audio_buffer *b = luaL_checkudata(L,1,"audio_buffer");
+    lua_Integer index = 0;
+
     if(!lua_isnumber(L,2)) {
-        return 0;
+        luaL_getmetatable(L,"audio_buffer");
+        lua_getfield(L,-1,"methods");
+        lua_pushvalue(L,2);
+        lua_rawget(L,-2);
+        return 1;
     }
-    index = lua_tointeger(L,2) - 1;
-    if(index < 0) {
+
+    b = lua_audio_check_buffer(L,1);
+    index = lua_tointeger(L,2);
+    if(index < 1 || (unsigned int)index > b->len) {
         return 0;
     }
-    lua_getfield(L,1,"data");
-    a = lua_touserdata(L,-1);
+    lua_pushnumber(L,b->data[index-1]);
+    return 1;
+}
+
+static int
+lua_audio_buffer_len(lua_State *L) {
+    lua_audio_buffer *b = lua_audio_check_buffer(L,1);
+    lua_pushinteger(L,b->len);
+    return 1;
+}
+
+static int
+lua_audio_buffer_totable(lua_State *L) {
+    /* buf:totable(t), fills and returns t, or a new table */
+    lua_audio_buffer *b = lua_audio_check_buffer(L,1);
+    unsigned int i = 0;
+
+    if(!lua_istable(L,2)) {
+        lua_settop(L,1);
+        lua_createtable(L,b->len,0);
+    }
+    else {
+        lua_settop(L,2);
+    }
+
+    for(i=0;i<b->len;i++) {
+        lua_pushnumber(L,b->data[i]);
+        lua_rawseti(L,2,i+1);
+    }
+    return 1;
+}
+
+static int
+lua_audio_buffer_get(lua_State *L) {
+    /* buf:get(first,count), returns count values starting at first */
+    lua_audio_buffer *b = lua_audio_check_buffer(L,1);
+    lua_Integer first = luaL_optinteger(L,2,1);
+    lua_Integer count = luaL_optinteger(L,3,b->len);
+    lua_Integer i = 0;
+
+    if(first < 1) first = 1;
+    if(first > b->len) return 0;
+    if(count > b->len - first + 1) count = b->len - first + 1;
+    if(count < 1) return 0;
+
+    luaL_checkstack(L,count,"too many values");
+    for(i=0;i<count;i++) {
+        lua_pushnumber(L,b->data[first - 1 + i]);
+    }
+    return count;
+}
+
+static int
+lua_audio_buffer_pointer(lua_State *L) {
+    lua_audio_buffer *b = lua_audio_check_buffer(L,1);
+    lua_pushlightuserdata(L,(void *)b->data);
+    return 1;
+}
+
+static const struct luaL_Reg lua_audio_buffer_methods[] = {
+    { "totable", lua_audio_buffer_totable },
+    { "get"    , lua_audio_buffer_get     },
+    { "pointer", lua_audio_buffer_pointer },
+    { NULL     , NULL                     },
+};
+
+static void
+lua_audio_push_buffer(lua_State *L, const audio_float *data, unsigned int len, const audio_processor *processor) {
+    lua_audio_buffer *b = lua_newuserdata(L,sizeof(lua_audio_buffer));
+    b->data = data;
+    b->len = len;
+    b->processor = processor;
+    b->generation = processor ? processor->generation : 0;
+    luaL_getmetatable(L,"audio_buffer");
+    lua_setmetatable(L,-2);
+}
+
+/* copies an array into the table audio[name], in place so scripts
+ * can keep a reference to it */
+static void
+lua_audio_set_array(lua_State *L, int idx, const char *name, const audio_float *data, unsigned int len) {
+    unsigned int i = 0;
+
+    lua_getfield(L,idx,name);
+    if(!lua_istable(L,-1)) {
+        lua_pop(L,1);
+        lua_createtable(L,len,0);
+        lua_pushvalue(L,-1);
+        lua_setfield(L,idx,name);
+    }
+
+    for(i=0;i<len;i++) {
+        lua_pushnumber(L,data[i]);
+        lua_rawseti(L,-2,i+1);
+    }
+
+    /* the spectrum may have shrunk */
+    for(i=len+1;;i++) {
+        lua_rawgeti(L,-1,i);
+        if(lua_isnil(L,-1)) {
+            lua_pop(L,1);
+            break;
+        }
+        lua_pop(L,1);
+        lua_pushnil(L);
+        lua_rawseti(L,-2,i);
+    }
+
     lua_pop(L,1);
+}
+
+/* with LuaJIT, stream.lua sets audio.map_arrays to point
+ * amps/peaks/freqs straight at the processor's arrays */
+static int
+lua_audio_mapped(lua_State *L, int idx) {
+    int r = 0;
+    lua_getfield(L,idx,"map_arrays");
+    r = lua_isfunction(L,-1);
+    lua_pop(L,1);
+    return r;
+}
+
+static void
+lua_audio_set_spectrum(lua_State *L, int idx, audio_processor *a) {
+    lua_pushinteger(L,a->analysis.spectrum_len);
+    lua_setfield(L,idx,"spectrum_len");
+
+    lua_pushinteger(L,a->analysis.hops);
+    lua_setfield(L,idx,"hops");
+
+    lua_pushinteger(L,a->lookahead.frames);
+    lua_setfield(L,idx,"lookahead");
+
+    if(lua_audio_mapped(L,idx)) {
+        lua_getfield(L,idx,"map_arrays");
+        lua_pushvalue(L,idx);
+        if(lua_pcall(L,1,0,0)) {
+            strerr_warn2x("error: ",lua_tostring(L,-1));
+            lua_pop(L,1);
+        }
+        return;
+    }
+
+    lua_audio_set_array(L,idx,"freqs",a->analysis.freqs,a->analysis.spectrum_len);
+}
+
+static void
+lua_audio_set_bands(lua_State *L, int idx, audio_processor *a) {
+    if(lua_audio_mapped(L,idx)) {
+        return;
+    }
+
+    lua_audio_set_array(L,idx,"amps",a->analysis.amps,a->analysis.spectrum_len);
+    lua_audio_set_array(L,idx,"peaks",a->analysis.peaks,a->analysis.spectrum_len);
+
+    if(a->analysis.harmonic) {
+        lua_audio_set_array(L,idx,"harmonic",a->analysis.harmonic,a->analysis.spectrum_len);
+        lua_audio_set_array(L,idx,"percussive",a->analysis.percussive,a->analysis.spectrum_len);
+    }
+    else if(a->reconfigured) {
+        lua_pushnil(L);
+        lua_setfield(L,idx,"harmonic");
+        lua_pushnil(L);
+        lua_setfield(L,idx,"percussive");
+    }
+
+    lua_audio_set_array(L,idx,"substeps",a->analysis.substeps,a->analysis.spectrum_len * a->analysis.hops);
+
+    if(a->lookahead.frames) {
+        lua_audio_set_array(L,idx,"current",a->lookahead.current,a->lookahead.width);
+    }
+    else {
+        lua_getfield(L,idx,"amps");
+        lua_setfield(L,idx,"current");
+    }
+}
+
+static int
+lua_audio_arrays(lua_State *L) {
+    /* audio:arrays(), returns the current per-band arrays as buffers */
+    audio_processor *a = lua_touserdata(L,lua_upvalueindex(1));
+
+    lua_newtable(L);
+    lua_audio_push_buffer(L,a->analysis.amps,a->analysis.spectrum_len,a);
+    lua_setfield(L,-2,"amps");
+    lua_audio_push_buffer(L,a->analysis.peaks,a->analysis.spectrum_len,a);
+    lua_setfield(L,-2,"peaks");
+    lua_audio_push_buffer(L,a->analysis.freqs,a->analysis.spectrum_len,a);
+    lua_setfield(L,-2,"freqs");
+    lua_audio_push_buffer(L,a->analysis.substeps,a->analysis.spectrum_len * a->analysis.hops,a);
+    lua_setfield(L,-2,"substeps");
+    if(a->lookahead.frames) {
+        lua_audio_push_buffer(L,a->lookahead.current,a->lookahead.width,a);
+        lua_setfield(L,-2,"current");
+    }
+    if(a->analysis.harmonic) {
+        lua_audio_push_buffer(L,a->analysis.harmonic,a->analysis.spectrum_len,a);
+        lua_setfield(L,-2,"harmonic");
+        lua_audio_push_buffer(L,a->analysis.percussive,a->analysis.spectrum_len,a);
+        lua_setfield(L,-2,"percussive");
+    }
+    return 1;
+}
+
+typedef struct lua_audio_colormap_stop {
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+} lua_audio_colormap_stop;
+
+static const lua_audio_colormap_stop colormap_gray[] = {
+    {   0,   0,   0 }, { 255, 255, 255 },
+};
+
+static const lua_audio_colormap_stop colormap_fire[] = {
+    {   0,   0,   0 }, { 128,   0,   0 }, { 255,  64,   0 }, { 255, 200,   0 }, { 255, 255, 255 },
+};
+
+static const lua_audio_colormap_stop colormap_ice[] = {
+    {   0,   0,   0 }, {   0,   0, 128 }, {   0, 128, 255 }, { 128, 255, 255 }, { 255, 255, 255 },
+};
+
+static const lua_audio_colormap_stop colormap_viridis[] = {
+    {  68,   1,  84 }, {  59,  82, 139 }, {  33, 145, 140 }, {  94, 201,  98 }, { 253, 231,  37 },
+};
+
+static const struct {
+    const char *name;
+    const lua_audio_colormap_stop *stops;
+    unsigned int len;
+} colormaps[] = {
+    { "gray"   , colormap_gray   , sizeof(colormap_gray) / sizeof(colormap_gray[0])       },
+    { "fire"   , colormap_fire   , sizeof(colormap_fire) / sizeof(colormap_fire[0])       },
+    { "ice"    , colormap_ice    , sizeof(colormap_ice) / sizeof(colormap_ice[0])         },
+    { "viridis", colormap_viridis, sizeof(colormap_viridis) / sizeof(colormap_viridis[0]) },
+    { NULL     , NULL            , 0                                                      },
+};
+
+/* spreads the stops evenly over 256 BGR entries */
+static void
+lua_audio_colormap_fill(uint8_t *lut, const lua_audio_colormap_stop *stops, unsigned int len) {
+    unsigned int i = 0;
+    unsigned int s = 0;
+    unsigned int pos = 0;
+    unsigned int frac = 0;
+
+    for(i=0;i<256;i++) {
+        pos = i * (len - 1); /* in 1/255ths of a stop */
+        s = pos / 255;
+        frac = pos % 255;
+        if(s >= len - 1) {
+            s = len - 2;
+            frac = 255;
+        }
+        lut[i*3]   = (stops[s].b * (255 - frac) + stops[s+1].b * frac) / 255;
+        lut[i*3+1] = (stops[s].g * (255 - frac) + stops[s+1].g * frac) / 255;
+        lut[i*3+2] = (stops[s].r * (255 - frac) + stops[s+1].r * frac) / 255;
+    }
+}
+
+/* colormap at idx is nil, a name, or an array of {r,g,b} stops */
+static int
+lua_audio_colormap(lua_State *L, int idx, uint8_t *lut) {
+    lua_audio_colormap_stop stops[256];
+    const char *name = NULL;
+    unsigned int len = 0;
+    unsigned int i = 0;
+
+    if(lua_isnoneornil(L,idx)) {
+        lua_audio_colormap_fill(lut,colormap_gray,2);
+        return 1;
+    }
+
+    if(lua_isstring(L,idx)) {
+        name = lua_tostring(L,idx);
+        for(i=0;colormaps[i].name != NULL;i++) {
+            if(strcmp(colormaps[i].name,name) == 0) {
+                lua_audio_colormap_fill(lut,colormaps[i].stops,colormaps[i].len);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    if(!lua_istable(L,idx)) {
+        return 0;
+    }
+
+    for(len=0;len<256;len++) {
+        lua_rawgeti(L,idx,len+1);
+        if(!lua_istable(L,-1)) {
+            lua_pop(L,1);
+            break;
+        }
+        lua_rawgeti(L,-1,1);
+        lua_rawgeti(L,-2,2);
+        lua_rawgeti(L,-3,3);
+        stops[len].r = (uint8_t)lua_tointeger(L,-3);
+        stops[len].g = (uint8_t)lua_tointeger(L,-2);
+        stops[len].b = (uint8_t)lua_tointeger(L,-1);
+        lua_pop(L,4);
+    }
 
-    if((unsigned int)index >= a->spectrum_len) {
+    if(len < 2) {
         return 0;
     }
 
-    lua_pushnumber(L,a->spectrum_cur[index].amp);
+    lua_audio_colormap_fill(lut,stops,len);
     return 1;
 }
 
+static int
+lua_audio_spectrogram_index(lua_State *L) {
+    audio_processor **a = luaL_checkudata(L,1,"audio_spectrogram");
+    audio_spectrogram *s = &((*a)->spectrogram);
+    const char *key = lua_tostring(L,2);
+
+    if(key == NULL) {
+        return 0;
+    }
+
+    if(strcmp(key,"depth") == 0) {
+        lua_pushinteger(L,s->depth);
+    }
+    else if(strcmp(key,"width") == 0) {
+        lua_pushinteger(L,s->width);
+    }
+    else if(strcmp(key,"head") == 0) {
+        lua_pushinteger(L,s->head);
+    }
+    else if(strcmp(key,"count") == 0) {
+        lua_pushinteger(L,s->count);
+    }
+    else if(strcmp(key,"format") == 0) {
+        lua_pushstring(L,s->format == AUDIO_SPECTROGRAM_FLOAT ? "float" : "u8");
+    }
+    else {
+        luaL_getmetatable(L,"audio_spectrogram");
+        lua_getfield(L,-1,"methods");
+        lua_pushvalue(L,2);
+        lua_rawget(L,-2);
+    }
+    return 1;
+}
+
+/* ring offset of the row age rows back (0 = newest), or -1 */
+static long
+lua_audio_spectrogram_row(const audio_spectrogram *s, unsigned int age) {
+    if(age >= s->count) {
+        return -1;
+    }
+    return (long)((s->head + s->depth - age) % s->depth) * s->width;
+}
+
+static audio_float
+lua_audio_spectrogram_value(const audio_spectrogram *s, long offset) {
+    if(s->format == AUDIO_SPECTROGRAM_FLOAT) {
+        return ((float *)s->data)[offset];
+    }
+    return ((uint8_t *)s->data)[offset] / 255.0f;
+}
+
+static int
+lua_audio_spectrogram_get(lua_State *L) {
+    /* spectrogram:get(age,band), age 1 is the newest row */
+    audio_processor **a = luaL_checkudata(L,1,"audio_spectrogram");
+    audio_spectrogram *s = &((*a)->spectrogram);
+    lua_Integer age = luaL_checkinteger(L,2);
+    lua_Integer band = luaL_checkinteger(L,3);
+    long row = 0;
+
+    if(age < 1 || band < 1 || (unsigned int)band > s->width) {
+        return 0;
+    }
+    row = lua_audio_spectrogram_row(s,age - 1);
+    if(row < 0) {
+        return 0;
+    }
+    lua_pushnumber(L,lua_audio_spectrogram_value(s,row + band - 1));
+    return 1;
+}
+
+static int
+lua_audio_spectrogram_totable(lua_State *L) {
+    /* spectrogram:totable(age,t), fills and returns t, or a new table */
+    audio_processor **a = luaL_checkudata(L,1,"audio_spectrogram");
+    audio_spectrogram *s = &((*a)->spectrogram);
+    lua_Integer age = luaL_checkinteger(L,2);
+    unsigned int i = 0;
+    long row = 0;
+
+    if(age < 1) {
+        return 0;
+    }
+    row = lua_audio_spectrogram_row(s,age - 1);
+    if(row < 0) {
+        return 0;
+    }
+
+    if(!lua_istable(L,3)) {
+        lua_settop(L,2);
+        lua_createtable(L,s->width,0);
+    }
+    else {
+        lua_settop(L,3);
+    }
+
+    for(i=0;i<s->width;i++) {
+        lua_pushnumber(L,lua_audio_spectrogram_value(s,row + i));
+        lua_rawseti(L,3,i+1);
+    }
+    return 1;
+}
+
+static int
+lua_audio_spectrogram_pointer(lua_State *L) {
+    audio_processor **a = luaL_checkudata(L,1,"audio_spectrogram");
+    if((*a)->spectrogram.data == NULL) {
+        return 0;
+    }
+    lua_pushlightuserdata(L,(*a)->spectrogram.data);
+    return 1;
+}
+
+/* i * n / d rounded down, for 0 <= i < d. d is the size asked for, not
+ * what's visible, so i * n can overflow and goes through a double then */
+static size_t
+lua_audio_blit_pos(lua_Integer i, size_t n, lua_Integer d) {
+    double v = 0;
+    if(n == 0 || (size_t)i <= (size_t)-1 / n) {
+        return (size_t)i * n / (size_t)d;
+    }
+    v = (double)i * (double)n / (double)d;
+    return v < (double)n ? (size_t)v : n - 1;
+}
+
+static int
+lua_audio_spectrogram_blit(lua_State *L) {
+    image_frame f;
+    /* spectrogram:blit(frame,x,y,width,height,colormap,direction) */
+    audio_processor **a = luaL_checkudata(L,1,"audio_spectrogram");
+    audio_spectrogram *s = &((*a)->spectrogram);
+    uint8_t lut[256 * 3];
+    uint8_t *image = NULL;
+    uint8_t *p = NULL;
+    const uint8_t *c = NULL;
+    unsigned int image_width = 0;
+    unsigned int image_height = 0;
+    unsigned int channels = 0;
+    const char *direction = NULL;
+    int vertical = 1;
+    int reverse = 0;
+    size_t total = 0;
+    size_t *rowpart = NULL;
+    size_t *colpart = NULL;
+    size_t offset = 0;
+    long row = 0;
+    lua_Integer px = 0;
+    lua_Integer py = 0;
+    lua_Integer px_start = 0;
+    lua_Integer px_end = 0;
+    lua_Integer py_start = 0;
+    lua_Integer py_end = 0;
+    unsigned int v = 0;
+    lua_Integer t = 0;
+
+    if(!luaimage_get_frame(L,2,&f)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Missing argument frame");
+        return 2;
+    }
+
+    lua_Integer x = luaL_checkinteger(L,3);
+    lua_Integer y = luaL_checkinteger(L,4);
+    lua_Integer w = luaL_checkinteger(L,5);
+    lua_Integer h = luaL_checkinteger(L,6);
+
+    if(!lua_audio_colormap(L,7,lut)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Unknown colormap");
+        return 2;
+    }
+
+    direction = luaL_optstring(L,8,"down");
+    if(strcmp(direction,"down") == 0) {
+        vertical = 1; reverse = 0;
+    }
+    else if(strcmp(direction,"up") == 0) {
+        vertical = 1; reverse = 1;
+    }
+    else if(strcmp(direction,"left") == 0) {
+        vertical = 0; reverse = 1;
+    }
+    else if(strcmp(direction,"right") == 0) {
+        vertical = 0; reverse = 0;
+    }
+    else {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Unknown direction");
+        return 2;
+    }
+
+    image = f.image;
+    image_width = f.width;
+    image_height = f.height;
+    channels = f.channels;
+
+    if(image == NULL || channels < 3 || s->depth == 0 || w < 1 || h < 1) {
+        lua_pushboolean(L,0);
+        return 1;
+    }
+
+    /* visible part of the rectangle, relative to x,y */
+    px_start = x < 1 ? 1 - x : 0;
+    py_start = y < 1 ? 1 - y : 0;
+    px_end = audio_min(w,(lua_Integer)image_width - x + 1);
+    py_end = audio_min(h,(lua_Integer)image_height - y + 1);
+    if(px_start >= px_end || py_start >= py_end) {
+        lua_pushboolean(L,1);
+        return 1;
+    }
+
+    /* the lookups only cover the visible part, which is never bigger
+     * than the frame however large w and h are */
+    rowpart = (size_t *)malloc(sizeof(size_t) * ((py_end - py_start) + (px_end - px_start)));
+    if(rowpart == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    colpart = rowpart + (py_end - py_start);
+
+    /* offset = rowpart[py] + colpart[px], anything past total is an
+     * empty row and drawn as the colormap's first entry */
+    total = (size_t)s->depth * s->width;
+
+    if(vertical) {
+        for(py=py_start;py<py_end;py++) {
+            t = reverse ? h - 1 - py : py;
+            row = lua_audio_spectrogram_row(s,lua_audio_blit_pos(t,s->depth,h));
+            rowpart[py - py_start] = row < 0 ? total : (size_t)row;
+        }
+        for(px=px_start;px<px_end;px++) {
+            colpart[px - px_start] = lua_audio_blit_pos(px,s->width,w);
+        }
+    }
+    else {
+        for(py=py_start;py<py_end;py++) {
+            rowpart[py - py_start] = lua_audio_blit_pos(h - 1 - py,s->width,h);
+        }
+        for(px=px_start;px<px_end;px++) {
+            t = reverse ? w - 1 - px : px;
+            row = lua_audio_spectrogram_row(s,lua_audio_blit_pos(t,s->depth,w));
+            colpart[px - px_start] = row < 0 ? total : (size_t)row;
+        }
+    }
+
+    for(py=py_start;py<py_end;py++) {
+        p = image + ((image_height - (y + py)) * image_width + (x + px_start - 1)) * channels;
+        for(px=px_start;px<px_end;px++) {
+            offset = rowpart[py - py_start] + colpart[px - px_start];
+            if(offset >= total) {
+                v = 0;
+            }
+            else if(s->format == AUDIO_SPECTROGRAM_FLOAT) {
+                v = (unsigned int)(audio_max(0.0f,audio_min(1.0f,((float *)s->data)[offset])) * 255.0f);
+            }
+            else {
+                v = ((uint8_t *)s->data)[offset];
+            }
+            c = lut + (v * 3);
+            p[0] = c[0];
+            p[1] = c[1];
+            p[2] = c[2];
+            if(channels == 4) {
+                p[3] = 255;
+            }
+            p += channels;
+        }
+    }
+
+    free(rowpart);
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static const struct luaL_Reg lua_audio_spectrogram_methods[] = {
+    { "get"    , lua_audio_spectrogram_get     },
+    { "totable", lua_audio_spectrogram_totable },
+    { "blit"   , lua_audio_spectrogram_blit    },
+    { "pointer", lua_audio_spectrogram_pointer },
+    { NULL     , NULL                          },
+};
+
+static int
+lua_audio_set_spectrogram(lua_State *L) {
+    /* audio:set_spectrogram(depth,format) */
+    audio_processor *a = lua_touserdata(L,lua_upvalueindex(1));
+    lua_Integer depth = luaL_checkinteger(L,2);
+    unsigned int format = AUDIO_SPECTROGRAM_U8;
+
+    if(lua_isstring(L,3)) {
+        if(!audio_spectrogram_format_scan(lua_tostring(L,3),&format)) {
+            lua_pushnil(L);
+            lua_pushliteral(L,"Unknown spectrogram format");
+            return 2;
+        }
+    }
+
+    if(depth < 0 || !audio_processor_spectrogram(a,(unsigned int)depth,format)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Unable to set up spectrogram");
+        return 2;
+    }
+
+    if(lua_istable(L,1) && lua_audio_mapped(L,1)) {
+        lua_getfield(L,1,"map_arrays");
+        lua_pushvalue(L,1);
+        lua_call(L,1,0);
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+lua_audio_plot_vectorscope(lua_State *L) {
+    image_frame f;
+    /* audio:plot_vectorscope(frame,x,y,width,height,r,g,b,a,scale) */
+    audio_processor *a = lua_touserdata(L,lua_upvalueindex(1));
+    const audio_float *side = a->stereo.points;
+    const audio_float *mid = a->stereo.points + a->stereo.points_len;
+    uint8_t *image = NULL;
+    uint8_t *p = NULL;
+    unsigned int image_width = 0;
+    unsigned int image_height = 0;
+    unsigned int channels = 0;
+    unsigned int i = 0;
+    unsigned int alpha = 0;
+    unsigned int alpha_inv = 0;
+    lua_Integer px = 0;
+    lua_Integer py = 0;
+
+    if(!luaimage_get_frame(L,2,&f)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Missing argument frame");
+        return 2;
+    }
+
+    lua_Integer x = luaL_checkinteger(L,3);
+    lua_Integer y = luaL_checkinteger(L,4);
+    lua_Integer w = luaL_checkinteger(L,5);
+    lua_Integer h = luaL_checkinteger(L,6);
+    lua_Integer r = luaL_checkinteger(L,7);
+    lua_Integer g = luaL_checkinteger(L,8);
+    lua_Integer b = luaL_checkinteger(L,9);
+    lua_Integer o = luaL_optinteger(L,10,255);
+    lua_Number scale = luaL_optnumber(L,11,1.0f);
+
+    if(r > 255 || b > 255 || g > 255 || o > 255 ||
+       r < 0   || b < 0   || g < 0   || o < 0 ) {
+        lua_pushboolean(L,0);
+        return 1;
+    }
+
+    image = f.image;
+    image_width = f.width;
+    image_height = f.height;
+    channels = f.channels;
+
+    if(image == NULL || channels < 3 || w < 1 || h < 1) {
+        lua_pushboolean(L,0);
+        return 1;
+    }
+
+    alpha = 1 + o;
+    alpha_inv = 256 - o;
+
+    for(i=0;i<a->stereo.points_len;i++) {
+        px = (lua_Integer)floor((side[i] * scale + 1.0f) / 2.0f * (w - 1) + 0.5f);
+        py = (lua_Integer)floor((1.0f - mid[i] * scale) / 2.0f * (h - 1) + 0.5f);
+        if(px < 0 || py < 0 || px >= w || py >= h) {
+            continue;
+        }
+        px += x;
+        py += y;
+        if(px < 1 || py < 1 || px > image_width || py > image_height) {
+            continue;
+        }
+
+        p = image + ((image_height - py) * image_width + (px - 1)) * channels;
+        if(o == 255) {
+            p[0] = b;
+            p[1] = g;
+            p[2] = r;
+        }
+        else {
+            p[0] = ((p[0] * alpha_inv) + (b * alpha)) >> 8;
+            p[1] = ((p[1] * alpha_inv) + (g * alpha)) >> 8;
+            p[2] = ((p[2] * alpha_inv) + (r * alpha)) >> 8;
+        }
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* reads an optional count at idx into v, 0 if it's negative or too big
+ * for an unsigned int */
+static int
+lua_audio_config_uint(lua_State *L, int idx, unsigned int *v) {
+    lua_Integer n = luaL_optinteger(L,idx,*v);
+    if(n < 0 || (unsigned long long)n > UINT_MAX) return 0;
+    *v = (unsigned int)n;
+    return 1;
+}
+
+static int
+lua_audio_configure(lua_State *L) {
+    /* audio:configure({ window = ..., fft_size = ..., ... }) */
+    audio_processor *a = lua_touserdata(L,lua_upvalueindex(1));
+    audio_config config = a->config;
+
+    if(!lua_istable(L,2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Missing argument config");
+        return 2;
+    }
+
+    lua_getfield(L,2,"window");
+    if(lua_isstring(L,-1)) {
+        if(!audio_window_scan(lua_tostring(L,-1),&(config.window))) {
+            lua_pushnil(L);
+            lua_pushliteral(L,"Unknown window function");
+            return 2;
+        }
+    }
+
+    lua_getfield(L,2,"scale");
+    if(lua_isstring(L,-1)) {
+        if(!audio_scale_scan(lua_tostring(L,-1),&(config.scale))) {
+            lua_pushnil(L);
+            lua_pushliteral(L,"Unknown band scale");
+            return 2;
+        }
+    }
+
+    lua_getfield(L,2,"engine");
+    if(lua_isstring(L,-1)) {
+        if(!audio_engine_scan(lua_tostring(L,-1),&(config.engine))) {
+            lua_pushnil(L);
+            lua_pushliteral(L,"Unknown analysis engine");
+            return 2;
+        }
+    }
+
+    lua_getfield(L,2,"hpss");
+    if(lua_isboolean(L,-1)) {
+        config.hpss = lua_toboolean(L,-1);
+    }
+
+    lua_getfield(L,2,"hop_mode");
+    if(lua_isstring(L,-1)) {
+        if(!audio_hop_mode_scan(lua_tostring(L,-1),&(config.hop_mode))) {
+            lua_pushnil(L);
+            lua_pushliteral(L,"Unknown hop mode");
+            return 2;
+        }
+    }
+
+    lua_getfield(L,2,"hops");
+    lua_getfield(L,2,"fft_size");
+    lua_getfield(L,2,"bars");
+    if(!lua_audio_config_uint(L,-3,&(config.hops)) ||
+       !lua_audio_config_uint(L,-2,&(config.fft_len)) ||
+       !lua_audio_config_uint(L,-1,&(config.spectrum_len))) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"hops, fft_size and bars can't be negative");
+        return 2;
+    }
+
+    lua_getfield(L,2,"freq_min");
+    config.freq_min = luaL_optnumber(L,-1,config.freq_min);
+
+    lua_getfield(L,2,"freq_max");
+    config.freq_max = luaL_optnumber(L,-1,config.freq_max);
+
+    lua_pop(L,10);
+
+    if(!audio_processor_configure(a,&config)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Unable to apply configuration");
+        return 2;
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static void
+lua_audio_set_rhythm(lua_State *L, int idx, audio_processor *a) {
+    lua_pushnumber(L,a->rhythm.onset);
+    lua_setfield(L,idx,"onset");
+
+    lua_pushboolean(L,a->rhythm.beat);
+    lua_setfield(L,idx,"beat");
+
+    lua_pushnumber(L,a->rhythm.bpm);
+    lua_setfield(L,idx,"bpm");
+}
+
+static const char * const pitch_names[12] = {
+    "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B",
+};
+
+static void
+lua_audio_set_chroma(lua_State *L, int idx, audio_processor *a) {
+    lua_audio_set_array(L,idx,"chroma",a->chroma.chroma,12);
+
+    lua_pushinteger(L,a->chroma.pitch + 1);
+    lua_setfield(L,idx,"pitch");
+
+    lua_pushstring(L,pitch_names[a->chroma.pitch]);
+    lua_setfield(L,idx,"pitch_name");
+
+    lua_pushinteger(L,a->chroma.key + 1);
+    lua_setfield(L,idx,"key");
+
+    lua_pushboolean(L,a->chroma.minor);
+    lua_setfield(L,idx,"key_minor");
+
+    lua_pushstring(L,pitch_names[a->chroma.key]);
+    lua_pushstring(L,a->chroma.minor ? " minor" : " major");
+    lua_concat(L,2);
+    lua_setfield(L,idx,"key_name");
+}
+
+static void
+lua_audio_set_meter(lua_State *L, int idx, audio_processor *a) {
+    lua_audio_set_array(L,idx,"rms",a->meter.rms,a->channels);
+    lua_audio_set_array(L,idx,"peak",a->meter.peak,a->channels);
+    lua_audio_set_array(L,idx,"true_peak",a->meter.true_peak,a->channels);
+
+    lua_pushnumber(L,a->meter.lufs_momentary);
+    lua_setfield(L,idx,"lufs_momentary");
+
+    lua_pushnumber(L,a->meter.lufs_short);
+    lua_setfield(L,idx,"lufs_short");
+
+    lua_pushnumber(L,a->stereo.correlation);
+    lua_setfield(L,idx,"correlation");
+
+    lua_pushnumber(L,a->stereo.balance);
+    lua_setfield(L,idx,"balance");
+}
+
+void
+luaaudio_update(lua_State *L, audio_processor *a) {
+    lua_getglobal(L,"stream");
+    lua_getfield(L,-1,"audio");
+    if(a->reconfigured) {
+        lua_audio_set_spectrum(L,lua_gettop(L),a);
+    }
+    lua_audio_set_bands(L,lua_gettop(L),a);
+    lua_audio_set_rhythm(L,lua_gettop(L),a);
+    lua_audio_set_meter(L,lua_gettop(L),a);
+    lua_audio_set_chroma(L,lua_gettop(L),a);
+    lua_pop(L,2);
+}
 
 int luaopen_audio(lua_State *L,audio_processor *a) {
+    int idx = 0;
     unsigned int i = 0;
-    luaL_newmetatable(L,"amp");
-    lua_pushcfunction(L,lua_amp_index);
+    luaL_newmetatable(L,"audio_spectrogram");
+    lua_pushcfunction(L,lua_audio_spectrogram_index);
     lua_setfield(L,-2,"__index");
+    lua_newtable(L);
+    luaL_setfuncs(L,lua_audio_spectrogram_methods,0);
+    lua_setfield(L,-2,"methods");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,"audio_buffer");
+    lua_pushcfunction(L,lua_audio_buffer_index);
+    lua_setfield(L,-2,"__index");
+    lua_pushcfunction(L,lua_audio_buffer_len);
+    lua_setfield(L,-2,"__len");
+    lua_newtable(L);
+    luaL_setfuncs(L,lua_audio_buffer_methods,0);
+    lua_setfield(L,-2,"methods");
     lua_pop(L,1);
 
     lua_newtable(L); /* audio */
+    idx = lua_gettop(L);
+
     lua_pushinteger(L,a->samplerate);
     lua_setfield(L,-2,"samplerate");
 
@@ -50,23 +973,55 @@ int luaopen_audio(lua_State *L,audio_processor *a) {
     lua_pushinteger(L,a->samplesize);
     lua_setfield(L,-2,"samplesize");
 
-    lua_pushinteger(L,a->spectrum_len);
-    lua_setfield(L,-2,"spectrum_len");
+    lua_pushliteral(L,AUDIO_FLOAT_TYPE);
+    lua_setfield(L,-2,"float_type");
 
-    lua_newtable(L); /* audio.freqs */
-    for(i=0;i<a->spectrum_len;i++) {
-        lua_pushinteger(L,i+1);
-        lua_pushnumber(L,a->spectrum_cur[i].freq);
-        lua_rawset(L,-3);
+    lua_newtable(L); /* audio.waveform */
+    lua_pushinteger(L,a->sample_window_len);
+    lua_setfield(L,-2,"len");
+    lua_audio_push_buffer(L,a->waveform,a->sample_window_len,NULL);
+    lua_setfield(L,-2,"mono");
+    for(i=0;i<a->channels;i++) {
+        lua_audio_push_buffer(L,a->waveform + (a->sample_window_len * (i + 1)),a->sample_window_len,NULL);
+        lua_rawseti(L,-2,i+1);
     }
-    lua_setfield(L,-2,"freqs");
+    lua_setfield(L,-2,"waveform");
+
+    lua_newtable(L); /* audio.vectorscope */
+    lua_pushinteger(L,a->stereo.points_len);
+    lua_setfield(L,-2,"len");
+    lua_audio_push_buffer(L,a->stereo.points,a->stereo.points_len,NULL);
+    lua_setfield(L,-2,"x");
+    lua_audio_push_buffer(L,a->stereo.points + a->stereo.points_len,a->stereo.points_len,NULL);
+    lua_setfield(L,-2,"y");
+    lua_setfield(L,-2,"vectorscope");
 
-    lua_newtable(L); /* audio.amps */
     lua_pushlightuserdata(L,a);
-    lua_setfield(L,-2,"data");
-    luaL_getmetatable(L,"amp");
+    lua_pushcclosure(L,lua_audio_plot_vectorscope,1);
+    lua_setfield(L,-2,"plot_vectorscope");
+
+    lua_audio_set_spectrum(L,idx,a);
+    lua_audio_set_bands(L,idx,a);
+    lua_audio_set_rhythm(L,idx,a);
+    lua_audio_set_meter(L,idx,a);
+    lua_audio_set_chroma(L,idx,a);
+
+    lua_pushlightuserdata(L,a);
+    lua_pushcclosure(L,lua_audio_arrays,1);
+    lua_setfield(L,-2,"arrays");
+
+    *((audio_processor **)lua_newuserdata(L,sizeof(audio_processor *))) = a;
+    luaL_getmetatable(L,"audio_spectrogram");
     lua_setmetatable(L,-2);
-    lua_setfield(L,-2,"amps");
+    lua_setfield(L,-2,"spectrogram");
+
+    lua_pushlightuserdata(L,a);
+    lua_pushcclosure(L,lua_audio_set_spectrogram,1);
+    lua_setfield(L,-2,"set_spectrogram");
+
+    lua_pushlightuserdata(L,a);
+    lua_pushcclosure(L,lua_audio_configure,1);
+    lua_setfield(L,-2,"configure");
 
     return 1;
 }
@@ -75,4 +1030,3 @@ int luaopen_audio(lua_State *L,audio_processor *a) {
 }
 #endif
 
-
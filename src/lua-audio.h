@@ -9,6 +9,8 @@ extern "C" {
 
 int luaopen_audio(lua_State *L,audio_processor *a);
 
+void luaaudio_update(lua_State *L, audio_processor *a);
+
 #ifdef __cplusplus
 }
 #endif
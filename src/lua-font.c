@@ -0,0 +1,285 @@
+#include "font.h"
+#include "lua-font.h"
+#include "font.lua.lh"
+
+#include <string.h>
+#include <lauxlib.h>
+#include <skalibs/skalibs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if !defined(luaL_newlibtable) \
+  && (!defined LUA_VERSION_NUM || LUA_VERSION_NUM==501)
+static void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
+  luaL_checkstack(L, nup+1, "too many upvalues");
+  for (; l->name != NULL; l++) {  /* fill the table with given functions */
+    int i;
+    lua_pushlstring(L, l->name,strlen(l->name));
+    for (i = 0; i < nup; i++)  /* copy upvalues to the top */
+      lua_pushvalue(L, -(nup+1));
+    lua_pushcclosure(L, l->func, nup);  /* closure with those upvalues */
+    lua_settable(L, -(nup + 3));
+  }
+  lua_pop(L, nup);  /* remove upvalues */
+}
+#endif
+
+font *
+luafont_check_font(lua_State *L, int idx) {
+    lua_font *f = (lua_font *)luaL_checkudata(L,idx,"font");
+    if(f->font == NULL) {
+        luaL_error(L,"font has been freed");
+    }
+    return f->font;
+}
+
+/* pushes a glyph's rows as numbers, top row first, the leftmost pixel
+ * is the highest bit of a (width + 7) / 8 byte number */
+static void
+lua_font_push_bitmap(lua_State *L, const font *f, const font_glyph *g) {
+    unsigned int pitch = (g->width + 7) / 8;
+    unsigned int y = 0;
+    unsigned int i = 0;
+    lua_Number row = 0;
+
+    lua_createtable(L,f->height,0);
+    for(y=0;y<f->height;y++) {
+        row = 0;
+        for(i=0;i<pitch;i++) {
+            row = (row * 256) + f->bits[g->offset + (y * pitch) + i];
+        }
+        lua_pushnumber(L,row);
+        lua_rawseti(L,-2,y+1);
+    }
+}
+
+static int
+lua_font_load(lua_State *L) {
+    const char *filename = luaL_checkstring(L,1);
+    lua_font *f = (lua_font *)lua_newuserdata(L,sizeof(lua_font));
+
+    f->widths_ref = LUA_NOREF;
+    f->bitmaps_ref = LUA_NOREF;
+    f->font = font_load(filename);
+    if(f->font == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"unable to load font");
+        return 2;
+    }
+
+    luaL_getmetatable(L,"font");
+    lua_setmetatable(L,-2);
+    return 1;
+}
+
+static int
+lua_font_gc(lua_State *L) {
+    lua_font *f = (lua_font *)lua_touserdata(L,1);
+    luaL_unref(L,LUA_REGISTRYINDEX,f->widths_ref);
+    luaL_unref(L,LUA_REGISTRYINDEX,f->bitmaps_ref);
+    f->widths_ref = LUA_NOREF;
+    f->bitmaps_ref = LUA_NOREF;
+    font_free(f->font);
+    f->font = NULL;
+    return 0;
+}
+
+/* font.widths and font.bitmaps are plain tables built on first use,
+ * so existing scripts can index and iterate them */
+static int
+lua_font_table(lua_State *L, lua_font *f, int *ref, int bitmaps) {
+    unsigned int i = 0;
+
+    if(*ref != LUA_NOREF) {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,*ref);
+        return 1;
+    }
+
+    lua_createtable(L,0,f->font->count);
+    for(i=0;i<f->font->count;i++) {
+        if(bitmaps) {
+            lua_font_push_bitmap(L,f->font,&f->font->glyphs[i]);
+        } else {
+            lua_pushinteger(L,f->font->glyphs[i].width);
+        }
+        lua_rawseti(L,-2,f->font->glyphs[i].codepoint);
+    }
+    lua_pushvalue(L,-1);
+    *ref = luaL_ref(L,LUA_REGISTRYINDEX);
+    return 1;
+}
+
+static int
+lua_font_index(lua_State *L) {
+    lua_font *f = (lua_font *)lua_touserdata(L,1);
+    const char *key = NULL;
+
+    luaL_getmetatable(L,"font");
+    lua_getfield(L,-1,"methods");
+    lua_pushvalue(L,2);
+    lua_rawget(L,-2);
+    if(!lua_isnil(L,-1)) {
+        return 1;
+    }
+    lua_pop(L,3);
+
+    if(lua_type(L,2) != LUA_TSTRING || f->font == NULL) {
+        return 0;
+    }
+
+    key = lua_tostring(L,2);
+    if(strcmp(key,"width") == 0) {
+        lua_pushinteger(L,f->font->width);
+        return 1;
+    }
+    if(strcmp(key,"height") == 0) {
+        lua_pushinteger(L,f->font->height);
+        return 1;
+    }
+    if(strcmp(key,"bbx") == 0) {
+        lua_pushinteger(L,f->font->bbx);
+        return 1;
+    }
+    if(strcmp(key,"bby") == 0) {
+        lua_pushinteger(L,f->font->bby);
+        return 1;
+    }
+    if(strcmp(key,"count") == 0) {
+        lua_pushinteger(L,f->font->count);
+        return 1;
+    }
+    if(strcmp(key,"widths") == 0) {
+        return lua_font_table(L,f,&f->widths_ref,0);
+    }
+    if(strcmp(key,"bitmaps") == 0) {
+        return lua_font_table(L,f,&f->bitmaps_ref,1);
+    }
+    return 0;
+}
+
+static int
+lua_font_pixel_at(lua_State *L, lua_Integer y) {
+    font *f = luafont_check_font(L,1);
+    const font_glyph *g = font_glyph_find(f,(uint32_t)luaL_checkinteger(L,2));
+    lua_Integer x = luaL_checkinteger(L,3);
+
+    if(g == NULL) {
+        return 0;
+    }
+
+    lua_pushboolean(L,x >= 1 && y >= 1 && font_glyph_pixel(f,g,(unsigned int)(x - 1),(unsigned int)(y - 1)));
+    return 1;
+}
+
+static int
+lua_font_pixel(lua_State *L) {
+    return lua_font_pixel_at(L,luaL_checkinteger(L,4));
+}
+
+static int
+lua_font_pixeli(lua_State *L) {
+    font *f = luafont_check_font(L,1);
+    return lua_font_pixel_at(L,(lua_Integer)f->height - (luaL_checkinteger(L,4) - 1));
+}
+
+static int
+lua_font_bitmap(lua_State *L) {
+    font *f = luafont_check_font(L,1);
+    const font_glyph *g = NULL;
+    const char *str = NULL;
+    const char *end = NULL;
+    size_t len = 0;
+    int i = 1;
+
+    if(lua_type(L,2) == LUA_TNUMBER) {
+        g = font_glyph_find(f,(uint32_t)lua_tointeger(L,2));
+        if(g == NULL) return 0;
+        lua_font_push_bitmap(L,f,g);
+        return 1;
+    }
+
+    if(lua_type(L,2) == LUA_TSTRING) {
+        str = lua_tolstring(L,2,&len);
+        end = str + len;
+        lua_newtable(L);
+        while(str < end) {
+            g = font_glyph_find(f,font_utf8_next(&str,end));
+            if(g == NULL) {
+                lua_pushinteger(L,0);
+            } else {
+                lua_font_push_bitmap(L,f,g);
+            }
+            lua_rawseti(L,-2,i++);
+        }
+        return 1;
+    }
+
+    lua_pushnil(L);
+    lua_pushliteral(L,"bitmap should be called with a codepoint or string");
+    return 2;
+}
+
+static int
+lua_font_get_string_width(lua_State *L) {
+    font *f = luafont_check_font(L,1);
+    size_t len = 0;
+    const char *str = luaL_checklstring(L,2,&len);
+    const char *end = str + len;
+    lua_Number scale = luaL_optnumber(L,3,1);
+    const font_glyph *g = NULL;
+    unsigned long w = 0;
+
+    while(str < end) {
+        g = font_glyph_find(f,font_utf8_next(&str,end));
+        w += g == NULL ? f->width : g->width;
+    }
+
+    lua_pushnumber(L,(lua_Number)w * scale);
+    return 1;
+}
+
+static const struct luaL_Reg lua_font_methods[] = {
+    { "pixel"            , lua_font_pixel            },
+    { "pixeli"           , lua_font_pixeli           },
+    { "bitmap"           , lua_font_bitmap           },
+    { "get_string_width" , lua_font_get_string_width },
+    { NULL               , NULL                      },
+};
+
+static const struct luaL_Reg lua_font_functions[] = {
+    { "load" , lua_font_load },
+    { NULL   , NULL          },
+};
+
+int luaopen_font(lua_State *L) {
+    luaL_newmetatable(L,"font");
+    lua_pushcfunction(L,lua_font_index);
+    lua_setfield(L,-2,"__index");
+    lua_pushcfunction(L,lua_font_gc);
+    lua_setfield(L,-2,"__gc");
+    lua_newtable(L);
+    luaL_setfuncs(L,lua_font_methods,0);
+    lua_setfield(L,-2,"methods");
+    lua_pop(L,1);
+
+    if(luaL_loadbuffer(L,font_lua,font_lua_length-1,"font.lua")) {
+        strerr_die2x(1,"error: ",lua_tostring(L,-1));
+    }
+
+    lua_newtable(L);
+    luaL_setfuncs(L,lua_font_functions,0);
+
+    if(lua_pcall(L,1,1,0)) {
+        strerr_die2x(1,"error: ",lua_tostring(L,-1));
+    }
+
+    lua_setglobal(L,"font");
+
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,30 @@
+#ifndef LUA_FONT_H
+#define LUA_FONT_H
+
+#include <lua.h>
+#include "font.h"
+
+/* a loaded font, full userdata with the "font" metatable */
+typedef struct lua_font {
+    font *font;
+    int widths_ref;
+    int bitmaps_ref;
+} lua_font;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* registers the "font" metatable and the global font module */
+int
+luaopen_font(lua_State *L);
+
+/* returns the font at idx, raises an error if it isn't one */
+font *
+luafont_check_font(lua_State *L, int idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,11 +1,14 @@
 #include "image.h"
 #include "lua-image.h"
+#include "lua-font.h"
 #include "image.lua.lh"
 #include "thread.h"
 #include "visualizer.h"
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <lauxlib.h>
 #include <skalibs/skalibs.h>
 #include <pthread.h>
@@ -32,6 +35,10 @@ static void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 }
 #endif
 
+#if defined LUA_VERSION_NUM && LUA_VERSION_NUM >= 502
+#define lua_objlen(L,i) lua_rawlen(L,(i))
+#endif
+
 static thread_ptr_t thread;
 static thread_signal_t t_signal;
 
@@ -49,39 +56,208 @@ wake_queue(void) {
     }
 }
 
+/* frames keep their length in an unsigned int, so width * height * channels
+ * (plus the frame header) has to fit in one */
 static int
-lua_image_from_memory(lua_State *L, unsigned int width, unsigned int height, unsigned int channels, uint8_t *image) {
-    uint8_t *l_image;
-    int idx;
+lua_image_frame_fits(uint64_t width, uint64_t height, uint64_t channels) {
+    uint64_t pixels = width * height;
+    if(width > UINT_MAX || height > UINT_MAX || channels > UINT_MAX) return 0;
+    if(pixels > UINT_MAX) return 0;
+    return pixels * channels <= UINT_MAX - sizeof(image_frame);
+}
 
-    lua_newtable(L);
-    idx = lua_gettop(L);
+image_frame *
+luaimage_new_frame(lua_State *L, unsigned int width, unsigned int height, unsigned int channels, const uint8_t *image) {
+    image_frame *f = NULL;
+    unsigned int len = 0;
 
-    lua_pushinteger(L,width);
-    lua_setfield(L,idx,"width");
+    if(!lua_image_frame_fits(width,height,channels)) {
+        luaL_error(L,"image is too large");
+        return NULL;
+    }
+    len = width * height * channels;
+
+    f = lua_newuserdata(L,sizeof(image_frame) + len);
+    f->image = (uint8_t *)(f + 1);
+    f->width = width;
+    f->height = height;
+    f->channels = channels;
+    f->stride = width * channels;
+    f->image_len = len;
+    f->owned = 1;
+
+    if(image != NULL) {
+        memcpy(f->image,image,len);
+    }
+    else {
+        memset(f->image,0,len);
+    }
 
-    lua_pushinteger(L,height);
-    lua_setfield(L,idx,"height");
+    luaL_getmetatable(L,"image");
+    lua_setmetatable(L,-2);
+    return f;
+}
 
-    lua_pushinteger(L,channels);
-    lua_setfield(L,idx,"channels");
+image_frame *
+luaimage_wrap_frame(lua_State *L, uint8_t *image, unsigned int width, unsigned int height, unsigned int channels) {
+    image_frame *f = NULL;
+
+    f = lua_newuserdata(L,sizeof(image_frame));
+    f->image = image;
+    f->width = width;
+    f->height = height;
+    f->channels = channels;
+    f->stride = width * channels;
+    f->image_len = width * height * channels;
+    f->owned = 0;
+
+    luaL_getmetatable(L,"image");
+    lua_setmetatable(L,-2);
+    return f;
+}
+
+int
+luaimage_get_frame(lua_State *L, int idx, image_frame *f) {
+    int ok = 0;
+
+    if(lua_type(L,idx) == LUA_TUSERDATA) {
+        if(lua_getmetatable(L,idx)) {
+            luaL_getmetatable(L,"image");
+            ok = lua_rawequal(L,-1,-2);
+            lua_pop(L,2);
+        }
+        if(!ok) return 0;
+        *f = *(image_frame *)lua_touserdata(L,idx);
+        return 1;
+    }
+
+    if(!lua_istable(L,idx)) {
+        return 0;
+    }
+
+    /* a table with the same fields, as frames used to be */
+    lua_getfield(L,idx,"image");
+    f->image = lua_touserdata(L,-1);
+
+    lua_getfield(L,idx,"width");
+    f->width = lua_tointeger(L,-1);
 
-    lua_pushinteger(L,width * height * channels);
-    lua_setfield(L,idx,"image_len");
+    lua_getfield(L,idx,"height");
+    f->height = lua_tointeger(L,-1);
 
-    lua_pushinteger(L,IMAGE_FIXED);
-    lua_setfield(L,idx,"image_state");
+    lua_getfield(L,idx,"channels");
+    f->channels = lua_tointeger(L,-1);
+
+    lua_pop(L,4);
+
+    f->stride = f->width * f->channels;
+    f->image_len = f->stride * f->height;
+    f->owned = 0;
+    return 1;
+}
 
-    lua_pushliteral(L,"fixed");
-    lua_setfield(L,idx,"state");
+/* frame fields other than the geometry live in a weak table keyed by frame */
+static void
+lua_image_frame_fields(lua_State *L, int idx, int create) {
+    lua_getfield(L,LUA_REGISTRYINDEX,"image_fields");
+    lua_pushvalue(L,idx);
+    lua_rawget(L,-2);
+    if(lua_isnil(L,-1) && create) {
+        lua_pop(L,1);
+        lua_newtable(L);
+        lua_pushvalue(L,idx);
+        lua_pushvalue(L,-2);
+        lua_rawset(L,-4);
+    }
+    lua_remove(L,-2);
+}
 
-    l_image = lua_newuserdata(L,width*height*channels);
-    lua_setfield(L,idx,"image");
-    memcpy(l_image,image,width*height*channels);
+static int
+lua_image_frame_index(lua_State *L) {
+    image_frame *f = lua_touserdata(L,1);
+    const char *key = NULL;
 
     luaL_getmetatable(L,"image");
-    lua_setmetatable(L,idx);
-    lua_settop(L,idx);
+    lua_getfield(L,-1,"methods");
+    lua_pushvalue(L,2);
+    lua_rawget(L,-2);
+    if(!lua_isnil(L,-1)) {
+        return 1;
+    }
+    lua_pop(L,3);
+
+    if(lua_type(L,2) == LUA_TSTRING) {
+        key = lua_tostring(L,2);
+        if(strcmp(key,"width") == 0) {
+            lua_pushinteger(L,f->width);
+            return 1;
+        }
+        if(strcmp(key,"height") == 0) {
+            lua_pushinteger(L,f->height);
+            return 1;
+        }
+        if(strcmp(key,"channels") == 0) {
+            lua_pushinteger(L,f->channels);
+            return 1;
+        }
+        if(strcmp(key,"stride") == 0) {
+            lua_pushinteger(L,f->stride);
+            return 1;
+        }
+        if(strcmp(key,"image_len") == 0) {
+            lua_pushinteger(L,f->image_len);
+            return 1;
+        }
+        if(strcmp(key,"image") == 0) {
+            lua_pushlightuserdata(L,f->image);
+            return 1;
+        }
+        if(strcmp(key,"image_state") == 0) {
+            lua_pushinteger(L,IMAGE_FIXED);
+            return 1;
+        }
+        if(strcmp(key,"state") == 0) {
+            lua_pushliteral(L,"fixed");
+            return 1;
+        }
+    }
+
+    lua_image_frame_fields(L,1,0);
+    if(lua_isnil(L,-1)) {
+        return 1;
+    }
+    lua_pushvalue(L,2);
+    lua_rawget(L,-2);
+    return 1;
+}
+
+static int
+lua_image_frame_newindex(lua_State *L) {
+    static const char * const fixed[] = {
+        "width", "height", "channels", "stride", "image_len", "image", "image_state", "state", NULL,
+    };
+    const char *key = NULL;
+    unsigned int i = 0;
+
+    if(lua_type(L,2) == LUA_TSTRING) {
+        key = lua_tostring(L,2);
+        for(i=0;fixed[i] != NULL;i++) {
+            if(strcmp(key,fixed[i]) == 0) {
+                return luaL_error(L,"frame field %s is read-only",key);
+            }
+        }
+    }
+
+    lua_image_frame_fields(L,1,1);
+    lua_pushvalue(L,2);
+    lua_pushvalue(L,3);
+    lua_rawset(L,-3);
+    return 0;
+}
+
+static int
+lua_image_from_memory(lua_State *L, unsigned int width, unsigned int height, unsigned int channels, uint8_t *image) {
+    luaimage_new_frame(L,width,height,channels,image);
     return 1;
 }
 
@@ -222,22 +398,31 @@ static int
 lua_image_new(lua_State *L) {
     const char *filename = NULL;
     int table_ind = 0;
-    int image_ind = 0;
     int frame_ind = 0;
 
     if(lua_isstring(L,1)) {
       filename = lua_tostring(L,1);
     }
-    unsigned int width    = (unsigned int)luaL_optinteger(L,2,0);
-    unsigned int height   = (unsigned int)luaL_optinteger(L,3,0);
-    unsigned int channels = (unsigned int)luaL_optinteger(L,4,0);
+    lua_Integer w = luaL_optinteger(L,2,0);
+    lua_Integer h = luaL_optinteger(L,3,0);
+    lua_Integer c = luaL_optinteger(L,4,0);
 
-    if(filename == NULL && (width == 0 || height == 0 || channels == 0) ) {
+    if(filename == NULL && (w < 1 || h < 1 || c < 1 || c > 4)) {
         lua_pushnil(L);
         lua_pushliteral(L,"Need either filename, or width/height/channels");
         return 2;
     }
 
+    if(filename == NULL && !lua_image_frame_fits(w,h,c)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Image is too large");
+        return 2;
+    }
+
+    unsigned int width    = (unsigned int)w;
+    unsigned int height   = (unsigned int)h;
+    unsigned int channels = (unsigned int)c;
+
     if(filename != NULL) {
         if(image_probe(filename,&width,&height,&channels) == 0) {
             lua_pushnil(L);
@@ -272,33 +457,13 @@ lua_image_new(lua_State *L) {
         lua_newtable(L); /* image.frames */
         frame_ind = lua_gettop(L);
 
-        lua_newtable(L);
-        image_ind = lua_gettop(L); /* image.frames[1] */
-
         lua_pushinteger(L,IMAGE_FIXED);
         lua_setfield(L,table_ind,"image_state");
 
         lua_pushliteral(L,"fixed");
         lua_setfield(L,table_ind,"state");
 
-        uint8_t *image = lua_newuserdata(L,(sizeof(uint8_t) * width * height * channels));
-        lua_setfield(L,image_ind,"image");
-        memset(image,0,sizeof(uint8_t) * width * height * channels);
-
-        lua_pushinteger(L,width);
-        lua_setfield(L,image_ind,"width");
-
-        lua_pushinteger(L,height);
-        lua_setfield(L,image_ind,"height");
-
-        lua_pushinteger(L,channels);
-        lua_setfield(L,image_ind,"channels");
-
-        lua_pushinteger(L,width * height * channels);
-        lua_setfield(L,image_ind,"image_len");
-
-        luaL_getmetatable(L,"image");
-        lua_setmetatable(L,image_ind);
+        luaimage_new_frame(L,width,height,channels,NULL); /* image.frames[1] */
 
         lua_rawseti(L,frame_ind,1);
         lua_setfield(L,table_ind,"frames");
@@ -312,6 +477,28 @@ lua_image_new(lua_State *L) {
     return 1;
 }
 
+static int
+lua_image_new_frame(lua_State *L) {
+    lua_Integer width = luaL_checkinteger(L,1);
+    lua_Integer height = luaL_checkinteger(L,2);
+    lua_Integer channels = luaL_checkinteger(L,3);
+
+    if(width < 1 || height < 1 || channels < 1 || channels > 4) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Need width/height/channels");
+        return 2;
+    }
+
+    if(!lua_image_frame_fits(width,height,channels)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Image is too large");
+        return 2;
+    }
+
+    luaimage_new_frame(L,width,height,channels,NULL);
+    return 1;
+}
+
 static int
 lua_image_unload(lua_State *L) {
     int state = 0;
@@ -506,12 +693,13 @@ lua_image_load(lua_State *L) {
 
 static int
 lua_image_get_pixel(lua_State *L) {
+    image_frame f;
     uint8_t *image = NULL;
     unsigned int index = 0;
     unsigned int width = 0;
     unsigned int height = 0;
     unsigned int channels = 0;
-    if(!lua_istable(L,1)) {
+    if(!luaimage_get_frame(L,1,&f)) {
         lua_pushnil(L);
         lua_pushliteral(L,"Missing argument self");
         return 2;
@@ -520,17 +708,10 @@ lua_image_get_pixel(lua_State *L) {
     lua_Integer x = luaL_checkinteger(L,2);
     lua_Integer y = luaL_checkinteger(L,3);
 
-    lua_getfield(L,1,"image");
-    image = lua_touserdata(L,-1);
-
-    lua_getfield(L,1,"width");
-    width = luaL_checkinteger(L,-1);
-
-    lua_getfield(L,1,"height");
-    height = luaL_checkinteger(L,-1);
-
-    lua_getfield(L,1,"channels");
-    channels = luaL_checkinteger(L,-1);
+    image = f.image;
+    width = f.width;
+    height = f.height;
+    channels = f.channels;
 
     if(x < 1 || y < 1 || x > width || y > height) {
         lua_pushboolean(L,0);
@@ -559,24 +740,13 @@ lua_image_get_pixel(lua_State *L) {
 
 static int
 lua_image_draw_rectangle(lua_State *L) {
+    image_frame f;
     uint8_t *image = NULL;
     unsigned int width = 0;
     unsigned int height = 0;
     unsigned int channels = 0;
 
-    unsigned int xstart = 0;
-    unsigned int xend = 0;
-    unsigned int ystart = 0;
-    unsigned int yend = 0;
-    unsigned int ytmp = 0;
-    unsigned int byte = 0;
-
-    unsigned int x;
-    unsigned int y;
-    unsigned int alpha;
-    unsigned int alpha_inv;
-
-    if(!lua_istable(L,1)) {
+    if(!luaimage_get_frame(L,1,&f)) {
         lua_pushnil(L);
         lua_pushliteral(L,"Missing argument self");
         return 2;
@@ -596,19 +766,10 @@ lua_image_draw_rectangle(lua_State *L) {
         return 1;
     }
 
-    lua_getfield(L,1,"image");
-    image = lua_touserdata(L,-1);
-
-    lua_getfield(L,1,"width");
-    width = lua_tointeger(L,-1);
-
-    lua_getfield(L,1,"height");
-    height = lua_tointeger(L,-1);
-
-    lua_getfield(L,1,"channels");
-    channels = lua_tointeger(L,-1);
-
-    lua_pop(L,4);
+    image = f.image;
+    width = f.width;
+    height = f.height;
+    channels = f.channels;
 
     if(r > 255 || b > 255 || g > 255 || a > 255 ||
        r < 0   || b < 0   || g < 0 || a < 0 ) {
@@ -616,97 +777,308 @@ lua_image_draw_rectangle(lua_State *L) {
         return 1;
     }
 
-    if(x1 <= x2) {
-        xstart = x1;
-        xend = x2;
+    if(image == NULL) {
+        lua_pushboolean(L,0);
+        return 1;
     }
-    else {
-        xstart = x2;
-        xend = x1;
+
+    lua_pushboolean(L,image_fill(image,width,height,channels,x1,y1,x2,y2,r,g,b,a));
+    return 1;
+}
+
+/* reads an {r,g,b,[a]} table into c, as r,g,b,a */
+static int
+lua_image_color(lua_State *L, int idx, uint8_t *c) {
+    lua_Integer v = 0;
+    int i = 0;
+
+    if(!lua_istable(L,idx)) return 0;
+
+    for(i=0;i<4;i++) {
+        lua_rawgeti(L,idx,i+1);
+        v = luaL_optinteger(L,-1,255);
+        lua_pop(L,1);
+        if(v < 0 || v > 255) return 0;
+        c[i] = v;
     }
+    return 1;
+}
+
+static int
+lua_image_draw_linear_gradient(lua_State *L) {
+    image_frame f;
+    uint8_t *image = NULL;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int channels = 0;
+    uint8_t from[4];
+    uint8_t to[4];
+    const char *direction = NULL;
 
-    if(y1 <= y2) {
-        ystart = y1;
-        yend = y2;
+    if(!luaimage_get_frame(L,1,&f)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Missing argument self");
+        return 2;
     }
-    else {
-        ystart = y2;
-        yend = y1;
+
+    lua_Integer x1 = luaL_checkinteger(L,2);
+    lua_Integer y1 = luaL_checkinteger(L,3);
+    lua_Integer x2 = luaL_checkinteger(L,4);
+    lua_Integer y2 = luaL_checkinteger(L,5);
+
+    if(!lua_image_color(L,6,from) || !lua_image_color(L,7,to)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Colors must be {r,g,b,[a]} tables with values 0 - 255");
+        return 2;
     }
 
-    if(xend < 1) {
-        lua_pushboolean(L,0);
-        return 1;
+    direction = luaL_optstring(L,8,"horizontal");
+    if(strcmp(direction,"horizontal") != 0 && strcmp(direction,"vertical") != 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Unknown gradient direction");
+        return 2;
     }
-    if(yend < 1) {
+
+    image = f.image;
+    width = f.width;
+    height = f.height;
+    channels = f.channels;
+
+    if(image == NULL) {
         lua_pushboolean(L,0);
         return 1;
     }
 
-    if(xstart > width) {
+    lua_pushboolean(L,image_gradient_linear(image,width,height,channels,
+      x1,y1,x2,y2,from,to,direction[0] == 'v'));
+    return 1;
+}
+
+static int
+lua_image_draw_radial_gradient(lua_State *L) {
+    image_frame f;
+    uint8_t *image = NULL;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int channels = 0;
+    uint8_t from[4];
+    uint8_t to[4];
+
+    if(!luaimage_get_frame(L,1,&f)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Missing argument self");
+        return 2;
+    }
+
+    lua_Integer x = luaL_checkinteger(L,2);
+    lua_Integer y = luaL_checkinteger(L,3);
+    lua_Integer radius = luaL_checkinteger(L,4);
+
+    /* image_gradient_radial takes int coordinates and an unsigned radius */
+    if(radius < 0 || radius > UINT_MAX ||
+       x < INT_MIN || x > INT_MAX || y < INT_MIN || y > INT_MAX) {
         lua_pushboolean(L,0);
         return 1;
     }
 
-    if(ystart > height) {
+    if(!lua_image_color(L,5,from) || !lua_image_color(L,6,to)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Colors must be {r,g,b,[a]} tables with values 0 - 255");
+        return 2;
+    }
+
+    image = f.image;
+    width = f.width;
+    height = f.height;
+    channels = f.channels;
+
+    if(image == NULL) {
         lua_pushboolean(L,0);
         return 1;
     }
 
-    if(xstart < 1) {
-        xstart = 1;
+    lua_pushboolean(L,image_gradient_radial(image,width,height,channels,
+      x,y,radius,from,to));
+    return 1;
+}
+
+/* reads r,g,b,[a] at idx. returns 0 if out of range, -1 if a is 0 and
+ * there is nothing to draw */
+static int
+lua_image_shape_color(lua_State *L, int idx, uint8_t *c) {
+    lua_Integer r = luaL_checkinteger(L,idx);
+    lua_Integer g = luaL_checkinteger(L,idx+1);
+    lua_Integer b = luaL_checkinteger(L,idx+2);
+    lua_Integer a = luaL_optinteger(L,idx+3,255);
+
+    if(r > 255 || b > 255 || g > 255 || a > 255 ||
+       r < 0   || b < 0   || g < 0 || a < 0 ) {
+        return 0;
     }
+    if(a == 0) return -1;
+
+    c[0] = r;
+    c[1] = g;
+    c[2] = b;
+    c[3] = a;
+    return 1;
+}
+
+/* reads {x1,y1,x2,y2,...} or {{x1,y1},{x2,y2},...} into x,y pairs. the
+ * buffer is a userdata left on the stack so an error doesn't leak it */
+static float *
+lua_image_points(lua_State *L, int idx, unsigned int *count) {
+    float *points = NULL;
+    size_t len = 0;
+    size_t i = 0;
+    int pairs = 0;
+
+    luaL_checktype(L,idx,LUA_TTABLE);
+    len = lua_objlen(L,idx);
+
+    lua_rawgeti(L,idx,1);
+    pairs = lua_istable(L,-1);
+    lua_pop(L,1);
 
-    if(ystart < 1) {
-        ystart = 1;
+    *count = pairs ? len : len / 2;
+    points = (float *)lua_newuserdata(L,(sizeof(float) * 2 * *count) + 1);
+
+    for(i=0;i<*count;i++) {
+        if(pairs) {
+            lua_rawgeti(L,idx,i+1);
+            luaL_checktype(L,-1,LUA_TTABLE);
+            lua_rawgeti(L,-1,1);
+            lua_rawgeti(L,-2,2);
+            points[i*2] = luaL_checknumber(L,-2);
+            points[(i*2)+1] = luaL_checknumber(L,-1);
+            lua_pop(L,3);
+        } else {
+            lua_rawgeti(L,idx,(i*2)+1);
+            lua_rawgeti(L,idx,(i*2)+2);
+            points[i*2] = luaL_checknumber(L,-2);
+            points[(i*2)+1] = luaL_checknumber(L,-1);
+            lua_pop(L,2);
+        }
     }
+    return points;
+}
+
+/* shared by the shape methods: checks self and the colour at idx, returns
+ * 1 to draw, or 0 with the method's results already pushed */
+static int
+lua_image_shape_args(lua_State *L, image_frame *f, int idx, uint8_t *c, int *ret) {
+    int ok = 0;
 
-    if(xend > width) {
-        xend = width;
+    if(!luaimage_get_frame(L,1,f)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Missing argument self");
+        *ret = 2;
+        return 0;
     }
 
-    if(yend > height) {
-        yend = height;
+    ok = lua_image_shape_color(L,idx,c);
+    if(ok != 1 || f->image == NULL) {
+        lua_pushboolean(L,ok == -1);
+        *ret = 1;
+        return 0;
     }
+    return 1;
+}
 
-    /* invert the ys */
-    ytmp = ystart;
-    ystart = yend;
-    yend = ytmp;
+static int
+lua_image_draw_line(lua_State *L) {
+    image_frame f;
+    uint8_t c[4];
+    int ret = 0;
 
-    xstart--;
-    xend--;
+    lua_Number x1 = luaL_checknumber(L,2);
+    lua_Number y1 = luaL_checknumber(L,3);
+    lua_Number x2 = luaL_checknumber(L,4);
+    lua_Number y2 = luaL_checknumber(L,5);
+    lua_Number thickness = luaL_optnumber(L,10,1);
 
-    ystart = height - ystart;
-    yend   = height - yend;
+    if(!lua_image_shape_args(L,&f,6,c,&ret)) return ret;
 
-    alpha = 1 + a;
-    alpha_inv = 256 - a;
+    lua_pushboolean(L,image_draw_line(f.image,f.width,f.height,f.channels,
+      x1,y1,x2,y2,thickness,c[0],c[1],c[2],c[3]));
+    return 1;
+}
 
-    lua_pushboolean(L,1);
+static int
+lua_image_draw_polyline(lua_State *L) {
+    image_frame f;
+    uint8_t c[4];
+    int ret = 0;
+    unsigned int count = 0;
+    float *points = NULL;
 
-    for(x=xstart;x<xend;x++) {
-        for(y=ystart;y<yend;y++) {
-            byte = (y * width * channels) + (x * channels);
-            assert(byte < (width * height * channels));
-            if(a == 255) {
-                image[byte] = b;
-                image[byte+1] = g;
-                image[byte+2] = r;
-            }
-            else {
-                image[byte] = ((image[byte] * alpha_inv) + (b * alpha)) >> 8;
-                image[byte+1] = ((image[byte+1] * alpha_inv) + (g * alpha)) >> 8;
-                image[byte+2] = ((image[byte+2] * alpha_inv) + (r * alpha)) >> 8;
-            }
+    lua_Number thickness = luaL_optnumber(L,7,1);
+    int closed = lua_toboolean(L,8);
 
-        }
-    }
+    if(!lua_image_shape_args(L,&f,3,c,&ret)) return ret;
+    points = lua_image_points(L,2,&count);
+
+    lua_pushboolean(L,image_draw_polyline(f.image,f.width,f.height,f.channels,
+      points,count,thickness,closed,c[0],c[1],c[2],c[3]));
+    return 1;
+}
+
+static int
+lua_image_draw_polygon(lua_State *L) {
+    image_frame f;
+    uint8_t c[4];
+    int ret = 0;
+    unsigned int count = 0;
+    float *points = NULL;
+
+    if(!lua_image_shape_args(L,&f,3,c,&ret)) return ret;
+    points = lua_image_points(L,2,&count);
+
+    lua_pushboolean(L,image_fill_polygon(f.image,f.width,f.height,f.channels,
+      points,count,c[0],c[1],c[2],c[3]));
+    return 1;
+}
+
+static int
+lua_image_draw_circle(lua_State *L) {
+    image_frame f;
+    uint8_t c[4];
+    int ret = 0;
+
+    lua_Number x = luaL_checknumber(L,2);
+    lua_Number y = luaL_checknumber(L,3);
+    lua_Number radius = luaL_checknumber(L,4);
+    lua_Number thickness = luaL_optnumber(L,9,0);
 
+    if(!lua_image_shape_args(L,&f,5,c,&ret)) return ret;
+
+    lua_pushboolean(L,image_draw_circle(f.image,f.width,f.height,f.channels,
+      x,y,radius,thickness,c[0],c[1],c[2],c[3]));
+    return 1;
+}
+
+static int
+lua_image_draw_arc(lua_State *L) {
+    image_frame f;
+    uint8_t c[4];
+    int ret = 0;
+
+    lua_Number x = luaL_checknumber(L,2);
+    lua_Number y = luaL_checknumber(L,3);
+    lua_Number radius = luaL_checknumber(L,4);
+    lua_Number start = luaL_checknumber(L,5);
+    lua_Number finish = luaL_checknumber(L,6);
+    lua_Number thickness = luaL_optnumber(L,11,1);
+
+    if(!lua_image_shape_args(L,&f,7,c,&ret)) return ret;
+
+    lua_pushboolean(L,image_draw_arc(f.image,f.width,f.height,f.channels,
+      x,y,radius,start,finish,thickness,c[0],c[1],c[2],c[3]));
     return 1;
 }
 
 static int lua_image_set_pixel(lua_State *L) {
+    image_frame f;
     uint8_t *image = NULL;
 
     unsigned int index = 0;
@@ -716,7 +1088,7 @@ static int lua_image_set_pixel(lua_State *L) {
     unsigned int alpha = 0;
     unsigned int alpha_inv = 0;
 
-    if(!lua_istable(L,1)) {
+    if(!luaimage_get_frame(L,1,&f)) {
         lua_pushnil(L);
         lua_pushliteral(L,"Missing argument self");
         return 2;
@@ -734,19 +1106,10 @@ static int lua_image_set_pixel(lua_State *L) {
         return 1;
     }
 
-    lua_getfield(L,1,"image");
-    image = lua_touserdata(L,-1);
-
-    lua_getfield(L,1,"width");
-    width = luaL_checkinteger(L,-1);
-
-    lua_getfield(L,1,"height");
-    height = luaL_checkinteger(L,-1);
-
-    lua_getfield(L,1,"channels");
-    channels = luaL_checkinteger(L,-1);
-
-    lua_pop(L,4);
+    image = f.image;
+    width = f.width;
+    height = f.height;
+    channels = f.channels;
 
     if(x < 1 || y < 1 || x > width || y > height) {
         lua_pushboolean(L,0);
@@ -784,37 +1147,30 @@ static int lua_image_set_pixel(lua_State *L) {
 
 static int
 lua_image_set(lua_State *L) {
+    image_frame f;
+    image_frame fsrc;
     /* image:set(src) */
     uint8_t *image_one = NULL;
     uint8_t *image_two = NULL;
     lua_Integer image_one_len = 0;
     lua_Integer image_two_len = 0;
 
-    if(!lua_istable(L,1)) {
+    if(!luaimage_get_frame(L,1,&f)) {
         lua_pushnil(L);
         lua_pushliteral(L,"Missing argument self");
         return 2;
     }
 
-    if(!lua_istable(L,2)) {
+    if(!luaimage_get_frame(L,2,&fsrc)) {
         lua_pushnil(L);
         lua_pushliteral(L,"Missing argument src");
         return 2;
     }
 
-    lua_getfield(L,1,"image");
-    image_one = lua_touserdata(L,-1);
-
-    lua_getfield(L,1,"image_len");
-    image_one_len = lua_tointeger(L,-1);
-
-    lua_getfield(L,2,"image");
-    image_two = lua_touserdata(L,-1);
-
-    lua_getfield(L,2,"image_len");
-    image_two_len = lua_tointeger(L,-1);
-
-    lua_pop(L,4);
+    image_one = f.image;
+    image_one_len = f.image_len;
+    image_two = fsrc.image;
+    image_two_len = fsrc.image_len;
 
     if(image_one && image_two && (image_one_len == image_two_len)) {
         memcpy(image_one,image_two,image_one_len);
@@ -826,249 +1182,935 @@ lua_image_set(lua_State *L) {
 
 static int
 lua_image_blend(lua_State *L) {
-    /* image:blend(src,alpha) */
-    int i = 0;
+    image_frame f;
+    image_frame fsrc;
+    /* image:blend(src,alpha,[mode]) */
     uint8_t *image_one = NULL;
     uint8_t *image_two = NULL;
     lua_Integer a;
-    lua_Integer alpha;
-    lua_Integer alpha_inv;
+    unsigned int mode = IMAGE_BLEND_ALPHA;
     lua_Integer image_one_len = 0;
     lua_Integer image_two_len = 0;
-
-    if(!lua_istable(L,1)) {
-        lua_pushnil(L);
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int channels = 0;
+    unsigned int src_width = 0;
+    unsigned int src_height = 0;
+    unsigned int src_channels = 0;
+
+    if(!luaimage_get_frame(L,1,&f)) {
+        lua_pushnil(L);
         lua_pushliteral(L,"Missing argument self");
         return 2;
     }
 
-    if(!lua_istable(L,2)) {
+    if(!luaimage_get_frame(L,2,&fsrc)) {
         lua_pushnil(L);
         lua_pushliteral(L,"Missing argument src");
         return 2;
     }
 
     a = luaL_checkinteger(L,3);
-    if(a == 0) {
+    if(a <= 0) {
         return 0;
     }
+    if(a > 255) {
+        a = 255;
+    }
 
-    alpha = 1 + a;
-    alpha_inv = 256 - a;
+    if(lua_isstring(L,4)) {
+        if(!image_blend_mode_scan(lua_tostring(L,4),&mode)) {
+            lua_pushnil(L);
+            lua_pushliteral(L,"Unknown blend mode");
+            return 2;
+        }
+    }
 
-    lua_getfield(L,1,"image");
-    image_one = lua_touserdata(L,-1);
-    lua_getfield(L,1,"image_len");
-    image_one_len = lua_tointeger(L,-1);
+    image_one = f.image;
+    image_one_len = f.image_len;
+    width = f.width;
+    height = f.height;
+    channels = f.channels;
 
-    lua_getfield(L,2,"image");
-    image_two = lua_touserdata(L,-1);
-    lua_getfield(L,2,"image_len");
-    image_two_len = lua_tointeger(L,-1);
+    image_two = fsrc.image;
+    image_two_len = fsrc.image_len;
+    src_width = fsrc.width;
+    src_height = fsrc.height;
+    src_channels = fsrc.channels;
 
-    lua_pop(L,4);
+    if(!image_one || !image_two) {
+        return 0;
+    }
 
-    if(image_one && image_two && (image_one_len == image_two_len)) {
-        for(i=0;i<image_one_len;i+=8) {
-            image_one[i] =   ((image_one[i] * alpha_inv) + (image_two[i] * alpha)) >> 8;
-            image_one[i+1] = ((image_one[i+1] * alpha_inv) + (image_two[i+1] * alpha)) >> 8;
-            image_one[i+2] = ((image_one[i+2] * alpha_inv) + (image_two[i+2] * alpha)) >> 8;
-            image_one[i+3] = ((image_one[i+3] * alpha_inv) + (image_two[i+3] * alpha)) >> 8;
-            image_one[i+4] = ((image_one[i+4] * alpha_inv) + (image_two[i+4] * alpha)) >> 8;
-            image_one[i+5] = ((image_one[i+5] * alpha_inv) + (image_two[i+5] * alpha)) >> 8;
-            image_one[i+6] = ((image_one[i+6] * alpha_inv) + (image_two[i+6] * alpha)) >> 8;
-            image_one[i+7] = ((image_one[i+7] * alpha_inv) + (image_two[i+7] * alpha)) >> 8;
-        }
+    if(image_one_len == image_two_len) {
+        image_blend_mode(image_one,image_two,image_one_len,a,mode);
+        lua_pushboolean(L,1);
+        return 1;
+    }
+
+    /* an RGBA image over an RGB one of the same size uses its own alpha too */
+    if(mode == IMAGE_BLEND_ALPHA && channels == 3 && src_channels == 4 &&
+       width == src_width && height == src_height) {
+        image_blend_rgba(image_one,image_two,width * height,a);
         lua_pushboolean(L,1);
         return 1;
     }
     return 0;
 }
 
+/* reads a stamp's source image at idx, and its flip, mask and alpha
+ * arguments after it, into c */
 static int
-lua_image_stamp_image(lua_State *L) {
-    uint8_t *image_one = NULL;
-    uint8_t *image_two = NULL;
+lua_image_stamp_args(lua_State *L, int idx, image_cmd *c) {
+    image_frame f;
+    lua_Integer aa = -1;
 
-    lua_Integer x;
-    lua_Integer y;
+    c->type = IMAGE_CMD_STAMP;
+    c->flags = 0;
+    c->mask_left = 0;
+    c->mask_right = 0;
+    c->mask_top = 0;
+    c->mask_bottom = 0;
+
+    c->x1 = luaL_optinteger(L,idx+1,1);
+    c->y1 = luaL_optinteger(L,idx+2,1);
+
+    if(lua_istable(L,idx+3)) {
+        lua_getfield(L,idx+3,"vflip");
+        if(lua_toboolean(L,-1)) c->flags |= IMAGE_STAMP_VFLIP;
+        lua_getfield(L,idx+3,"hflip");
+        if(lua_toboolean(L,-1)) c->flags |= IMAGE_STAMP_HFLIP;
+        lua_pop(L,2);
+    }
 
-    int hflip = 0;
-    int vflip = 0;
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-    uint8_t a;
-    lua_Integer aa = -1;
+    if(lua_istable(L,idx+4)) {
+        lua_getfield(L,idx+4,"left");
+        c->mask_left = luaL_optinteger(L,-1,0);
+        lua_getfield(L,idx+4,"right");
+        c->mask_right = luaL_optinteger(L,-1,0);
+        lua_getfield(L,idx+4,"top");
+        c->mask_top = luaL_optinteger(L,-1,0);
+        lua_getfield(L,idx+4,"bottom");
+        c->mask_bottom = luaL_optinteger(L,-1,0);
+        lua_pop(L,4);
+    }
 
-    int mask_left = 0;
-    int mask_right = 0;
-    int mask_top = 0;
-    int mask_bottom = 0;
-    unsigned int src_width = 0;
-    unsigned int src_height = 0;
-    unsigned int src_channels = 0;
+    if(lua_isnumber(L,idx+5)) {
+        aa = lua_tointeger(L,idx+5);
+        if(aa < 0) aa = -1;
+        if(aa > 255) aa = 255;
+    }
+    c->alpha = aa;
+
+    if(!luaimage_get_frame(L,idx,&f)) {
+        return 0;
+    }
+    c->src = f.image;
+    c->src_width = f.width;
+    c->src_height = f.height;
+    c->src_channels = f.channels;
+
+    return c->src != NULL;
+}
+
+static int
+lua_image_stamp_image(lua_State *L) {
+    image_frame f;
+    uint8_t *image = NULL;
     unsigned int width = 0;
     unsigned int height = 0;
     unsigned int channels = 0;
-    int xi = 1;
-    int yi = 1;
-    int xm;
-    int ym;
-    int yii;
-    int xii;
-    int xt;
-    int yt;
-    unsigned int dxt;
-    unsigned int dyt;
-    unsigned int byte;
-    int alpha;
-    int alpha_inv;
+    image_cmd c;
 
-    if(!lua_istable(L,1)) {
+    if(!luaimage_get_frame(L,1,&f)) {
         lua_pushnil(L);
         lua_pushliteral(L,"Missing argument self");
         return 2;
     }
 
-    if(!lua_istable(L,2)) {
+    if(!lua_istable(L,2) && !lua_isuserdata(L,2)) {
         lua_pushnil(L);
         lua_pushliteral(L,"Missing argument src");
         return 2;
     }
 
-    x = luaL_optinteger(L,3,1);
-    y = luaL_optinteger(L,4,1);
+    if(!lua_image_stamp_args(L,2,&c)) {
+        return 0;
+    }
+
+    image = f.image;
+    width = f.width;
+    height = f.height;
+    channels = f.channels;
 
-    if(lua_istable(L,5)) {
-        lua_getfield(L,5,"vflip");
-        vflip = lua_toboolean(L,-1);
-        lua_getfield(L,5,"hflip");
-        hflip = lua_toboolean(L,-1);
+    if(image == NULL) {
+        return 0;
     }
 
-    if(lua_istable(L,6)) {
-        lua_getfield(L,6,"left");
-        mask_left = luaL_optinteger(L,-1,0);
-        lua_getfield(L,6,"right");
-        mask_right = luaL_optinteger(L,-1,0);
-        lua_getfield(L,6,"top");
-        mask_top = luaL_optinteger(L,-1,0);
-        lua_getfield(L,6,"bottom");
-        mask_bottom = luaL_optinteger(L,-1,0);
+    image_stamp(
+      image, width, height, channels,
+      c.src, c.src_width, c.src_height, c.src_channels,
+      c.x1, c.y1, c.flags,
+      c.mask_left, c.mask_right, c.mask_top, c.mask_bottom,
+      c.alpha);
+
+    return 0;
+
+}
+
+/* a list of drawing commands, run with frame:draw_batch */
+typedef struct lua_image_batch {
+    image_cmd *cmds;
+    unsigned int len;
+    unsigned int size;
+    int sources; /* registry ref to a table keeping stamped images alive */
+} lua_image_batch;
+
+/* glyph positions queued on a batch are kept well inside an int, so
+ * image_draw can add the mask's size to them */
+#define LUA_IMAGE_BATCH_MAX (INT_MAX / 2)
+
+static image_cmd *
+lua_image_batch_push(lua_image_batch *b) {
+    image_cmd *t = NULL;
+    unsigned int size = 0;
+
+    if(b->len == b->size) {
+        size = b->size ? b->size * 2 : 64;
+        t = realloc(b->cmds,sizeof(image_cmd) * size);
+        if(t == NULL) return NULL;
+        b->cmds = t;
+        b->size = size;
     }
+    t = &b->cmds[b->len++];
+    memset(t,0,sizeof(image_cmd));
+    return t;
+}
 
-    if(lua_isnumber(L,7)) {
-        aa = lua_tointeger(L,7);
+/* mask commands hold a reference to their glyph mask, dropped when the
+ * batch is cleared */
+static void
+lua_image_batch_release(lua_image_batch *b) {
+    unsigned int i = 0;
+    for(i=0;i<b->len;i++) {
+        if(b->cmds[i].type == IMAGE_CMD_MASK) font_mask_unref(b->cmds[i].src);
     }
+}
 
-    lua_getfield(L,1,"width");
-    width = lua_tointeger(L,-1);
+/* text masks count in scaled pixels, anything partly masked is hidden */
+static int
+lua_image_text_mask(lua_Number v, unsigned int max) {
+    if(v <= 0) return 0;
+    if(v >= max) return max;
+    return (int)ceil(v);
+}
 
-    lua_getfield(L,1,"height");
-    height = lua_tointeger(L,-1);
+/* draws one glyph through the font's scaled mask cache and returns its
+ * advance, onto f or queued on batch (one of them is NULL). codepoints
+ * the font doesn't have are drawn as a space, scales past FONT_SCALE_MAX
+ * aren't drawn and advance 0 */
+static lua_Integer
+lua_image_stamp_glyph(lua_State *L, image_frame *f, lua_image_batch *batch,
+  font *fnt, uint32_t codepoint, lua_Integer scale,
+  lua_Integer x, lua_Integer y, lua_Integer r, lua_Integer g, lua_Integer b, uint8_t a,
+  lua_Number lmask, lua_Number rmask, lua_Number tmask, lua_Number bmask) {
+    const font_glyph *glyph = font_glyph_find(fnt,codepoint);
+    const font_mask *m = NULL;
+    image_cmd *c = NULL;
+    lua_Integer xmax = batch == NULL ? (lua_Integer)f->width : LUA_IMAGE_BATCH_MAX;
+    lua_Integer ymax = batch == NULL ? (lua_Integer)f->height : LUA_IMAGE_BATCH_MAX;
+
+    if(glyph == NULL) glyph = font_glyph_find(fnt,32);
+    if(glyph == NULL || scale < 1 || scale > FONT_SCALE_MAX) return 0;
+
+    if((batch != NULL || f->image != NULL) &&
+       r >= 0 && r <= 255 && g >= 0 && g <= 255 && b >= 0 && b <= 255 &&
+       x <= xmax && y <= ymax) {
+        m = font_glyph_mask(fnt,glyph,scale);
+        if(m != NULL &&
+           x > -(lua_Integer)m->width && y > -(lua_Integer)m->height) {
+            if(batch == NULL) {
+                image_stamp_mask(
+                  f->image, f->width, f->height, f->channels,
+                  m->mask, m->width, m->height,
+                  x, y,
+                  lua_image_text_mask(lmask,m->width),
+                  lua_image_text_mask(rmask,m->width),
+                  lua_image_text_mask(tmask,m->height),
+                  lua_image_text_mask(bmask,m->height),
+                  r, g, b, a);
+            }
+            else {
+                c = lua_image_batch_push(batch);
+                if(c == NULL) {
+                    luaL_error(L,"Out of memory");
+                }
+                c->type = IMAGE_CMD_MASK;
+                c->x1 = x;
+                c->y1 = y;
+                c->r = r;
+                c->g = g;
+                c->b = b;
+                c->a = a;
+                c->src = font_mask_ref(m);
+                c->src_width = m->width;
+                c->src_height = m->height;
+                c->mask_left = lua_image_text_mask(lmask,m->width);
+                c->mask_right = lua_image_text_mask(rmask,m->width);
+                c->mask_top = lua_image_text_mask(tmask,m->height);
+                c->mask_bottom = lua_image_text_mask(bmask,m->height);
+            }
+        }
+    }
 
-    lua_getfield(L,1,"channels");
-    channels = lua_tointeger(L,-1);
+    return glyph->width * scale;
+}
 
-    lua_getfield(L,1,"image");
-    image_one = lua_touserdata(L,-1);
+/* frame:stamp_letter and batch:stamp_letter, arguments from 2 */
+static int
+lua_image_letter(lua_State *L, image_frame *f, lua_image_batch *batch) {
+    /* (font,codepoint,scale,x,y,r,g,b,lmask,rmask,tmask,bmask) */
+    font *fnt = luafont_check_font(L,2);
+
+    lua_pushinteger(L,lua_image_stamp_glyph(L,f,batch,fnt,
+      (uint32_t)luaL_checkinteger(L,3),
+      luaL_checkinteger(L,4),
+      luaL_checkinteger(L,5),
+      luaL_checkinteger(L,6),
+      luaL_checkinteger(L,7),
+      luaL_checkinteger(L,8),
+      luaL_checkinteger(L,9),
+      255,
+      luaL_optnumber(L,10,0),
+      luaL_optnumber(L,11,0),
+      luaL_optnumber(L,12,0),
+      luaL_optnumber(L,13,0)));
+    return 1;
+}
 
-    lua_getfield(L,2,"width");
-    src_width = lua_tointeger(L,-1);
+static int
+lua_image_stamp_letter(lua_State *L) {
+    image_frame f;
 
-    lua_getfield(L,2,"height");
-    src_height = lua_tointeger(L,-1);
+    if(!luaimage_get_frame(L,1,&f)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Missing argument self");
+        return 2;
+    }
+    return lua_image_letter(L,&f,NULL);
+}
 
-    lua_getfield(L,2,"channels");
-    src_channels = lua_tointeger(L,-1);
+/* frame:stamp_string and batch:stamp_string, arguments from 2 */
+static int
+lua_image_string(lua_State *L, image_frame *f, lua_image_batch *batch) {
+    /* (font,str,scale,x,y,r,g,b,max,lmask,rmask,tmask,bmask) */
+    font *fnt = NULL;
+    const font_glyph *glyph = NULL;
+    const font_mask *m = NULL;
+    const char *str = NULL;
+    const char *end = NULL;
+    size_t len = 0;
+    uint32_t codepoint = 0;
+    lua_Integer scale = 0;
+    lua_Integer xi = 0;
+    lua_Integer y = 0;
+    lua_Integer r = 0;
+    lua_Integer g = 0;
+    lua_Integer b = 0;
+    lua_Integer cw = 0;
+    int has_max = 0;
+    int has_lmask = 0;
+    int lmask_applied = 0;
+    lua_Number max = 0;
+    lua_Number lmask = 0;
+    lua_Number rmask = 0;
+    lua_Number tmask = 0;
+    lua_Number bmask = 0;
+
+    fnt = luafont_check_font(L,2);
+    str = luaL_checklstring(L,3,&len);
+    end = str + len;
+    scale = luaL_checkinteger(L,4);
+    xi = luaL_checkinteger(L,5);
+    y = luaL_checkinteger(L,6);
+    r = luaL_checkinteger(L,7);
+    g = luaL_checkinteger(L,8);
+    b = luaL_checkinteger(L,9);
+    has_max = !lua_isnoneornil(L,10);
+    max = luaL_optnumber(L,10,0);
+    has_lmask = !lua_isnoneornil(L,11);
+    lmask = luaL_optnumber(L,11,0);
+    rmask = luaL_optnumber(L,12,0);
+    tmask = luaL_optnumber(L,13,0) * scale;
+    bmask = luaL_optnumber(L,14,0) * scale;
+    lmask_applied = !has_lmask;
+
+    if(scale < 1 || scale > FONT_SCALE_MAX) {
+        return 0;
+    }
 
-    lua_getfield(L,2,"image");
-    image_two = lua_touserdata(L,-1);
+    /* without a per-letter rmask the string is one cached strip, masking
+     * it on the left and at max stamps just the visible part of it. the
+     * strip can be evicted before a batch is drawn, so batches queue
+     * letters */
+    if(batch == NULL && rmask == 0 && (m = font_string_mask(fnt,str,len,scale)) != NULL) {
+        if(has_max && xi + (lua_Integer)m->width > max) {
+            rmask = m->width - (max - xi);
+        }
+        if(f->image != NULL &&
+           r >= 0 && r <= 255 && g >= 0 && g <= 255 && b >= 0 && b <= 255 &&
+           xi <= (lua_Integer)f->width && xi > -(lua_Integer)m->width &&
+           y <= (lua_Integer)f->height && y > -(lua_Integer)m->height) {
+            image_stamp_mask(
+              f->image, f->width, f->height, f->channels,
+              m->mask, m->width, m->height,
+              xi, y,
+              lua_image_text_mask(lmask,m->width),
+              lua_image_text_mask(rmask,m->width),
+              lua_image_text_mask(tmask,m->height),
+              lua_image_text_mask(bmask,m->height),
+              r, g, b, 255);
+        }
+        return 0;
+    }
 
-    lua_pop(L,8);
+    while(str < end) {
+        codepoint = font_utf8_next(&str,end);
+        glyph = font_glyph_find(fnt,codepoint);
+        if(glyph == NULL) glyph = font_glyph_find(fnt,32);
+        cw = glyph == NULL ? 0 : glyph->width * scale;
+
+        /* lmask skips whole letters first, then trims the first one drawn.
+         * past max every letter is masked out, as is anything past the
+         * right edge */
+        if(has_lmask && lmask >= cw) {
+            lmask -= cw;
+            xi += cw;
+            continue;
+        }
+        if(has_max && xi >= max) break;
+        if(xi > (batch == NULL ? (lua_Integer)f->width : LUA_IMAGE_BATCH_MAX)) break;
 
-    if(x < 1) {
-        xi = xi + (x * -1) + 1;
-    }
-    if(y < 1) {
-        yi = yi + (y * -1) + 1;
+        if(has_max && xi + cw > max) {
+            rmask = cw - (max - xi);
+        }
+        xi += lua_image_stamp_glyph(L,f,batch,fnt,codepoint,scale,xi,y,r,g,b,255,
+          lmask_applied ? 0 : lmask,
+          rmask,tmask,bmask);
+        if(!lmask_applied) {
+            lmask_applied = 1;
+            lmask = 0;
+        }
     }
 
-    xm = src_width;
-    ym = src_height;
+    return 0;
+}
 
-    xi += mask_left;
-    yi += mask_top;
-    xm -= mask_right;
-    ym -= mask_bottom;
+static int
+lua_image_stamp_string(lua_State *L) {
+    image_frame f;
 
-    for(yii=yi;yii <= ym; yii++) {
-        for(xii=xi;xii <= xm; xii++) {
-            xt = xii;
-            yt = yii;
+    if(!luaimage_get_frame(L,1,&f)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Missing argument self");
+        return 2;
+    }
+    return lua_image_string(L,&f,NULL);
+}
 
-            if(hflip) {
-                xt = src_width - xii + 1;
-            }
-            if(vflip) {
-                yt = src_height - yii + 1;
-            }
-            dxt = x - 1 + xii;
-            dyt = y - 1 + yii;
+/* truncates v to an integer in lo - hi, NaN becomes lo */
+static lua_Integer
+lua_image_fx_int(lua_Number v, lua_Integer lo, lua_Integer hi) {
+    if(!(v > lo)) return lo;
+    if(v >= hi) return hi;
+    return (lua_Integer)v;
+}
 
-            if(dxt > width || dyt > height) {
-                continue;
-            }
+/* same as hsl_to_rgb in image.lua, h wraps around */
+static void
+lua_image_hsl_to_rgb(lua_Number h, lua_Number s, lua_Number l, lua_Integer *r, lua_Integer *g, lua_Integer *b) {
+    lua_Number c = 0;
+    lua_Number hp = 0;
+    lua_Number x = 0;
+    lua_Number m = 0;
+    lua_Number r1 = 0;
+    lua_Number g1 = 0;
+    lua_Number b1 = 0;
+
+    if(l >= 100) {
+        *r = *g = *b = 255;
+        return;
+    }
+    if(l <= 0) {
+        *r = *g = *b = 0;
+        return;
+    }
+    if(s == 0) {
+        *r = *g = *b = (lua_Integer)ceil(255 * (l / 100));
+        return;
+    }
 
-            xt = xt - 1;
-            yt = src_height - yt;
+    h = fmod(h,360);
+    if(h < 0) h += 360;
+    l = l / 100;
+    s = s / 100;
+
+    c = (1 - fabs(2 * l - 1)) * s;
+    hp = h / 60;
+    x = c * (1 - fabs(fmod(hp,2) - 1));
+    m = l - (c / 2);
+
+    if(hp <= 1) { r1 = c; g1 = x; }
+    else if(hp <= 2) { r1 = x; g1 = c; }
+    else if(hp <= 3) { g1 = c; b1 = x; }
+    else if(hp <= 4) { g1 = x; b1 = c; }
+    else if(hp <= 5) { r1 = x; b1 = c; }
+    else { r1 = c; b1 = x; }
+
+    /* s past 100 gives colours out of range, they stay out of range */
+    *r = lua_image_fx_int(ceil((r1 + m) * 255),-1,256);
+    *g = lua_image_fx_int(ceil((g1 + m) * 255),-1,256);
+    *b = lua_image_fx_int(ceil((b1 + m) * 255),-1,256);
+}
 
-            dxt = dxt - 1;
-            dyt = height - dyt;
+enum TEXT_FX_SHAPE {
+    TEXT_FX_SINE,
+    TEXT_FX_TRIANGLE,
+    TEXT_FX_SQUARE,
+    TEXT_FX_SAW,
+    TEXT_FX_LINEAR,
+};
 
-            byte = (yt * src_width * src_channels) + (xt * src_channels);
-            assert(byte < (src_width * src_height * src_channels));
+static const char * const lua_image_fx_shapes[] = {
+    "sine",
+    "triangle",
+    "square",
+    "saw",
+    "linear",
+    NULL,
+};
 
-            if(src_channels == 4) {
-                a = image_two[byte + 3];
+/* a per-letter curve, offset + amplitude * shape(phase + step * i),
+ * i counting letters from 0. periodic shapes repeat every 2 pi */
+typedef struct text_fx_curve {
+    unsigned int active;
+    unsigned int shape;
+    lua_Number amplitude;
+    lua_Number step;
+    lua_Number phase;
+    lua_Number offset;
+} text_fx_curve;
+
+/* positions and offsets from fx are clamped to this, so adding a few of
+ * them up stays inside an int */
+#define LUA_IMAGE_FX_MAX (INT_MAX / 4)
+
+static lua_Number
+lua_image_fx_number(lua_State *L, int idx, const char *key, lua_Number def) {
+    lua_Number n = def;
+    lua_getfield(L,idx,key);
+    if(lua_type(L,-1) == LUA_TNUMBER) n = lua_tonumber(L,-1);
+    lua_pop(L,1);
+    if(!isfinite(n)) {
+        luaL_error(L,"%s must be a finite number",key);
+    }
+    return n;
+}
+
+/* reads a curve from field key of the table at idx, a plain number is
+ * a constant offset */
+static void
+lua_image_fx_curve(lua_State *L, int idx, const char *key, text_fx_curve *c) {
+    const char *shape = NULL;
+    unsigned int i = 0;
+
+    memset(c,0,sizeof(text_fx_curve));
+    lua_getfield(L,idx,key);
+    if(lua_type(L,-1) == LUA_TNUMBER) {
+        c->active = 1;
+        c->shape = TEXT_FX_LINEAR;
+        c->offset = lua_tonumber(L,-1);
+        if(!isfinite(c->offset)) {
+            luaL_error(L,"%s must be a finite number",key);
+        }
+    }
+    else if(lua_istable(L,-1)) {
+        c->active = 1;
+        c->amplitude = lua_image_fx_number(L,-1,"amplitude",1);
+        c->step = lua_image_fx_number(L,-1,"step",0);
+        c->phase = lua_image_fx_number(L,-1,"phase",0);
+        c->offset = lua_image_fx_number(L,-1,"offset",0);
+        lua_getfield(L,-1,"shape");
+        shape = lua_tostring(L,-1);
+        if(shape != NULL) {
+            for(i=0;lua_image_fx_shapes[i] != NULL;i++) {
+                if(strcmp(shape,lua_image_fx_shapes[i]) == 0) break;
             }
-            else {
-                a = 255;
+            if(lua_image_fx_shapes[i] == NULL) {
+                luaL_error(L,"unknown shape %s for %s",shape,key);
             }
+            c->shape = i;
+        }
+        lua_pop(L,1);
+    }
+    lua_pop(L,1);
+}
 
-            if(a == 0) {
-                continue;
-            }
+static lua_Number
+lua_image_fx_eval(const text_fx_curve *c, lua_Number phase, unsigned int i) {
+    lua_Number t = 0;
+    lua_Number v = 0;
+
+    if(!c->active) return 0;
+    if(c->shape == TEXT_FX_LINEAR && c->amplitude == 0) return c->offset;
+
+    t = phase + c->phase + (c->step * i);
+    switch(c->shape) {
+        case TEXT_FX_TRIANGLE: v = asin(sin(t)) * 2 / M_PI; break;
+        case TEXT_FX_SQUARE: v = sin(t) < 0 ? -1 : 1; break;
+        case TEXT_FX_SAW: v = t / (2 * M_PI); v = 2 * (v - floor(v + 0.5)); break;
+        case TEXT_FX_LINEAR: v = t; break;
+        default: v = sin(t);
+    }
+    return c->offset + (c->amplitude * v);
+}
 
-            b = image_two[byte];
-            g = image_two[byte + 1];
-            r = image_two[byte + 2];
+static int
+lua_image_stamp_string_fx(lua_State *L) {
+    /* frame:stamp_string_fx(str,fx) */
+    image_frame f;
+    font *fnt = NULL;
+    const font_glyph *glyph = NULL;
+    const char *str = NULL;
+    const char *end = NULL;
+    size_t len = 0;
+    uint32_t codepoint = 0;
+    unsigned int i = 0;
+    int use_hsl = 0;
+    int has_max = 0;
+    int has_lmask = 0;
+    int lmask_applied = 0;
+    lua_Integer scale = 0;
+    lua_Integer gscale = 0;
+    lua_Integer x = 0;
+    lua_Integer xi = 0;
+    lua_Integer y = 0;
+    lua_Integer r = 255;
+    lua_Integer g = 255;
+    lua_Integer b = 255;
+    lua_Integer a = 255;
+    lua_Integer cw = 0;
+    lua_Integer dx = 0;
+    lua_Integer dy = 0;
+    lua_Number phase = 0;
+    lua_Number hue = 0;
+    lua_Number hue_step = 0;
+    lua_Number saturation = 0;
+    lua_Number lightness = 0;
+    lua_Number max = 0;
+    lua_Number lmask = 0;
+    lua_Number rmask = 0;
+    lua_Number tmask = 0;
+    lua_Number bmask = 0;
+    text_fx_curve cdx;
+    text_fx_curve cdy;
+    text_fx_curve csize;
+
+    if(!luaimage_get_frame(L,1,&f)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Missing argument self");
+        return 2;
+    }
+    str = luaL_checklstring(L,2,&len);
+    end = str + len;
+    luaL_checktype(L,3,LUA_TTABLE);
 
-            if(aa > -1 && a > 0) {
-                a = aa;
-            }
+    lua_getfield(L,3,"font");
+    fnt = luafont_check_font(L,-1);
+    lua_pop(L,1);
 
-            byte = (dyt * width * channels) + (dxt * channels);
-            assert(byte < (width * height * channels));
+    scale = lua_image_fx_int(lua_image_fx_number(L,3,"scale",1),-FONT_SCALE_MAX,FONT_SCALE_MAX);
+    x = xi = lua_image_fx_int(lua_image_fx_number(L,3,"x",1),-LUA_IMAGE_FX_MAX,LUA_IMAGE_FX_MAX);
+    y = lua_image_fx_int(lua_image_fx_number(L,3,"y",1),-LUA_IMAGE_FX_MAX,LUA_IMAGE_FX_MAX);
+    /* out of range colours stay out of range, so they aren't drawn */
+    r = lua_image_fx_int(lua_image_fx_number(L,3,"r",255),-1,256);
+    g = lua_image_fx_int(lua_image_fx_number(L,3,"g",255),-1,256);
+    b = lua_image_fx_int(lua_image_fx_number(L,3,"b",255),-1,256);
+    a = lua_image_fx_int(lua_image_fx_number(L,3,"alpha",255),0,255);
+    phase = lua_image_fx_number(L,3,"phase",0);
+
+    lua_getfield(L,3,"hue");
+    use_hsl = lua_type(L,-1) == LUA_TNUMBER;
+    lua_pop(L,1);
+    hue = lua_image_fx_number(L,3,"hue",0);
+    hue_step = lua_image_fx_number(L,3,"hue_step",0);
+    saturation = lua_image_fx_number(L,3,"saturation",100);
+    lightness = lua_image_fx_number(L,3,"lightness",50);
 
-            if(a == 255) {
-                image_one[byte] = b;
-                image_one[byte+1] = g;
-                image_one[byte+2] = r;
-                continue;
-            }
-            alpha = 1 + a;
-            alpha_inv = 256 - a;
+    lua_getfield(L,3,"max");
+    has_max = lua_type(L,-1) == LUA_TNUMBER;
+    lua_pop(L,1);
+    max = lua_image_fx_number(L,3,"max",0);
+    lua_getfield(L,3,"lmask");
+    has_lmask = lua_type(L,-1) == LUA_TNUMBER;
+    lua_pop(L,1);
+    lmask = lua_image_fx_number(L,3,"lmask",0);
+    tmask = lua_image_fx_number(L,3,"tmask",0);
+    bmask = lua_image_fx_number(L,3,"bmask",0);
+    lmask_applied = !has_lmask;
+
+    lua_image_fx_curve(L,3,"dx",&cdx);
+    lua_image_fx_curve(L,3,"dy",&cdy);
+    lua_image_fx_curve(L,3,"size",&csize);
+
+    for(i=0;str < end;i++) {
+        codepoint = font_utf8_next(&str,end);
+        glyph = font_glyph_find(fnt,codepoint);
+        if(glyph == NULL) glyph = font_glyph_find(fnt,32);
+
+        /* curves can run far out of range even from finite fields */
+        gscale = scale + lua_image_fx_int(ceil(lua_image_fx_eval(&csize,phase,i)),
+          -FONT_SCALE_MAX,FONT_SCALE_MAX);
+        if(gscale < 1) gscale = 1;
+        if(gscale > FONT_SCALE_MAX) gscale = FONT_SCALE_MAX;
+        cw = glyph == NULL ? 0 : glyph->width * gscale;
+
+        /* lmask and max work like stamp_string, on the undisplaced letters */
+        if(has_lmask && lmask >= cw) {
+            lmask -= cw;
+            xi += cw;
+            continue;
+        }
+        if(has_max && xi >= max) break;
 
-            image_one[byte]   = ((image_one[byte]   * alpha_inv) + (b * alpha)) >> 8;
-            image_one[byte+1] = ((image_one[byte+1] * alpha_inv) + (g * alpha)) >> 8;
-            image_one[byte+2] = ((image_one[byte+2] * alpha_inv) + (r * alpha)) >> 8;
+        rmask = has_max && xi + cw > max ? cw - (max - xi) : 0;
+        if(use_hsl) {
+            lua_image_hsl_to_rgb(hue + (hue_step * i),saturation,lightness,&r,&g,&b);
+        }
+        dx = lua_image_fx_int(ceil(lua_image_fx_eval(&cdx,phase,i)),-LUA_IMAGE_FX_MAX,LUA_IMAGE_FX_MAX);
+        dy = lua_image_fx_int(ceil(lua_image_fx_eval(&cdy,phase,i)),-LUA_IMAGE_FX_MAX,LUA_IMAGE_FX_MAX);
+
+        lua_image_stamp_glyph(L,&f,NULL,fnt,codepoint,gscale,xi + dx,y + dy,r,g,b,(uint8_t)a,
+          (lmask_applied ? 0 : lmask),
+          rmask,tmask * gscale,bmask * gscale);
+        xi += cw;
+        if(!lmask_applied) {
+            lmask_applied = 1;
+            lmask = 0;
         }
     }
 
+    lua_pushinteger(L,xi - x);
+    return 1;
+}
+
+static int
+lua_image_new_batch(lua_State *L) {
+    lua_image_batch *b = lua_newuserdata(L,sizeof(lua_image_batch));
+    b->cmds = NULL;
+    b->len = 0;
+    b->size = 0;
+    lua_newtable(L);
+    b->sources = luaL_ref(L,LUA_REGISTRYINDEX);
+    luaL_getmetatable(L,"image_batch");
+    lua_setmetatable(L,-2);
+    return 1;
+}
+
+static int
+lua_image_batch_draw_rectangle(lua_State *L) {
+    lua_image_batch *b = luaL_checkudata(L,1,"image_batch");
+    image_cmd *c = NULL;
+
+    lua_Integer x1 = luaL_checkinteger(L,2);
+    lua_Integer y1 = luaL_checkinteger(L,3);
+    lua_Integer x2 = luaL_checkinteger(L,4);
+    lua_Integer y2 = luaL_checkinteger(L,5);
+    lua_Integer r = luaL_checkinteger(L,6);
+    lua_Integer g = luaL_checkinteger(L,7);
+    lua_Integer bl = luaL_checkinteger(L,8);
+    lua_Integer a = luaL_optinteger(L,9,255);
+
+    if(r > 255 || bl > 255 || g > 255 || a > 255 ||
+       r < 0   || bl < 0   || g < 0 || a < 0 ) {
+        lua_pushboolean(L,0);
+        return 1;
+    }
+
+    if(a == 0) {
+        lua_pushboolean(L,1);
+        return 1;
+    }
+
+    c = lua_image_batch_push(b);
+    if(c == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Out of memory");
+        return 2;
+    }
+
+    c->type = IMAGE_CMD_RECTANGLE;
+    c->x1 = x1;
+    c->y1 = y1;
+    c->x2 = x2;
+    c->y2 = y2;
+    c->r = r;
+    c->g = g;
+    c->b = bl;
+    c->a = a;
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+lua_image_batch_set_pixel(lua_State *L) {
+    lua_image_batch *b = luaL_checkudata(L,1,"image_batch");
+    image_cmd *c = NULL;
+
+    lua_Integer x = luaL_checkinteger(L,2);
+    lua_Integer y = luaL_checkinteger(L,3);
+    lua_Integer r = luaL_checkinteger(L,4);
+    lua_Integer g = luaL_checkinteger(L,5);
+    lua_Integer bl = luaL_checkinteger(L,6);
+    lua_Integer a = luaL_optinteger(L,7,255);
+
+    if(r > 255 || bl > 255 || g > 255 || a > 255 ||
+       r < 0   || bl < 0   || g < 0 || a < 0 ) {
+        lua_pushboolean(L,0);
+        return 1;
+    }
+
+    if(a == 0) {
+        lua_pushboolean(L,1);
+        return 1;
+    }
+
+    c = lua_image_batch_push(b);
+    if(c == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Out of memory");
+        return 2;
+    }
+
+    c->type = IMAGE_CMD_PIXEL;
+    c->x1 = x;
+    c->y1 = y;
+    c->r = r;
+    c->g = g;
+    c->b = bl;
+    c->a = a;
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+lua_image_batch_stamp_image(lua_State *L) {
+    lua_image_batch *b = luaL_checkudata(L,1,"image_batch");
+    image_cmd c;
+    image_cmd *t = NULL;
+
+    if(!lua_istable(L,2) && !lua_isuserdata(L,2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Missing argument src");
+        return 2;
+    }
+
+    if(!lua_image_stamp_args(L,2,&c)) {
+        lua_pushboolean(L,0);
+        return 1;
+    }
+
+    t = lua_image_batch_push(b);
+    if(t == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Out of memory");
+        return 2;
+    }
+    *t = c;
+
+    lua_rawgeti(L,LUA_REGISTRYINDEX,b->sources);
+    lua_pushvalue(L,2);
+    lua_rawseti(L,-2,b->len);
+    lua_pop(L,1);
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+lua_image_batch_stamp_letter(lua_State *L) {
+    return lua_image_letter(L,NULL,luaL_checkudata(L,1,"image_batch"));
+}
+
+static int
+lua_image_batch_stamp_string(lua_State *L) {
+    return lua_image_string(L,NULL,luaL_checkudata(L,1,"image_batch"));
+}
+
+static int
+lua_image_batch_clear(lua_State *L) {
+    lua_image_batch *b = luaL_checkudata(L,1,"image_batch");
+    lua_image_batch_release(b);
+    b->len = 0;
+    luaL_unref(L,LUA_REGISTRYINDEX,b->sources);
+    lua_newtable(L);
+    b->sources = luaL_ref(L,LUA_REGISTRYINDEX);
+    return 0;
+}
+
+static int
+lua_image_batch_count(lua_State *L) {
+    lua_image_batch *b = luaL_checkudata(L,1,"image_batch");
+    lua_pushinteger(L,b->len);
+    return 1;
+}
+
+static int
+lua_image_batch_gc(lua_State *L) {
+    lua_image_batch *b = luaL_checkudata(L,1,"image_batch");
+    lua_image_batch_release(b);
+    free(b->cmds);
+    b->cmds = NULL;
+    b->len = 0;
+    b->size = 0;
+    luaL_unref(L,LUA_REGISTRYINDEX,b->sources);
+    b->sources = LUA_NOREF;
     return 0;
+}
+
+static int
+lua_image_draw_batch(lua_State *L) {
+    image_frame f;
+    uint8_t *image = NULL;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int channels = 0;
+    lua_image_batch *b = NULL;
+
+    if(!luaimage_get_frame(L,1,&f)) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"Missing argument self");
+        return 2;
+    }
+
+    b = luaL_checkudata(L,2,"image_batch");
+
+    image = f.image;
+    width = f.width;
+    height = f.height;
+    channels = f.channels;
 
+    if(image == NULL) {
+        lua_pushboolean(L,0);
+        return 1;
+    }
+
+    image_draw(image,width,height,channels,b->cmds,b->len);
+
+    lua_pushboolean(L,1);
+    return 1;
 }
 
 static int
@@ -1091,9 +2133,31 @@ static const struct luaL_Reg lua_image_image_methods[] = {
     { "set_pixel", lua_image_set_pixel },
     { "get_pixel", lua_image_get_pixel },
     { "draw_rectangle", lua_image_draw_rectangle },
+    { "draw_linear_gradient", lua_image_draw_linear_gradient },
+    { "draw_radial_gradient", lua_image_draw_radial_gradient },
+    { "draw_line", lua_image_draw_line },
+    { "draw_polyline", lua_image_draw_polyline },
+    { "draw_polygon", lua_image_draw_polygon },
+    { "draw_circle", lua_image_draw_circle },
+    { "draw_arc", lua_image_draw_arc },
     { "set", lua_image_set },
     { "blend", lua_image_blend },
     { "stamp_image", lua_image_stamp_image },
+    { "stamp_letter", lua_image_stamp_letter },
+    { "stamp_string", lua_image_stamp_string },
+    { "stamp_string_fx", lua_image_stamp_string_fx },
+    { "draw_batch", lua_image_draw_batch },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg lua_image_batch_methods[] = {
+    { "draw_rectangle", lua_image_batch_draw_rectangle },
+    { "set_pixel", lua_image_batch_set_pixel },
+    { "stamp_image", lua_image_batch_stamp_image },
+    { "stamp_letter", lua_image_batch_stamp_letter },
+    { "stamp_string", lua_image_batch_stamp_string },
+    { "clear", lua_image_batch_clear },
+    { "count", lua_image_batch_count },
     { NULL, NULL },
 };
 
@@ -1107,6 +2171,8 @@ static const struct luaL_Reg lua_image_instance_methods[] = {
 static const struct luaL_Reg lua_image_methods[] = {
     { "new"           , lua_image_new },
     { "from_ref"      , lua_image_from_ref },
+    { "batch"         , lua_image_new_batch },
+    { "frame"         , lua_image_new_frame },
     { NULL     , NULL                },
 };
 
@@ -1137,9 +2203,29 @@ int luaimage_stop_threads(void) {
 
 int luaopen_image(lua_State *L,void *vis) {
     luaL_newmetatable(L,"image");
+    lua_pushcfunction(L,lua_image_frame_index);
+    lua_setfield(L,-2,"__index");
+    lua_pushcfunction(L,lua_image_frame_newindex);
+    lua_setfield(L,-2,"__newindex");
     lua_newtable(L);
     luaL_setfuncs(L,lua_image_image_methods,0);
+    lua_setfield(L,-2,"methods");
+
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushliteral(L,"k");
+    lua_setfield(L,-2,"__mode");
+    lua_setmetatable(L,-2);
+    lua_setfield(L,LUA_REGISTRYINDEX,"image_fields");
+
+    luaL_newmetatable(L,"image_batch");
+    lua_newtable(L);
+    luaL_setfuncs(L,lua_image_batch_methods,0);
     lua_setfield(L,-2,"__index");
+    lua_pushcfunction(L,lua_image_batch_gc);
+    lua_setfield(L,-2,"__gc");
+    lua_pushcfunction(L,lua_image_batch_count);
+    lua_setfield(L,-2,"__len");
 
     luaL_newmetatable(L,"image_c");
     lua_newtable(L);
@@ -2,6 +2,7 @@
 #define LUA_IMAGE_H
 
 #include <lua.h>
+#include <stdint.h>
 #include "thread.h"
 
 enum IMAGE_STATE {
@@ -12,6 +13,18 @@ enum IMAGE_STATE {
     IMAGE_FIXED,
 };
 
+/* a frame, one drawable image. full userdata with the "image" metatable,
+ * its pixels either follow this header (owned) or belong to someone else */
+typedef struct image_frame {
+    uint8_t *image;
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels;
+    unsigned int stride;
+    unsigned int image_len;
+    unsigned int owned;
+} image_frame;
+
 typedef struct image_q {
     int table_ref;
     char *filename;
@@ -41,6 +54,19 @@ queue_image_load(intptr_t table_ref,const char* filename, unsigned int width, un
 
 void wake_queue(void);
 
+/* pushes a new frame, copying image into it unless it's NULL */
+image_frame *
+luaimage_new_frame(lua_State *L, unsigned int width, unsigned int height, unsigned int channels, const uint8_t *image);
+
+/* pushes a frame that draws into someone else's memory */
+image_frame *
+luaimage_wrap_frame(lua_State *L, uint8_t *image, unsigned int width, unsigned int height, unsigned int channels);
+
+/* reads the frame at idx into f. tables with image, width, height and
+ * channels fields are accepted too */
+int
+luaimage_get_frame(lua_State *L, int idx, image_frame *f);
+
 int
 luaimage_setup_threads(thread_queue_t *ret);
 
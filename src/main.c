@@ -16,10 +16,21 @@
                "  -c channels\n" \
                "  -s samplesize (in bytes)\n" \
                "  -b number of visualizer bars to calculate\n" \
+               "  -x (blackman-harris|blackman|hann|none) window function\n" \
+               "  -N minimum FFT size\n" \
+               "  -L lowest frequency (in Hz)\n" \
+               "  -H highest frequency (in Hz)\n" \
+               "  -S (log|linear) bar scale\n" \
+               "  -e (fft|cqt) analysis engine\n" \
+               "  -n analysis hops per frame\n" \
+               "  -g (max|mean) how hops are combined\n" \
+               "  -d frames of look-ahead\n" \
                "  -i /path/to/input\n" \
                "  -o /path/to/output\n" \
                "  -l /path/to/lua/scripts\n" \
                "  -m (1|0) enable/disable mpd\n" \
+               "  -W /path/to/fftw/wisdom\n" \
+               "  -p (estimate|measure|patient) FFTW planning effort\n" \
                "Following options only valid when -m=0\n" \
                "  -t title\n" \
                "  -a artist\n" \
@@ -39,7 +50,7 @@ int main(int argc, char const *const *argv) {
 
     subgetopt_t l = SUBGETOPT_ZERO;
 
-    while((opt = subgetopt_r(argc,argv,":w:h:f:r:c:s:b:i:o:l:m:t:a:A:F:T:",&l)) != -1 ) {
+    while((opt = subgetopt_r(argc,argv,":w:h:f:r:c:s:b:x:N:L:H:S:e:n:g:d:i:o:l:m:W:p:t:a:A:F:T:",&l)) != -1 ) {
         switch(opt) {
             case 'w': {
                 if(!uint_scan(l.arg,&(vis->video_width))) dieusage();
@@ -63,6 +74,45 @@ int main(int argc, char const *const *argv) {
             }
             case 'b': {
                 if(!uint_scan(l.arg,&(vis->bars))) dieusage();
+                if(vis->bars == 0 || vis->bars > AUDIO_BARS_MAX) dieusage();
+                break;
+            }
+            case 'x': {
+                if(!audio_window_scan(l.arg,&(vis->window))) dieusage();
+                break;
+            }
+            case 'N': {
+                if(!uint_scan(l.arg,&(vis->fft_len))) dieusage();
+                break;
+            }
+            case 'L': {
+                if(!uint_scan(l.arg,&(vis->freq_min))) dieusage();
+                break;
+            }
+            case 'H': {
+                if(!uint_scan(l.arg,&(vis->freq_max))) dieusage();
+                break;
+            }
+            case 'S': {
+                if(!audio_scale_scan(l.arg,&(vis->scale))) dieusage();
+                break;
+            }
+            case 'e': {
+                if(!audio_engine_scan(l.arg,&(vis->engine))) dieusage();
+                break;
+            }
+            case 'n': {
+                if(!uint_scan(l.arg,&(vis->hops))) dieusage();
+                if(vis->hops == 0 || vis->hops > AUDIO_HOPS_MAX) dieusage();
+                break;
+            }
+            case 'g': {
+                if(!audio_hop_mode_scan(l.arg,&(vis->hop_mode))) dieusage();
+                break;
+            }
+            case 'd': {
+                if(!uint_scan(l.arg,&(vis->lookahead))) dieusage();
+                if(vis->lookahead > AUDIO_LOOKAHEAD_MAX) dieusage();
                 break;
             }
             case 's': {
@@ -74,6 +124,25 @@ int main(int argc, char const *const *argv) {
                 if(vis->mpd > 1) dieusage();
                 break;
             }
+            case 'W': {
+                vis->wisdom_file = l.arg;
+                break;
+            }
+            case 'p': {
+                if(strcmp(l.arg,"estimate") == 0) {
+                    vis->plan_effort = AUDIO_PLAN_ESTIMATE;
+                }
+                else if(strcmp(l.arg,"measure") == 0) {
+                    vis->plan_effort = AUDIO_PLAN_MEASURE;
+                }
+                else if(strcmp(l.arg,"patient") == 0) {
+                    vis->plan_effort = AUDIO_PLAN_PATIENT;
+                }
+                else {
+                    dieusage();
+                }
+                break;
+            }
             case 'i': {
                 vis->input_fifo = l.arg;
                 break;
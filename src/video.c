@@ -38,9 +38,48 @@ avi_stream_free(avi_stream *stream) {
         ringbuf_free(&(stream->frames));
     }
 
+    if(stream->audio_delay) {
+        free(stream->audio_delay);
+    }
+
     return 0;
 }
 
+int
+avi_stream_delay(avi_stream *stream, unsigned int frames) {
+    uint8_t *d = NULL;
+
+    if(frames) {
+        /* starts out silent */
+        d = (uint8_t *)malloc(frames * stream->audio_frame_len);
+        if(!d) return 0;
+        memset(d,0,frames * stream->audio_frame_len);
+    }
+
+    if(stream->audio_delay) free(stream->audio_delay);
+    stream->audio_delay = d;
+    stream->audio_delay_len = frames;
+    stream->audio_delay_pos = 0;
+    return 1;
+}
+
+void
+avi_stream_audio(avi_stream *stream, const uint8_t *chunk) {
+    uint8_t *slot = NULL;
+
+    if(!stream->audio_delay_len) {
+        memcpy(stream->audio_frame,chunk,stream->audio_frame_len);
+        return;
+    }
+
+    /* the oldest chunk is copied out to the frame, the new one is
+     * copied into its slot */
+    slot = stream->audio_delay + (stream->audio_delay_pos * stream->audio_frame_len);
+    memcpy(stream->audio_frame,slot,stream->audio_frame_len);
+    memcpy(slot,chunk,stream->audio_frame_len);
+    stream->audio_delay_pos = (stream->audio_delay_pos + 1) % stream->audio_delay_len;
+}
+
 int
 avi_stream_init(
   avi_stream *stream,
@@ -28,6 +28,13 @@ typedef struct avi_stream {
     char *input_frame;
     char *output_frame;
     ringbuf_t frames;
+
+    /* audio chunks held back for look-ahead, as a ring separate from
+     * frames. each chunk is copied in, and copied out into audio_frame
+     * audio_delay_len frames later */
+    unsigned int audio_delay_len; /* in frames, 0 when disabled */
+    unsigned int audio_delay_pos;
+    uint8_t *audio_delay; /* audio_delay[audio_delay_len * audio_frame_len] */
 } avi_stream;
 
 #define AVI_STREAM_ZERO { \
@@ -48,6 +55,9 @@ typedef struct avi_stream {
   .input_frame = NULL, \
   .frames = NULL, \
   .output_frame_rem = 0, \
+  .audio_delay_len = 0, \
+  .audio_delay_pos = 0, \
+  .audio_delay = NULL, \
 }
 
 #ifdef __cplusplus
@@ -70,6 +80,15 @@ avi_stream_write_header(avi_stream *stream, void *ctx, size_t(*w)(uint8_t *buf,
 int
 avi_stream_free(avi_stream *stream);
 
+/* holds audio back by frames frames, to line it up with
+ * video drawn from an analysis that runs ahead */
+int
+avi_stream_delay(avi_stream *stream, unsigned int frames);
+
+/* fills the next frame's audio, from chunk or the delay line */
+void
+avi_stream_audio(avi_stream *stream, const uint8_t *chunk);
+
 #ifdef __cplusplus
 }
 #endif
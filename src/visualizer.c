@@ -18,12 +18,12 @@
 #include "audio.h"
 #include "visualizer-int.h"
 #include "stream.lua.lh"
-#include "font.lua.lh"
 #include "tinydir.h"
 #include "image.h"
 #include "lua-audio.h"
 #include "lua-image.h"
 #include "lua-file.h"
+#include "lua-font.h"
 #include "ringbuf.h"
 
 #define func_list_len(g) genalloc_len(lua_func_list,g)
@@ -629,10 +629,10 @@ visualizer_make_frames(visualizer *vis) {
         if(vis->processor.firstflag == 0) {
             vis->processor.firstflag = 1;
         }
+        luaaudio_update(vis->Lua,&(vis->processor));
+        vis->processor.reconfigured = 0;
 
-        memcpy(vis->stream.audio_frame,
-               vis->processor.output_buffer,
-               vis->stream.audio_frame_len);
+        avi_stream_audio(&(vis->stream),(const uint8_t *)vis->processor.output_buffer);
 
         memset(vis->stream.video_frame,0,vis->stream.video_frame_len);
 
@@ -784,13 +784,29 @@ visualizer_init(visualizer *vis) {
     vis->processor.channels     = vis->channels;
     vis->processor.samplerate   = vis->samplerate;
     vis->processor.samplesize   = vis->samplesize;
-    vis->processor.spectrum_len = vis->bars;
+    vis->processor.config.spectrum_len = vis->bars;
+    vis->processor.config.window       = vis->window;
+    vis->processor.config.scale        = vis->scale;
+    vis->processor.config.engine       = vis->engine;
+    vis->processor.config.hops         = vis->hops;
+    vis->processor.config.hop_mode     = vis->hop_mode;
+    vis->processor.config.freq_min     = vis->freq_min;
+    vis->processor.config.freq_max     = vis->freq_max;
+    vis->processor.config.fft_len      = vis->fft_len;
+    vis->processor.wisdom_file  = vis->wisdom_file;
+    vis->processor.plan_effort  = vis->plan_effort;
 
     if(!audio_processor_init(&(vis->processor))) {
         strerr_warn1x("error: unable to initialize audio processor");
         return visualizer_free(vis);
     }
 
+    if(!avi_stream_delay(&(vis->stream),vis->lookahead) ||
+       !audio_processor_lookahead(&(vis->processor),vis->lookahead)) {
+        strerr_warn1x("error: unable to set up look-ahead");
+        return visualizer_free(vis);
+    }
+
     vis->fds[0].fd = selfpipe_init();
     vis->fds[0].events = IOPAUSE_READ | IOPAUSE_EXCEPT;
 
@@ -825,16 +841,7 @@ visualizer_init(visualizer *vis) {
     luaL_openlibs(vis->Lua);
     luaopen_image(vis->Lua,vis);
     luaopen_file(vis->Lua);
-
-    if(luaL_loadbuffer(vis->Lua,font_lua,font_lua_length-1,"font.lua")) {
-        strerr_die2x(1,"error: ",lua_tostring(vis->Lua,-1));
-    }
-
-    if(lua_pcall(vis->Lua,0,1,0)) {
-        strerr_die2x(1,"error: ",lua_tostring(vis->Lua,-1));
-    }
-
-    lua_setglobal(vis->Lua,"font");
+    luaopen_font(vis->Lua);
     lua_settop(vis->Lua,0);
 
     lua_newtable(vis->Lua);
@@ -872,25 +879,11 @@ visualizer_init(visualizer *vis) {
     lua_setglobal(vis->Lua,"song");
     lua_settop(vis->Lua,0);
 
-    lua_getglobal(vis->Lua,"image");
-    lua_getfield(vis->Lua,-1,"new");
-    lua_pushnil(vis->Lua);
-    lua_pushinteger(vis->Lua,vis->video_width);
-    lua_pushinteger(vis->Lua,vis->video_height);
-    lua_pushinteger(vis->Lua,3);
-    if(lua_pcall(vis->Lua,4,1,0)) {
-        strerr_die2x(1,"error: ",lua_tostring(vis->Lua,-1));
-    }
-
-    lua_getfield(vis->Lua,-1,"frames");
-    lua_rawgeti(vis->Lua,-1,1);
+    luaimage_wrap_frame(vis->Lua,vis->stream.video_frame,vis->video_width,vis->video_height,3);
 
     lua_pushinteger(vis->Lua,vis->framerate);
     lua_setfield(vis->Lua,-2,"framerate");
 
-    lua_pushlightuserdata(vis->Lua,vis->stream.video_frame);
-    lua_setfield(vis->Lua,-2,"image");
-
     lua_newtable(vis->Lua);
     lua_pushvalue(vis->Lua,-2);
     lua_setfield(vis->Lua,-2,"video");
@@ -1156,6 +1149,8 @@ visualizer_loop(visualizer *vis) {
 
 int visualizer_cleanup(visualizer *vis) {
     int draining = 0;
+    unsigned int flush = vis->lookahead;
+    unsigned int used = 0;
     if(vis->fds[2].fd != -1) {
         draining = 1;
         while(draining) {
@@ -1164,7 +1159,15 @@ int visualizer_cleanup(visualizer *vis) {
                 draining = 0;
             }
             visualizer_make_frames(vis);
-            if(ringbuf_bytes_used(vis->processor.samples) < vis->processor.output_buffer_len &&
+            used = ringbuf_bytes_used(vis->processor.samples);
+            /* pad with silence to push the look-ahead's audio out */
+            if(flush && used < vis->processor.output_buffer_len) {
+                ringbuf_memset(vis->processor.samples,0,vis->processor.output_buffer_len - used);
+                vis->processor.samples_available = vis->processor.sample_window_len;
+                used = vis->processor.output_buffer_len;
+                flush--;
+            }
+            if(used < vis->processor.output_buffer_len &&
                ringbuf_bytes_used(vis->stream.frames) < vis->stream.frame_len) {
                 draining = 0;
             }
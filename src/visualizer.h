@@ -24,6 +24,15 @@ typedef struct visualizer {
     unsigned int channels;
     unsigned int samplesize;
     unsigned int bars;
+    unsigned int window;
+    unsigned int scale;
+    unsigned int engine;
+    unsigned int hops;
+    unsigned int hop_mode;
+    unsigned int lookahead; /* frames the analysis runs ahead of the output */
+    unsigned int fft_len;
+    unsigned int freq_min;
+    unsigned int freq_max;
     unsigned int mpd;
     unsigned int ms_per_frame;
     uint64_t elapsed_ms;
@@ -32,6 +41,8 @@ typedef struct visualizer {
     const char *lua_folder;
     const char *input_fifo;
     const char *output_fifo;
+    const char *wisdom_file;
+    unsigned int plan_effort;
     genalloc lua_funcs;
     lua_State *Lua;
     thread_queue_t image_queue;
@@ -59,6 +70,8 @@ typedef struct visualizer {
   .processor = AUDIO_PROCESSOR_ZERO, \
   .lua_folder = NULL, \
   .output_fifo = NULL, \
+  .wisdom_file = NULL, \
+  .plan_effort = AUDIO_PLAN_MEASURE, \
   .lua_funcs = GENALLOC_ZERO, \
   .Lua = NULL, \
   .lua_image_cb = NULL, \
@@ -78,6 +91,15 @@ typedef struct visualizer {
   .channels = 0, \
   .samplesize = 0, \
   .bars = 0, \
+  .window = AUDIO_WINDOW_BLACKMAN_HARRIS, \
+  .scale = AUDIO_SCALE_LOG, \
+  .engine = AUDIO_ENGINE_FFT, \
+  .hops = 1, \
+  .hop_mode = AUDIO_HOP_MAX, \
+  .lookahead = 0, \
+  .fft_len = 4096, \
+  .freq_min = 50, \
+  .freq_max = 10000, \
   .mpd = 1, \
   .totaltime = -1, \
   .elapsed_ms = 0, \